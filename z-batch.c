@@ -0,0 +1,626 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Headless batch processing of .mul files, without GTK or a display.
+ *
+ * Every channel of the given files (and of the .mul files in the given
+ * directories) is plane leveled like Level All does it and written to the
+ * output directory as <file>-<channel>.gsf, together with a grayscale
+ * thumbnail <file>-<channel>.png. Files of the same name from different
+ * directories are told apart by their whole path, see batch_name_files().
+ * The files are processed in parallel by a thread pool with one thread per
+ * core (--jobs), every thread holds a single channel at a time.
+ *
+ * With --sheet, all channels are also put on a contact sheet, see z-sheet.c.
+ * Its tiles are rendered from the previews of the files, so the sheet is
+ * streamed to disk like in the overviews.
+ *
+ * With --drift, the images are instead taken as the frames of one series and
+ * drift corrected like in the Drift Correction window, see batch_drift().
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libprocess/datafield.h>
+#include <libprocess/gwyprocess.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "z-io.h"
+#include "z-kernels.h"
+#include "z-sheet.h"
+
+typedef struct {
+  const gchar *output;
+  gboolean data;
+  gboolean thumbnails;
+  gboolean sheet;
+  gint n_failed;
+} Batch;
+
+typedef struct {
+  const gchar *filename;
+  gchar *stem; // start of the output names
+  MulImageInfo *labels; // without previews, only kept for the sheet
+  gint n_labels;
+} BatchFile;
+
+typedef struct {
+  BatchFile *file;
+  gint index;
+} BatchTile;
+
+/* Renders the leveled data in grayscale over the range of the leveled field,
+ * like the thumbnails of the overviews with the default palette */
+static gboolean batch_write_thumbnail(const gchar *filename,
+                                      const gdouble *data, gint xres,
+                                      gint yres, const LevelResult *level) {
+  // The pixbuf loaders are loaded on first use
+  static GMutex save_lock;
+  gint width, height;
+
+  thumbnail_size(xres, yres, &width, &height);
+  gdouble *thumb = g_new(gdouble, (gsize)width * height);
+  decimate_buffer(data, xres, yres, thumb, width, height);
+
+  GdkPixbuf *pixbuf =
+      gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+  gint rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  gdouble range = level->max - level->min;
+  gdouble scale = range > 0.0 ? 255.999 / range : 0.0;
+  for (gint i = 0; i < height; i++) {
+    guchar *pixel = pixels + (gsize)i * rowstride;
+    for (gint j = 0; j < width; j++) {
+      gdouble v = (thumb[(gsize)i * width + j] - level->min) * scale;
+      guchar gray = (guchar)CLAMP(v, 0.0, 255.0);
+      pixel[3 * j] = pixel[3 * j + 1] = pixel[3 * j + 2] = gray;
+    }
+  }
+  g_free(thumb);
+
+  GError *error = NULL;
+  g_mutex_lock(&save_lock);
+  gboolean ok = gdk_pixbuf_save(pixbuf, filename, "png", &error, NULL);
+  g_mutex_unlock(&save_lock);
+  if (!ok) {
+    fprintf(stderr, "Can't write %s: %s\n", filename,
+            error ? error->message : "unknown error");
+    g_clear_error(&error);
+  }
+  g_object_unref(pixbuf);
+  return ok;
+}
+
+/* Levels and writes one channel, the field is reused for all channels of the
+ * same size */
+static gboolean batch_process_channel(Batch *batch, const gchar *filename,
+                                      const gchar *stem,
+                                      const MulImageInfo *info, gint index,
+                                      GwyDataField **data_field) {
+  if (!*data_field ||
+      gwy_data_field_get_xres(*data_field) != info->xres ||
+      gwy_data_field_get_yres(*data_field) != info->yres) {
+    if (*data_field) {
+      g_object_unref(*data_field);
+    }
+    *data_field = gwy_data_field_new(info->xres, info->yres, info->xreal,
+                                     info->yreal, FALSE);
+  }
+  gwy_data_field_set_xreal(*data_field, info->xreal);
+  gwy_data_field_set_yreal(*data_field, info->yreal);
+
+  gdouble *data = gwy_data_field_get_data(*data_field);
+  if (!mul_read_data(filename, info, data)) {
+    fprintf(stderr, "Can't read channel %d of %s\n", index, filename);
+    return FALSE;
+  }
+  // Labels without a z scale keep the raw numbers, hence no z unit then
+  if (info->zscale) {
+    gwy_data_field_multiply(*data_field, info->zscale);
+  }
+
+  LevelResult level;
+  level_plane_buffer(data, info->xres, info->yres, &level);
+
+  gboolean ok = TRUE;
+  gchar *path = g_strdup_printf("%s%s%s-%03d.gsf", batch->output,
+                                G_DIR_SEPARATOR_S, stem, index);
+  if (batch->data) {
+    if (!write_gsf(path, *data_field, "m", info->zscale ? "m" : "",
+                   info->title)) {
+      fprintf(stderr, "Can't write %s\n", path);
+      ok = FALSE;
+    }
+  }
+  if (batch->thumbnails) {
+    strcpy(path + strlen(path) - strlen("gsf"), "png");
+    ok = batch_write_thumbnail(path, data, info->xres, info->yres, &level) &&
+         ok;
+  }
+  g_free(path);
+  return ok;
+}
+
+/* Worker: all channels of one file */
+static void batch_file_run(gpointer data, gpointer user_data) {
+  BatchFile *file = data;
+  const gchar *filename = file->filename;
+  Batch *batch = user_data;
+  GPtrArray *images = mul_read_index(filename, -1);
+
+  if (!images) {
+    fprintf(stderr, "Can't read %s as .mul file\n", filename);
+    g_atomic_int_inc(&batch->n_failed);
+    return;
+  }
+  if (batch->sheet) {
+    file->labels = g_new(MulImageInfo, images->len);
+    file->n_labels = images->len;
+    for (guint k = 0; k < images->len; k++) {
+      file->labels[k] = *(MulImageInfo *)g_ptr_array_index(images, k);
+      file->labels[k].preview = NULL;
+    }
+  }
+
+  GwyDataField *data_field = NULL;
+  gint n_failed = 0;
+  for (guint k = 0; k < images->len && (batch->data || batch->thumbnails);
+       k++) {
+    if (!batch_process_channel(batch, filename, file->stem,
+                               g_ptr_array_index(images, k), k,
+                               &data_field)) {
+      n_failed++;
+    }
+  }
+  printf("%s: %u channels%s\n", filename, images->len,
+         n_failed ? ", some failed" : "");
+
+  if (n_failed) {
+    g_atomic_int_inc(&batch->n_failed);
+  }
+  if (data_field) {
+    g_object_unref(data_field);
+  }
+  g_ptr_array_free(images, TRUE);
+}
+
+/* Worker part of a sheet tile, the preview leveled like in the overviews */
+static void batch_sheet_tile(gint index, SheetTile *tile, gpointer user_data) {
+  BatchTile *batch_tile = &g_array_index((GArray *)user_data, BatchTile, index);
+  const gchar *filename = batch_tile->file->filename;
+  const MulImageInfo *label = &batch_tile->file->labels[batch_tile->index];
+  gchar *base = g_path_get_basename(filename);
+  gint width, height;
+
+  tile->title = g_strdup_printf("%s: %s", base, label->title);
+  g_free(base);
+
+  gdouble *thumb = mul_read_image_preview(filename, label, &width, &height);
+  if (thumb) {
+    LevelResult level;
+    level_plane_buffer(thumb, width, height, &level);
+    sheet_tile_set_data(tile, thumb, width, height, &level, NULL);
+    g_free(thumb);
+  }
+}
+
+static gboolean batch_write_sheet(const gchar *filename, BatchFile *files,
+                                  guint n_files, gint columns,
+                                  gint per_page) {
+  GArray *tiles = g_array_new(FALSE, FALSE, sizeof(BatchTile));
+
+  for (guint k = 0; k < n_files; k++) {
+    for (gint i = 0; i < files[k].n_labels; i++) {
+      BatchTile tile = {files + k, i};
+      g_array_append_val(tiles, tile);
+    }
+  }
+  if (!tiles->len) {
+    fprintf(stderr, "No images for the sheet\n");
+    g_array_free(tiles, TRUE);
+    return FALSE;
+  }
+
+  gboolean ok = contact_sheet_write(filename, tiles->len, columns, per_page,
+                                    batch_sheet_tile, NULL, tiles);
+  if (ok) {
+    printf("Sheet with %u images written to %s\n", tiles->len, filename);
+  } else {
+    fprintf(stderr, "Can't write sheet %s\n", filename);
+  }
+  g_array_free(tiles, TRUE);
+  return ok;
+}
+
+static int compare_filenames(const void *a, const void *b) {
+  return strcmp(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+/* Adds path, or the .mul files in it if it is a directory, sorted by name */
+static void batch_collect(const gchar *path, GPtrArray *files) {
+  if (!g_file_test(path, G_FILE_TEST_IS_DIR)) {
+    g_ptr_array_add(files, g_strdup(path));
+    return;
+  }
+
+  GError *error = NULL;
+  GDir *dir = g_dir_open(path, 0, &error);
+  if (!dir) {
+    fprintf(stderr, "Can't open %s: %s\n", path, error->message);
+    g_error_free(error);
+    return;
+  }
+
+  guint first = files->len;
+  const gchar *name;
+  while ((name = g_dir_read_name(dir))) {
+    if (g_str_has_suffix(name, ".mul")) {
+      g_ptr_array_add(files, g_build_filename(path, name, NULL));
+    }
+  }
+  g_dir_close(dir);
+  qsort(files->pdata + first, files->len - first, sizeof(gpointer),
+        compare_filenames);
+}
+
+/*
+ * Drift correction of a series that does not fit into memory.
+ *
+ * The images of all files, in the given order, are the frames. Two passes are
+ * made over the files: the first reads the frames of every consecutive pair
+ * and estimates their displacement with drift_estimate_shift(), the second
+ * reads every frame again, shifts it back by its offset against the first
+ * frame, crops it to the region covered by all frames and writes it to
+ * frame-NNNNN.gsf. Every thread holds the samples of at most two frames, so
+ * the memory used does not grow with the length of the series; only the
+ * labels are kept for all frames.
+ */
+typedef struct {
+  const gchar *filename;
+  MulImageInfo info;
+  gdouble dx; // displacement against the previous frame, in pixels
+  gdouble dy;
+} DriftFrame;
+
+typedef struct {
+  const gchar *output;
+  DriftFrame *frames;
+  gint xres;
+  gint yres;
+  gdouble x0; // crop origin in the first frame
+  gdouble y0;
+  gint width;
+  gint height;
+  gint n_failed;
+} BatchDrift;
+
+static gdouble *batch_drift_read(const DriftFrame *frame) {
+  gdouble *data =
+      g_new(gdouble, (gsize)frame->info.xres * frame->info.yres);
+
+  if (!mul_read_data(frame->filename, &frame->info, data)) {
+    fprintf(stderr, "Can't read channel %d of %s\n", frame->info.id,
+            frame->filename);
+    g_free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/* Worker of the first pass: a frame against its predecessor */
+static void batch_drift_pair(gpointer data, gpointer user_data) {
+  DriftFrame *frame = data;
+  BatchDrift *drift = user_data;
+  gdouble *a = batch_drift_read(frame - 1);
+  gdouble *b = a ? batch_drift_read(frame) : NULL;
+
+  if (!b || !drift_estimate_shift(a, b, drift->xres, drift->yres, FALSE, 0.0,
+                                  0.0, &frame->dx, &frame->dy)) {
+    fprintf(stderr, "No drift found for %s: %s, taken as none\n",
+            frame->filename, frame->info.title);
+    frame->dx = frame->dy = 0.0;
+    g_atomic_int_inc(&drift->n_failed);
+  }
+  g_free(a);
+  g_free(b);
+}
+
+/* Worker of the second pass: shifts and writes one frame. The offset against
+ * the first frame has been summed up in dx, dy. */
+static void batch_drift_frame(gpointer data, gpointer user_data) {
+  DriftFrame *frame = data;
+  BatchDrift *drift = user_data;
+  gdouble *source = batch_drift_read(frame);
+
+  if (!source) {
+    g_atomic_int_inc(&drift->n_failed);
+    return;
+  }
+
+  GwyDataField *data_field = gwy_data_field_new(
+      drift->width, drift->height,
+      frame->info.xreal * drift->width / drift->xres,
+      frame->info.yreal * drift->height / drift->yres, FALSE);
+  // Rounding noise must not push the last sample out of the frame
+  gdouble x = CLAMP(drift->x0 + frame->dx, 0.0, drift->xres - drift->width);
+  gdouble y = CLAMP(drift->y0 + frame->dy, 0.0, drift->yres - drift->height);
+  drift_resample_frame(source, drift->xres, x, y,
+                       gwy_data_field_get_data(data_field), drift->width,
+                       drift->height);
+  g_free(source);
+  if (frame->info.zscale) {
+    gwy_data_field_multiply(data_field, frame->info.zscale);
+  }
+
+  gint index = frame - drift->frames;
+  gchar *name = g_strdup_printf("frame-%05d.gsf", index);
+  gchar *path = g_build_filename(drift->output, name, NULL);
+  gchar *title = g_strdup_printf("%s (drift corrected)", frame->info.title);
+  if (!write_gsf(path, data_field, "m", frame->info.zscale ? "m" : "",
+                 title)) {
+    fprintf(stderr, "Can't write %s\n", path);
+    g_atomic_int_inc(&drift->n_failed);
+  }
+  g_free(title);
+  g_free(path);
+  g_free(name);
+  g_object_unref(data_field);
+}
+
+/* Runs both passes over the frames with the given number of threads */
+static gboolean batch_drift(const gchar *output, GPtrArray *filenames,
+                            gint jobs) {
+  GArray *frames = g_array_new(FALSE, FALSE, sizeof(DriftFrame));
+
+  for (guint k = 0; k < filenames->len; k++) {
+    const gchar *filename = g_ptr_array_index(filenames, k);
+    GPtrArray *images = mul_read_index(filename, -1);
+    if (!images) {
+      fprintf(stderr, "Can't read %s as .mul file\n", filename);
+      g_array_free(frames, TRUE);
+      return FALSE;
+    }
+    for (guint i = 0; i < images->len; i++) {
+      DriftFrame frame = {filename, *(MulImageInfo *)g_ptr_array_index(
+                                        images, i),
+                          0.0, 0.0};
+      frame.info.preview = NULL;
+      g_array_append_val(frames, frame);
+    }
+    g_ptr_array_free(images, TRUE);
+  }
+
+  gint n_frames = frames->len;
+  DriftFrame *frame = (DriftFrame *)frames->data;
+  if (n_frames < 2) {
+    fprintf(stderr, "Need at least two frames\n");
+    g_array_free(frames, TRUE);
+    return FALSE;
+  }
+  for (gint k = 1; k < n_frames; k++) {
+    if (frame[k].info.xres != frame[0].info.xres ||
+        frame[k].info.yres != frame[0].info.yres) {
+      fprintf(stderr, "%s: %s differs in size from the first frame\n",
+              frame[k].filename, frame[k].info.title);
+      g_array_free(frames, TRUE);
+      return FALSE;
+    }
+  }
+
+  BatchDrift drift = {output, frame, frame[0].info.xres, frame[0].info.yres,
+                      0.0, 0.0, 0, 0, 0};
+  GThreadPool *pool =
+      g_thread_pool_new(batch_drift_pair, &drift, jobs, TRUE, NULL);
+  for (gint k = 1; k < n_frames; k++) {
+    g_thread_pool_push(pool, frame + k, NULL);
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  // Offsets against the first frame and the region covered by all frames
+  gdouble min_x = 0.0, max_x = 0.0, min_y = 0.0, max_y = 0.0;
+  for (gint k = 1; k < n_frames; k++) {
+    frame[k].dx += frame[k - 1].dx;
+    frame[k].dy += frame[k - 1].dy;
+    min_x = MIN(min_x, frame[k].dx);
+    max_x = MAX(max_x, frame[k].dx);
+    min_y = MIN(min_y, frame[k].dy);
+    max_y = MAX(max_y, frame[k].dy);
+  }
+  gint x0 = (gint)ceil(-min_x), y0 = (gint)ceil(-min_y);
+  drift.x0 = x0;
+  drift.y0 = y0;
+  drift.width = (gint)floor(drift.xres - 1 - max_x) - x0 + 1;
+  drift.height = (gint)floor(drift.yres - 1 - max_y) - y0 + 1;
+  if (drift.width < 2 || drift.height < 2) {
+    fprintf(stderr, "The frames do not overlap\n");
+    g_array_free(frames, TRUE);
+    return FALSE;
+  }
+
+  pool = g_thread_pool_new(batch_drift_frame, &drift, jobs, TRUE, NULL);
+  for (gint k = 0; k < n_frames; k++) {
+    g_thread_pool_push(pool, frame + k, NULL);
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);
+  printf("%d frames of %d x %d written to %s, %d failed\n", n_frames,
+         drift.width, drift.height, output, drift.n_failed);
+
+  g_array_free(frames, TRUE);
+  return drift.n_failed == 0;
+}
+
+/* The file name without extension, or the whole path with the directory
+ * separators replaced if whole_path */
+static gchar *batch_stem(const gchar *filename, gboolean whole_path) {
+  gchar *stem = whole_path ? g_strdup(filename) : g_path_get_basename(filename);
+  gchar *dot = strrchr(stem, '.');
+
+  if (dot && dot != stem && !strpbrk(dot, "/\\")) {
+    *dot = '\0';
+  }
+  if (whole_path) {
+    g_strdelimit(stem, "/\\:", '_');
+    gchar *start = stem + strspn(stem, "._");
+    memmove(stem, start, strlen(start) + 1);
+  }
+  return stem;
+}
+
+/* Names the outputs of every file after the file, or after its whole path if
+ * another file has the same name, so that no file overwrites the results of
+ * another one. Paths that still give the same name get a number. */
+static void batch_name_files(BatchFile *files, guint n_files) {
+  GHashTable *names =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  for (guint k = 0; k < n_files; k++) {
+    gchar *stem = batch_stem(files[k].filename, FALSE);
+    gint n = GPOINTER_TO_INT(g_hash_table_lookup(names, stem));
+    g_hash_table_insert(names, stem, GINT_TO_POINTER(n + 1));
+  }
+
+  GHashTable *taken = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint k = 0; k < n_files; k++) {
+    gchar *stem = batch_stem(files[k].filename, FALSE);
+    if (GPOINTER_TO_INT(g_hash_table_lookup(names, stem)) > 1) {
+      g_free(stem);
+      stem = batch_stem(files[k].filename, TRUE);
+    }
+    files[k].stem = g_strdup(stem);
+    for (gint n = 2; g_hash_table_contains(taken, files[k].stem); n++) {
+      g_free(files[k].stem);
+      files[k].stem = g_strdup_printf("%s~%d", stem, n);
+    }
+    g_hash_table_add(taken, files[k].stem);
+    g_free(stem);
+  }
+  g_hash_table_destroy(taken);
+  g_hash_table_destroy(names);
+}
+
+int main(int argc, char *argv[]) {
+  gchar *output = NULL, *sheet = NULL, *drift = NULL;
+  gint jobs = g_get_num_processors(), columns = 10, per_page = 0;
+  gboolean no_data = FALSE, no_thumbnails = FALSE;
+  GOptionEntry entries[] = {
+      {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+       "Directory for the results (default .)", "DIR"},
+      {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+       "Files processed in parallel (default number of cores)", "N"},
+      {"no-data", 0, 0, G_OPTION_ARG_NONE, &no_data,
+       "Do not write the leveled channels", NULL},
+      {"no-thumbnails", 0, 0, G_OPTION_ARG_NONE, &no_thumbnails,
+       "Do not write thumbnails", NULL},
+      {"sheet", 's', 0, G_OPTION_ARG_FILENAME, &sheet,
+       "Also put all channels on a contact sheet", "FILE.png"},
+      {"columns", 'c', 0, G_OPTION_ARG_INT, &columns,
+       "Columns of the sheet (default 10)", "N"},
+      {"per-page", 'p', 0, G_OPTION_ARG_INT, &per_page,
+       "Split the sheet into pages of at most N images (default one page)",
+       "N"},
+      {"drift", 'd', 0, G_OPTION_ARG_FILENAME, &drift,
+       "Drift correct the images as one series instead, written to DIR",
+       "DIR"},
+      {NULL, 0, 0, 0, NULL, NULL, NULL},
+  };
+  GOptionContext *context =
+      g_option_context_new("FILE|DIRECTORY... - level .mul files");
+  GError *error = NULL;
+
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    fprintf(stderr, "%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (argc < 2) {
+    fprintf(stderr, "No files given, see %s --help\n", argv[0]);
+    return 1;
+  }
+  if (jobs < 1 || columns < 1) {
+    fprintf(stderr, "Need at least one job and one column\n");
+    return 1;
+  }
+
+  GPtrArray *filenames = g_ptr_array_new_with_free_func(g_free);
+  for (gint k = 1; k < argc; k++) {
+    batch_collect(argv[k], filenames);
+  }
+  gwy_process_type_init();
+
+  if (drift) {
+    gboolean ok = g_mkdir_with_parents(drift, 0755) == 0;
+    if (!ok) {
+      fprintf(stderr, "Can't create %s\n", drift);
+    } else {
+      ok = batch_drift(drift, filenames, jobs);
+    }
+    g_ptr_array_free(filenames, TRUE);
+    g_free(output);
+    g_free(sheet);
+    g_free(drift);
+    return ok ? 0 : 1;
+  }
+
+  Batch batch = {output ? output : ".", !no_data, !no_thumbnails,
+                 sheet != NULL, 0};
+  if (g_mkdir_with_parents(batch.output, 0755) != 0) {
+    fprintf(stderr, "Can't create %s\n", batch.output);
+    g_ptr_array_free(filenames, TRUE);
+    return 1;
+  }
+
+  BatchFile *files = g_new0(BatchFile, filenames->len);
+  for (guint k = 0; k < filenames->len; k++) {
+    files[k].filename = g_ptr_array_index(filenames, k);
+  }
+  batch_name_files(files, filenames->len);
+
+  GThreadPool *pool =
+      g_thread_pool_new(batch_file_run, &batch, jobs, TRUE, NULL);
+  for (guint k = 0; k < filenames->len; k++) {
+    g_thread_pool_push(pool, files + k, NULL);
+  }
+  // Waits for all files
+  g_thread_pool_free(pool, FALSE, TRUE);
+  printf("%u files, %d failed\n", filenames->len, batch.n_failed);
+
+  gboolean ok = batch.n_failed == 0;
+  if (sheet) {
+    ok = batch_write_sheet(sheet, files, filenames->len, columns, per_page) &&
+         ok;
+  }
+
+  for (guint k = 0; k < filenames->len; k++) {
+    g_free(files[k].stem);
+    g_free(files[k].labels);
+  }
+  g_free(files);
+  g_ptr_array_free(filenames, TRUE);
+  g_free(output);
+  g_free(sheet);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,334 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Headless benchmarks of the kernels in z-kernels.c, run with `make bench`.
+ *
+ * Every benchmark runs on synthetic square data fields of the requested
+ * sizes. After the warm-up runs, every iteration is timed on its own (after an
+ * untimed preparation, if the benchmark has one) and the median and minimum
+ * are reported together with the throughput in MPixel/s of the median, as one
+ * tab separated line per benchmark and size:
+ *
+ *   label  benchmark  size  iterations  median_s  min_s  mpix_per_s
+ *
+ * The label (--label) is meant for the commit, so that outputs of several
+ * commits can be concatenated and compared. The container benchmark does not
+ * touch the samples, its throughput is 0.
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+#include <libdraw/gwydraw.h>
+#include <libdraw/gwygradient.h>
+#include <libdraw/gwypixfield.h>
+#include <libgwyddion/gwycontainer.h>
+#include <libprocess/datafield.h>
+#include <libprocess/gwyprocess.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "z-kernels.h"
+
+#define BENCH_CHANNELS 16
+#define BENCH_SHIFT_X 3.3
+#define BENCH_SHIFT_Y -1.6
+
+typedef struct {
+  gint size;
+  GwyDataField *first;
+  GwyDataField *second; // first shifted by (BENCH_SHIFT_X, BENCH_SHIFT_Y)
+  GwyDataField *target;
+  GwyContainer *container;
+} BenchData;
+
+typedef struct {
+  const gchar *name;
+  void (*prepare)(BenchData *data); // before every run, not timed, or NULL
+  void (*run)(BenchData *data);
+  gint pixels_per_run; // in units of size^2
+} Benchmark;
+
+/* Smooth surface with some structure, a tilt and noise */
+static void bench_fill(GwyDataField *data_field, gdouble x0, gdouble y0,
+                       GRand *rng) {
+  gint xres = gwy_data_field_get_xres(data_field);
+  gint yres = gwy_data_field_get_yres(data_field);
+  gdouble *data = gwy_data_field_get_data(data_field);
+
+  for (gint i = 0; i < yres; i++) {
+    gdouble y = i + y0;
+    for (gint j = 0; j < xres; j++) {
+      gdouble x = j + x0;
+      data[(gsize)i * xres + j] = sin(0.071 * x) * cos(0.053 * y) +
+                                  0.5 * sin(0.013 * x + 0.029 * y) +
+                                  1e-3 * x - 2e-3 * y +
+                                  0.05 * g_rand_double(rng);
+    }
+  }
+}
+
+static void bench_data_init(BenchData *data, gint size) {
+  GRand *rng = g_rand_new_with_seed(size);
+
+  data->size = size;
+  data->first = gwy_data_field_new(size, size, size, size, FALSE);
+  data->second = gwy_data_field_new(size, size, size, size, FALSE);
+  data->target = gwy_data_field_new(size, size, size, size, FALSE);
+  bench_fill(data->first, 0.0, 0.0, rng);
+  bench_fill(data->second, BENCH_SHIFT_X, BENCH_SHIFT_Y, rng);
+
+  // The channels share one field, what counts is walking the container
+  data->container = gwy_container_new();
+  for (gint k = 0; k < BENCH_CHANNELS; k++) {
+    gchar key[32];
+    g_snprintf(key, sizeof(key), "/%d/data", k);
+    gwy_container_set_object_by_name(data->container, key, data->first);
+  }
+  g_rand_free(rng);
+}
+
+static void bench_data_free(BenchData *data) {
+  g_object_unref(data->container);
+  g_object_unref(data->first);
+  g_object_unref(data->second);
+  g_object_unref(data->target);
+}
+
+/* The leveling works in place, every run starts from the unleveled data */
+static void bench_level_plane_prepare(BenchData *data) {
+  gwy_data_field_copy(data->first, data->target, FALSE);
+}
+
+static void bench_level_plane(BenchData *data) {
+  level_plane_buffer(gwy_data_field_get_data(data->target), data->size,
+                     data->size, NULL);
+}
+
+static void bench_thumbnail(BenchData *data) {
+  gint width, height;
+
+  thumbnail_size(data->size, data->size, &width, &height);
+  gdouble *thumb = g_new(gdouble, (gsize)width * height);
+  decimate_buffer(gwy_data_field_get_data_const(data->first), data->size,
+                  data->size, thumb, width, height);
+  LevelResult level;
+  level_plane_buffer(thumb, width, height, &level);
+
+  // Colour mapping with the default palette, as create_thumbnail() does it
+  GwyDataField *small = gwy_data_field_new(width, height, width, height, FALSE);
+  memcpy(gwy_data_field_get_data(small), thumb,
+         (gsize)width * height * sizeof(gdouble));
+  GdkPixbuf *pixbuf =
+      gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  gwy_pixbuf_draw_data_field_with_range(pixbuf, small,
+                                        gwy_gradients_get_gradient(NULL),
+                                        level.min, level.max);
+  g_object_unref(pixbuf);
+  g_object_unref(small);
+  g_free(thumb);
+}
+
+/* Counts the channels by their keys, like the data browser finds them */
+static void bench_container_key(gpointer key, gpointer value,
+                                gpointer user_data) {
+  const gchar *name = g_quark_to_string(GPOINTER_TO_UINT(key));
+  gint *n_channels = user_data;
+
+  if (g_str_has_suffix(name, "/data")) {
+    (*n_channels)++;
+  }
+}
+
+/* Walking the container and looking up the channels, without leveling */
+static void bench_container(BenchData *data) {
+  gint n_channels = 0, n_found = 0;
+
+  gwy_container_foreach(data->container, "/", bench_container_key,
+                        &n_channels);
+  for (gint k = 0; k < n_channels; k++) {
+    gchar key[32];
+    GwyDataField *data_field = NULL;
+    g_snprintf(key, sizeof(key), "/%d/data", k);
+    if (gwy_container_gis_object_by_name(data->container, key,
+                                         &data_field)) {
+      n_found++;
+    }
+  }
+  if (n_found != BENCH_CHANNELS) {
+    fprintf(stderr, "container: found %d of %d channels\n", n_found,
+            BENCH_CHANNELS);
+  }
+}
+
+static void bench_drift_estimate(BenchData *data) {
+  gdouble dx, dy;
+
+  if (!drift_estimate_shift(gwy_data_field_get_data_const(data->first),
+                            gwy_data_field_get_data_const(data->second),
+                            data->size, data->size, FALSE, 0.0, 0.0, &dx,
+                            &dy) ||
+      fabs(dx + BENCH_SHIFT_X) > 0.5 || fabs(dy + BENCH_SHIFT_Y) > 0.5) {
+    fprintf(stderr, "drift_estimate: wrong shift %g %g at size %d\n", dx, dy,
+            data->size);
+  }
+}
+
+static void bench_drift_resample(BenchData *data) {
+  drift_resample_frame(gwy_data_field_get_data_const(data->first), data->size,
+                       2.3, 1.7, gwy_data_field_get_data(data->target),
+                       data->size - 4, data->size - 4);
+}
+
+static const Benchmark benchmarks[] = {
+    {"level_plane", bench_level_plane_prepare, bench_level_plane, 1},
+    {"thumbnail", NULL, bench_thumbnail, 1},
+    {"container", NULL, bench_container, 0},
+    {"drift_estimate", NULL, bench_drift_estimate, 1},
+    {"drift_resample", NULL, bench_drift_resample, 1},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+  gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+  return (x > y) - (x < y);
+}
+
+/* Runs one benchmark and prints its line */
+static void bench_run(const Benchmark *bench, BenchData *data, gint warmup,
+                      gint iterations, const gchar *label) {
+  gdouble *times = g_new(gdouble, iterations);
+
+  for (gint k = 0; k < warmup; k++) {
+    if (bench->prepare) {
+      bench->prepare(data);
+    }
+    bench->run(data);
+  }
+  for (gint k = 0; k < iterations; k++) {
+    if (bench->prepare) {
+      bench->prepare(data);
+    }
+    gint64 start = g_get_monotonic_time();
+    bench->run(data);
+    times[k] = (g_get_monotonic_time() - start) * 1e-6;
+  }
+  qsort(times, iterations, sizeof(gdouble), compare_doubles);
+
+  gdouble median = iterations % 2
+                       ? times[iterations / 2]
+                       : 0.5 * (times[iterations / 2 - 1] +
+                                times[iterations / 2]);
+  gdouble mpix = 1e-6 * bench->pixels_per_run * data->size * data->size;
+  printf("%s\t%s\t%d\t%d\t%.6f\t%.6f\t%.2f\n", label, bench->name,
+         data->size, iterations, median, times[0],
+         median > 0.0 ? mpix / median : 0.0);
+  fflush(stdout);
+  g_free(times);
+}
+
+/* TRUE if name is in the comma separated list, or the list is NULL */
+static gboolean bench_selected(const gchar *list, const gchar *name) {
+  if (!list) {
+    return TRUE;
+  }
+
+  gchar **names = g_strsplit(list, ",", -1);
+  gboolean found = FALSE;
+  for (gint k = 0; names[k] && !found; k++) {
+    found = strcmp(g_strstrip(names[k]), name) == 0;
+  }
+  g_strfreev(names);
+  return found;
+}
+
+int main(int argc, char *argv[]) {
+  gchar *sizes = NULL, *only = NULL, *label = NULL;
+  gint warmup = 1, iterations = 5;
+  gboolean list = FALSE;
+  GOptionEntry entries[] = {
+      {"sizes", 's', 0, G_OPTION_ARG_STRING, &sizes,
+       "Comma separated field sizes (default 256,512,1024,2048,4096,8192)",
+       "N,..."},
+      {"warmup", 'w', 0, G_OPTION_ARG_INT, &warmup,
+       "Untimed runs before measuring (default 1)", "N"},
+      {"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+       "Timed runs (default 5)", "N"},
+      {"bench", 'b', 0, G_OPTION_ARG_STRING, &only,
+       "Comma separated benchmarks to run (default all)", "NAME,..."},
+      {"label", 'l', 0, G_OPTION_ARG_STRING, &label,
+       "First column of the output, e.g. the commit (default -)", "TEXT"},
+      {"list", 0, 0, G_OPTION_ARG_NONE, &list, "List the benchmarks and exit",
+       NULL},
+      {NULL, 0, 0, 0, NULL, NULL, NULL},
+  };
+  GOptionContext *context = g_option_context_new("- benchmark z-module");
+  GError *error = NULL;
+
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    fprintf(stderr, "%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (list) {
+    for (guint k = 0; k < G_N_ELEMENTS(benchmarks); k++) {
+      printf("%s\n", benchmarks[k].name);
+    }
+    return 0;
+  }
+  if (warmup < 0 || iterations < 1) {
+    fprintf(stderr, "Need at least one iteration and no negative warm-up\n");
+    return 1;
+  }
+
+  gwy_process_type_init();
+  gwy_draw_type_init();
+  gchar **size_list =
+      g_strsplit(sizes ? sizes : "256,512,1024,2048,4096,8192", ",", -1);
+  printf("# label\tbenchmark\tsize\titerations\tmedian_s\tmin_s\t"
+         "mpix_per_s\n");
+  for (gint k = 0; size_list[k]; k++) {
+    gint size = atoi(size_list[k]);
+    if (size < 16) {
+      fprintf(stderr, "Skipping size %s\n", size_list[k]);
+      continue;
+    }
+
+    BenchData data;
+    bench_data_init(&data, size);
+    for (guint b = 0; b < G_N_ELEMENTS(benchmarks); b++) {
+      if (bench_selected(only, benchmarks[b].name)) {
+        bench_run(benchmarks + b, &data, warmup, iterations,
+                  label ? label : "-");
+      }
+    }
+    bench_data_free(&data);
+  }
+
+  g_strfreev(size_list);
+  g_free(sizes);
+  g_free(only);
+  g_free(label);
+  return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Checks of the kernels in z-kernels.c on synthetic data, run with
+ * `make check`.
+ *
+ * The frames are sampled from a smooth analytic surface with a little noise of
+ * their own, so a frame shifted by a fractional offset is exact apart from
+ * the noise and the estimates can be compared with the true shift. Every
+ * check prints one line with its result; the exit status is non-zero if any
+ * of them failed.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "z-kernels.h"
+
+#define CHECK_NOISE 0.02
+#define CHECK_SHIFT_X 3.3
+#define CHECK_SHIFT_Y -1.6
+#define CHECK_SHIFT_TOLERANCE 0.1
+#define CHECK_TRACK_X 7.4
+#define CHECK_TRACK_Y -5.7
+#define CHECK_TRACK_TOLERANCE 0.25
+#define CHECK_TRACK_SIZE 33
+#define CHECK_TRACK_RADIUS 24
+#define CHECK_TRACK_MIN_SCORE 0.95
+
+static gint n_failed = 0;
+
+static void check_report(gboolean ok, const gchar *name, const gchar *detail) {
+  printf("%s %s: %s\n", ok ? "PASS" : "FAIL", name, detail);
+  if (!ok) {
+    n_failed++;
+  }
+}
+
+/* Smooth surface with a few bumps, so that no shift matches it except the
+ * true one */
+static gdouble check_surface(gdouble x, gdouble y) {
+  return sin(0.071 * x) * cos(0.053 * y) + 0.5 * sin(0.013 * x + 0.029 * y) +
+         0.3 * sin(0.23 * x + 0.11 * y) * cos(0.19 * y - 0.07 * x) +
+         0.8 * exp(-((x - 140.0) * (x - 140.0) + (y - 120.0) * (y - 120.0)) /
+                   300.0) +
+         0.6 * exp(-((x - 300.0) * (x - 300.0) + (y - 380.0) * (y - 380.0)) /
+                   900.0) +
+         1e-3 * x - 2e-3 * y;
+}
+
+/* The surface moved by (dx, dy), so that frame[i][j] is the unmoved surface
+ * at (j - dx, i - dy), plus noise */
+static gdouble *check_frame(gint xres, gint yres, gdouble dx, gdouble dy,
+                            GRand *rng) {
+  gdouble *data = g_new(gdouble, (gsize)xres * yres);
+
+  for (gint i = 0; i < yres; i++) {
+    for (gint j = 0; j < xres; j++) {
+      data[(gsize)i * xres + j] =
+          check_surface(j - dx, i - dy) +
+          g_rand_double_range(rng, -0.5 * CHECK_NOISE, 0.5 * CHECK_NOISE);
+    }
+  }
+  return data;
+}
+
+/* The fitted plane matches the one the data was made of and nothing is left
+ * after subtracting it */
+static void check_level_plane(void) {
+  const gint xres = 333, yres = 211;
+  const gdouble a = 0.7, bx = 2.5e-3, by = -4.1e-3;
+  gdouble *data = g_new(gdouble, (gsize)xres * yres);
+
+  for (gint i = 0; i < yres; i++) {
+    for (gint j = 0; j < xres; j++) {
+      data[(gsize)i * xres + j] = a + bx * j + by * i;
+    }
+  }
+
+  LevelResult level;
+  level_plane_buffer(data, xres, yres, &level);
+  gdouble error = MAX(fabs(level.a - a),
+                      MAX(fabs(level.bx - bx), fabs(level.by - by)));
+  for (gsize k = 0; k < (gsize)xres * yres; k++) {
+    error = MAX(error, fabs(data[k]));
+  }
+
+  gchar *detail = g_strdup_printf("max error %.1e", error);
+  check_report(error < 1e-9, "level_plane_buffer", detail);
+  g_free(detail);
+  g_free(data);
+}
+
+/* Coarse to fine estimation recovers a fractional shift */
+static void check_estimate_shift(gint size) {
+  GRand *rng = g_rand_new_with_seed(size);
+  gdouble *a = check_frame(size, size, 0.0, 0.0, rng);
+  gdouble *b = check_frame(size, size, CHECK_SHIFT_X, CHECK_SHIFT_Y, rng);
+  gdouble x = 0.0, y = 0.0;
+
+  gboolean ok =
+      drift_estimate_shift(a, b, size, size, FALSE, 0.0, 0.0, &x, &y);
+  ok = ok && fabs(x - CHECK_SHIFT_X) < CHECK_SHIFT_TOLERANCE &&
+       fabs(y - CHECK_SHIFT_Y) < CHECK_SHIFT_TOLERANCE;
+
+  gchar *name = g_strdup_printf("drift_estimate_shift %d", size);
+  gchar *detail = g_strdup_printf("(%.3f, %.3f) for (%.1f, %.1f)", x, y,
+                                  CHECK_SHIFT_X, CHECK_SHIFT_Y);
+  check_report(ok, name, detail);
+  g_free(detail);
+  g_free(name);
+  g_free(a);
+  g_free(b);
+  g_rand_free(rng);
+}
+
+/* The SIMD resampling equals scalar bilinear interpolation, also in place */
+static void check_resample(gdouble x, gdouble y) {
+  const gint xres = 67, yres = 45;
+  const gint width = xres - 4, height = yres - 4;
+  GRand *rng = g_rand_new_with_seed(42);
+  gdouble *source = g_new(gdouble, (gsize)xres * yres);
+  gdouble *target = g_new(gdouble, (gsize)width * height);
+
+  for (gsize k = 0; k < (gsize)xres * yres; k++) {
+    source[k] = g_rand_double_range(rng, -1.0, 1.0);
+  }
+  drift_resample_frame(source, xres, x, y, target, width, height);
+
+  gint ix = (gint)floor(x), iy = (gint)floor(y);
+  gdouble fx = x - ix, fy = y - iy;
+  gdouble error = 0.0;
+  for (gint i = 0; i < height; i++) {
+    for (gint j = 0; j < width; j++) {
+      const gdouble *p = source + (gsize)(i + iy) * xres + j + ix;
+      gdouble top = (1.0 - fx) * p[0] + (fx > 0.0 ? fx * p[1] : 0.0);
+      gdouble bottom = 0.0;
+      if (fy > 0.0) {
+        bottom = (1.0 - fx) * p[xres] + (fx > 0.0 ? fx * p[xres + 1] : 0.0);
+      }
+      error = MAX(error, fabs((1.0 - fy) * top + fy * bottom -
+                              target[(gsize)i * width + j]));
+    }
+  }
+
+  // The same again into the source itself
+  drift_resample_frame(source, xres, x, y, source, width, height);
+  for (gsize k = 0; k < (gsize)width * height; k++) {
+    error = MAX(error, fabs(source[k] - target[k]));
+  }
+
+  gchar *name = g_strdup_printf("drift_resample_frame (%.2f, %.2f)", x, y);
+  gchar *detail = g_strdup_printf("max error %.1e", error);
+  check_report(error < 1e-12, name, detail);
+  g_free(detail);
+  g_free(name);
+  g_free(target);
+  g_free(source);
+  g_rand_free(rng);
+}
+
+/* A template cut from one frame is found at its shifted position in the
+ * other */
+static void check_track_match(void) {
+  const gint size = 256, side = CHECK_TRACK_SIZE;
+  const gint cx = 140, cy = 120;
+  GRand *rng = g_rand_new_with_seed(size);
+  gdouble *a = check_frame(size, size, 0.0, 0.0, rng);
+  gdouble *b = check_frame(size, size, CHECK_TRACK_X, CHECK_TRACK_Y, rng);
+  gdouble *tmpl = g_new(gdouble, side * side);
+
+  gdouble norm = track_template(a, size, cx, cy, side, tmpl);
+  gdouble x = cx, y = cy, score = 0.0;
+  if (norm > 0.0) {
+    score = track_match(b, size, size, tmpl, side, norm, CHECK_TRACK_RADIUS,
+                        &x, &y);
+  }
+  gboolean ok = score >= CHECK_TRACK_MIN_SCORE &&
+                fabs(x - cx - CHECK_TRACK_X) < CHECK_TRACK_TOLERANCE &&
+                fabs(y - cy - CHECK_TRACK_Y) < CHECK_TRACK_TOLERANCE;
+
+  gchar *detail =
+      g_strdup_printf("(%.2f, %.2f) for (%.1f, %.1f), score %.3f", x - cx,
+                      y - cy, CHECK_TRACK_X, CHECK_TRACK_Y, score);
+  check_report(ok, "track_match", detail);
+  g_free(detail);
+  g_free(tmpl);
+  g_free(a);
+  g_free(b);
+  g_rand_free(rng);
+}
+
+int main(void) {
+  check_level_plane();
+  // Pyramids of two, three and four levels
+  check_estimate_shift(256);
+  check_estimate_shift(512);
+  check_estimate_shift(1024);
+  check_resample(2.37, 1.61);
+  check_resample(3.0, 0.45);
+  check_resample(1.25, 2.0);
+  check_track_match();
+
+  return n_failed ? 1 : 0;
+}
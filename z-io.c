@@ -0,0 +1,262 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "z-io.h"
+#include "z-kernels.h"
+
+/*
+ * Header-only reader for .mul files (Aarhus STM).
+ *
+ * The file starts with an index area of MUL_INDEX_SIZE bytes, followed by the
+ * images. Every image consists of a MUL_BLOCK_SIZE byte label and xres*yres
+ * 16 bit little endian samples; the total size of the image in blocks is
+ * stored in the label. Only the labels and, optionally, a decimated preview
+ * are read, or the samples of a single image with mul_read_data(). In the
+ * module, the full container is still loaded by Gwyddion's own .mul module
+ * once a channel is activated.
+ */
+/* Height of one count per unit of the z scale in the label, in m, the
+ * calibration of the Aarhus STM as applied by Gwyddion's loader */
+#define MUL_HEIGHT_PER_COUNT (-0.1 / 1.36 / 2000.0 * 1e-9)
+
+static gint mul_get_int16(const guchar *p) {
+  return (gint16)(p[0] | (p[1] << 8));
+}
+
+static guint mul_get_uint16(const guchar *p) { return p[0] | (p[1] << 8); }
+
+/* Label strings are Pascal strings of at most MUL_STRING_SIZE characters */
+static void mul_get_string(const guchar *p, gchar *str) {
+  guint len = MIN(p[0], MUL_STRING_SIZE);
+
+  memcpy(str, p + 1, len);
+  str[len] = '\0';
+  g_strstrip(str);
+}
+
+static void mul_image_info_free(gpointer p) {
+  MulImageInfo *info = p;
+
+  g_free(info->preview);
+  g_free(info);
+}
+
+/* Reads the samples at the current position of fh into data */
+static gboolean mul_read_samples(FILE *fh, const MulImageInfo *info,
+                                 gdouble *data) {
+  gsize n = (gsize)info->xres * info->yres;
+  guchar *raw = g_malloc(2 * n);
+  gboolean ok = fread(raw, 2, n, fh) == n;
+
+  for (gsize k = 0; ok && k < n; k++) {
+    data[k] = mul_get_int16(raw + 2 * k);
+  }
+  g_free(raw);
+  return ok;
+}
+
+static gboolean mul_read_preview(FILE *fh, MulImageInfo *info) {
+  gdouble *data = g_new(gdouble, (gsize)info->xres * info->yres);
+  gboolean ok = mul_read_samples(fh, info, data);
+
+  if (ok) {
+    thumbnail_size(info->xres, info->yres, &info->preview_width,
+                   &info->preview_height);
+    info->preview =
+        g_new(gdouble, (gsize)info->preview_width * info->preview_height);
+    decimate_buffer(data, info->xres, info->yres, info->preview,
+                    info->preview_width, info->preview_height);
+  }
+  g_free(data);
+  return ok;
+}
+
+/* Returns an array of MulImageInfo, or NULL if the file does not look like a
+ * .mul file this reader understands. Labels with impossible dimensions are
+ * skipped, a broken chain of labels ends the index. Positions in the array
+ * therefore need not be the channel numbers of Gwyddion's loader, match the
+ * id or title instead. The preview is only read for the image at position
+ * preview_index, pass -1 for none. */
+GPtrArray *mul_read_index(const gchar *filename, gint preview_index) {
+  FILE *fh = g_fopen(filename, "rb");
+  if (!fh) {
+    return NULL;
+  }
+
+  fseek(fh, 0, SEEK_END);
+  gint64 file_size = ftell(fh);
+  GPtrArray *images = g_ptr_array_new_with_free_func(mul_image_info_free);
+  gint64 offset = MUL_INDEX_SIZE;
+  gboolean ok = TRUE;
+
+  while (ok && offset + MUL_BLOCK_SIZE <= file_size) {
+    guchar label[MUL_BLOCK_SIZE];
+    if (fseek(fh, offset, SEEK_SET) != 0 ||
+        fread(label, 1, MUL_BLOCK_SIZE, fh) != MUL_BLOCK_SIZE) {
+      break;
+    }
+
+    guint size = mul_get_uint16(label + 2);
+    gint xres = mul_get_uint16(label + 4);
+    gint yres = mul_get_uint16(label + 6);
+    gint64 data_size = 2 * (gint64)xres * yres;
+    if (size < 1 || offset + (gint64)size * MUL_BLOCK_SIZE > file_size) {
+      break;
+    }
+    if (xres < 1 || xres > MUL_MAX_RES || yres < 1 || yres > MUL_MAX_RES ||
+        (gint64)size * MUL_BLOCK_SIZE < MUL_BLOCK_SIZE + data_size) {
+      offset += (gint64)size * MUL_BLOCK_SIZE;
+      continue;
+    }
+
+    MulImageInfo *info = g_new0(MulImageInfo, 1);
+    info->id = mul_get_int16(label);
+    info->xres = xres;
+    info->yres = yres;
+    info->data_offset = offset + MUL_BLOCK_SIZE;
+    // Sizes are in Angstrom, a missing one makes pixels of 1 Angstrom
+    info->xreal = 1e-10 * ABS(mul_get_int16(label + 22));
+    info->yreal = 1e-10 * ABS(mul_get_int16(label + 24));
+    if (!(info->xreal > 0.0)) {
+      info->xreal = 1e-10 * xres;
+    }
+    if (!(info->yreal > 0.0)) {
+      info->yreal = 1e-10 * yres;
+    }
+    info->zscale = MUL_HEIGHT_PER_COUNT * mul_get_int16(label + 30);
+    mul_get_string(label + 61, info->title);
+    if (!*info->title) {
+      g_snprintf(info->title, sizeof(info->title), "Image %d", info->id);
+    }
+
+    gint year = mul_get_int16(label + 10);
+    GDateTime *datetime = g_date_time_new_local(
+        year < 100 ? year + 1900 : year, mul_get_int16(label + 12),
+        mul_get_int16(label + 14), mul_get_int16(label + 16),
+        mul_get_int16(label + 18), mul_get_int16(label + 20));
+    if (datetime) {
+      info->timestamp = g_date_time_to_unix(datetime);
+      g_date_time_unref(datetime);
+    }
+
+    g_ptr_array_add(images, info);
+    if ((gint)images->len - 1 == preview_index &&
+        !mul_read_preview(fh, info)) {
+      ok = FALSE;
+    }
+    offset += (gint64)size * MUL_BLOCK_SIZE;
+  }
+  fclose(fh);
+
+  if (!ok || images->len == 0) {
+    g_ptr_array_free(images, TRUE);
+    return NULL;
+  }
+  return images;
+}
+
+/* Returns the decimated, not leveled data of an image listed by
+ * mul_read_index(). Only its samples are read, at info->data_offset. */
+gdouble *mul_read_image_preview(const gchar *filename,
+                                const MulImageInfo *info, gint *width,
+                                gint *height) {
+  FILE *fh;
+  if (info->xres <= 0 || info->yres <= 0 ||
+      !(fh = g_fopen(filename, "rb"))) {
+    return NULL;
+  }
+
+  MulImageInfo image = *info;
+  image.preview = NULL;
+  if (fseek(fh, info->data_offset, SEEK_SET) == 0 &&
+      mul_read_preview(fh, &image)) {
+    *width = image.preview_width;
+    *height = image.preview_height;
+  }
+  fclose(fh);
+  return image.preview;
+}
+
+/* Reads the samples of an image listed by mul_read_index() into data, which
+ * holds xres*yres values, row by row as stored in the file. The values are
+ * the raw 16 bit numbers, which is all leveling and thumbnails need; multiply
+ * them by info->zscale for heights. */
+gboolean mul_read_data(const gchar *filename, const MulImageInfo *info,
+                       gdouble *data) {
+  FILE *fh = g_fopen(filename, "rb");
+  if (!fh) {
+    return FALSE;
+  }
+
+  gboolean ok = fseek(fh, info->data_offset, SEEK_SET) == 0 &&
+                mul_read_samples(fh, info, data);
+  fclose(fh);
+  return ok;
+}
+
+/* Writes a field as Gwyddion Simple Field: a text header padded with NULs to
+ * a multiple of 4 bytes, then little endian floats */
+gboolean write_gsf(const gchar *filename, GwyDataField *data_field,
+                   const gchar *xy_unit, const gchar *z_unit,
+                   const gchar *title) {
+  gint xres = gwy_data_field_get_xres(data_field);
+  gint yres = gwy_data_field_get_yres(data_field);
+  const gdouble *data = gwy_data_field_get_data_const(data_field);
+  gchar xreal[G_ASCII_DTOSTR_BUF_SIZE], yreal[G_ASCII_DTOSTR_BUF_SIZE];
+
+  FILE *fh = fopen(filename, "wb");
+  if (!fh) {
+    return FALSE;
+  }
+
+  g_ascii_dtostr(xreal, sizeof(xreal), gwy_data_field_get_xreal(data_field));
+  g_ascii_dtostr(yreal, sizeof(yreal), gwy_data_field_get_yreal(data_field));
+  gchar *header = g_strdup_printf("Gwyddion Simple Field 1.0\n"
+                                  "XRes = %d\nYRes = %d\n"
+                                  "XReal = %s\nYReal = %s\n"
+                                  "XYUnits = %s\nZUnits = %s\n"
+                                  "Title = %s\n",
+                                  xres, yres, xreal, yreal, xy_unit, z_unit,
+                                  title);
+  gsize header_len = strlen(header);
+  static const gchar padding[4] = {0};
+  gboolean ok = fwrite(header, 1, header_len, fh) == header_len &&
+                fwrite(padding, 1, 4 - header_len % 4, fh) ==
+                    4 - header_len % 4;
+  g_free(header);
+
+  guint32 *row = g_new(guint32, xres);
+  for (gint i = 0; ok && i < yres; i++) {
+    for (gint j = 0; j < xres; j++) {
+      union {
+        gfloat f;
+        guint32 u;
+      } value = {.f = (gfloat)data[(gsize)i * xres + j]};
+      row[j] = GUINT32_TO_LE(value.u);
+    }
+    ok = fwrite(row, sizeof(guint32), xres, fh) == (gsize)xres;
+  }
+  g_free(row);
+
+  return fclose(fh) == 0 && ok;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef Z_IO_H
+#define Z_IO_H
+
+#include <glib.h>
+#include <libprocess/datafield.h>
+
+/* File reading and writing without GTK, shared by the module and z-batch */
+
+enum {
+  MUL_BLOCK_SIZE = 128,
+  MUL_INDEX_LENGTH = 64,
+  MUL_INDEX_SIZE = MUL_BLOCK_SIZE * MUL_INDEX_LENGTH,
+  MUL_STRING_SIZE = 20,
+  MUL_MAX_RES = 16384,
+};
+
+typedef struct {
+  gint id;
+  gchar title[MUL_STRING_SIZE + 1];
+  gint xres;
+  gint yres;
+  gdouble xreal;      // in m
+  gdouble yreal;      // in m
+  gdouble zscale;     // height of one count in m, 0 if the label has none
+  gint64 timestamp;   // acquisition time (local), 0 if unknown
+  gint64 data_offset; // of the samples in the file
+  gdouble *preview;   // decimated data, not leveled
+  gint preview_width;
+  gint preview_height;
+} MulImageInfo;
+
+GPtrArray *mul_read_index(const gchar *filename, gint preview_index);
+gdouble *mul_read_image_preview(const gchar *filename,
+                                const MulImageInfo *info, gint *width,
+                                gint *height);
+gboolean mul_read_data(const gchar *filename, const MulImageInfo *info,
+                       gdouble *data);
+
+gboolean write_gsf(const gchar *filename, GwyDataField *data_field,
+                   const gchar *xy_unit, const gchar *z_unit,
+                   const gchar *title);
+
+#endif
@@ -0,0 +1,562 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Numerical kernels of the module.
+ *
+ * Everything in here works on plain buffers of doubles and never touches
+ * GTK or Gwyddion objects, so it can run in worker threads and is also
+ * linked into the z-bench benchmark driver.
+ */
+
+#include "z-kernels.h"
+#include <fftw3.h>
+#include <math.h>
+
+/* Fits a plane z = a + bx*col + by*row to the raw buffer, filling the plane
+ * part of result. Only reads the buffer, so it can run in a worker thread. */
+void level_plane_fit(const gdouble *data, gint xres, gint yres,
+                     LevelResult *result) {
+  gdouble sum_z = 0.0, sum_xz = 0.0, sum_yz = 0.0;
+
+  for (gint i = 0; i < yres; i++) {
+    gdouble row_z, row_xz;
+    row_moments(data + (gsize)i * xres, xres, &row_z, &row_xz);
+    sum_z += row_z;
+    sum_xz += row_xz;
+    sum_yz += i * row_z;
+  }
+
+  // With coordinates centered on the grid the normal equations decouple
+  gdouble n = (gdouble)xres * yres;
+  gdouble xc = 0.5 * (xres - 1), yc = 0.5 * (yres - 1);
+  gdouble sxx = yres * (gdouble)xres * ((gdouble)xres * xres - 1.0) / 12.0;
+  gdouble syy = xres * (gdouble)yres * ((gdouble)yres * yres - 1.0) / 12.0;
+  gdouble avg = sum_z / n;
+  result->bx = sxx > 0.0 ? (sum_xz - xc * sum_z) / sxx : 0.0;
+  result->by = syy > 0.0 ? (sum_yz - yc * sum_z) / syy : 0.0;
+  result->a = avg - result->bx * xc - result->by * yc;
+}
+
+/* Subtracts the plane of result from the buffer and records the range of the
+ * leveled data. The x part of the plane is precomputed into a single row that
+ * stays in cache for the whole pass. */
+void level_plane_subtract(gdouble *data, gint xres, gint yres,
+                          LevelResult *result) {
+  gdouble *ramp = g_new(gdouble, xres);
+  for (gint j = 0; j < xres; j++) {
+    ramp[j] = result->bx * j;
+  }
+
+  result->min = G_MAXDOUBLE;
+  result->max = -G_MAXDOUBLE;
+  for (gint i = 0; i < yres; i++) {
+    row_subtract(data + (gsize)i * xres, ramp, xres,
+                 result->a + result->by * i, &result->min, &result->max);
+  }
+  g_free(ramp);
+}
+
+/* Fits a plane z = a + bx*col + by*row to the raw buffer and subtracts it.
+ * Gives the same result as gwy_data_field_fit_plane() followed by
+ * gwy_data_field_plane_level(), but only touches the buffer, so it can run in
+ * a worker thread. */
+void level_plane_buffer(gdouble *data, gint xres, gint yres,
+                        LevelResult *result) {
+  LevelResult level;
+
+  level_plane_fit(data, xres, yres, &level);
+  level_plane_subtract(data, xres, yres, &level);
+  if (result) {
+    *result = level;
+  }
+}
+
+/* Subtracts the plane of result, fitted to the xres x yres data, from its
+ * width x height decimation made by decimate_buffer(). As the plane is
+ * linear, its average over a block is its value in the centre of the block,
+ * so this equals leveling first and decimating afterwards. */
+void level_plane_subtract_decimated(gdouble *thumb, gint width, gint height,
+                                    gint xres, gint yres, LevelResult *result) {
+  gdouble *ramp = g_new(gdouble, width);
+  for (gint tj = 0; tj < width; tj++) {
+    gint j0 = (gint)((gint64)tj * xres / width);
+    gint j1 = MAX(j0 + 1, (gint)((gint64)(tj + 1) * xres / width));
+    ramp[tj] = result->bx * 0.5 * (j0 + j1 - 1);
+  }
+
+  result->min = G_MAXDOUBLE;
+  result->max = -G_MAXDOUBLE;
+  for (gint ti = 0; ti < height; ti++) {
+    gint i0 = (gint)((gint64)ti * yres / height);
+    gint i1 = MAX(i0 + 1, (gint)((gint64)(ti + 1) * yres / height));
+    row_subtract(thumb + (gsize)ti * width, ramp, width,
+                 result->a + result->by * 0.5 * (i0 + i1 - 1), &result->min,
+                 &result->max);
+  }
+  g_free(ramp);
+}
+
+/* Area-averages data to width x height pixels. When the target is larger
+ * than the source in some direction the nearest pixel is taken instead.
+ *
+ * The source is read once, row by row, and every row is summed into the
+ * target row it falls into; the block boundaries along x are computed once
+ * for all rows. */
+void decimate_buffer(const gdouble *data, gint xres, gint yres,
+                     gdouble *target, gint width, gint height) {
+  gint *j0 = g_new(gint, 2 * width), *j1 = j0 + width;
+  for (gint tj = 0; tj < width; tj++) {
+    j0[tj] = (gint)((gint64)tj * xres / width);
+    j1[tj] = MAX(j0[tj] + 1, (gint)((gint64)(tj + 1) * xres / width));
+  }
+
+  for (gint ti = 0; ti < height; ti++) {
+    gint i0 = (gint)((gint64)ti * yres / height);
+    gint i1 = MAX(i0 + 1, (gint)((gint64)(ti + 1) * yres / height));
+    gdouble *trow = target + (gsize)ti * width;
+
+    for (gint tj = 0; tj < width; tj++) {
+      trow[tj] = 0.0;
+    }
+    for (gint i = i0; i < i1; i++) {
+      const gdouble *row = data + (gsize)i * xres;
+      for (gint tj = 0; tj < width; tj++) {
+        gdouble s = 0.0;
+        for (gint j = j0[tj]; j < j1[tj]; j++) {
+          s += row[j];
+        }
+        trow[tj] += s;
+      }
+    }
+    for (gint tj = 0; tj < width; tj++) {
+      trow[tj] /= (gdouble)(i1 - i0) * (j1[tj] - j0[tj]);
+    }
+  }
+  g_free(j0);
+}
+
+/* Thumbnail dimensions fitting into THUMBNAIL_SIZE with the aspect ratio of
+ * the data */
+void thumbnail_size(gint xres, gint yres, gint *width, gint *height) {
+  gdouble scale = MIN((gdouble)THUMBNAIL_SIZE / xres,
+                      (gdouble)THUMBNAIL_SIZE / yres);
+  *width = MAX(1, (gint)(xres * scale + 0.5));
+  *height = MAX(1, (gint)(yres * scale + 0.5));
+}
+
+/*
+ * Drift estimation.
+ *
+ * Both frames are halved repeatedly down to about DRIFT_COARSE_SIZE pixels,
+ * where phase correlation (FFTW, mean-free Hann windowed data) gives the
+ * integer displacement. On every finer level the doubled displacement is
+ * corrected by searching the best normalized cross-correlation within
+ * DRIFT_REFINE_RADIUS pixels, and at full resolution a parabola through the
+ * neighbouring scores gives the sub-pixel part. The cost is thus
+ * proportional to the number of pixels, not to the size of the search range.
+ *
+ * A seed restricts the coarse peak to DRIFT_SEED_RADIUS pixels around it.
+ * This resolves ambiguous correlations of periodic structures.
+ */
+#define DRIFT_SEED_RADIUS 8
+#define DRIFT_REFINE_RADIUS 2
+#define DRIFT_COARSE_SIZE 128
+#define DRIFT_MIN_SIZE 16
+#define DRIFT_MAX_LEVELS 12
+
+/* Planning is the only part of FFTW that is not thread safe */
+static GMutex fftw_plan_lock;
+
+/* Fills target with the mean-free data multiplied by a Hann window */
+static void drift_window_frame(const gdouble *data, gint xres, gint yres,
+                               const gdouble *xwin, const gdouble *ywin,
+                               gdouble *target) {
+  gsize n = (gsize)xres * yres;
+  gdouble mean = 0.0;
+
+  for (gsize k = 0; k < n; k++) {
+    mean += data[k];
+  }
+  mean /= n;
+
+  for (gint i = 0; i < yres; i++) {
+    const gdouble *row = data + (gsize)i * xres;
+    gdouble *trow = target + (gsize)i * xres;
+    for (gint j = 0; j < xres; j++) {
+      trow[j] = (row[j] - mean) * xwin[j] * ywin[i];
+    }
+  }
+}
+
+static gdouble *drift_hann_window(gint n) {
+  gdouble *window = g_new(gdouble, n);
+
+  for (gint k = 0; k < n; k++) {
+    window[k] = n > 1 ? 0.5 - 0.5 * cos(2.0 * G_PI * k / (n - 1)) : 1.0;
+  }
+  return window;
+}
+
+/* Maps a position in the circular correlation to a signed shift */
+static gint drift_wrap_shift(gint k, gint n) { return k > n / 2 ? k - n : k; }
+
+/* Integer displacement of b against a by phase correlation. With a seed, only
+ * shifts within radius around it are considered. */
+static void drift_phase_correlate(const gdouble *a_data, const gdouble *b_data,
+                                  gint xres, gint yres, gboolean seeded,
+                                  gdouble seed_x, gdouble seed_y, gint radius,
+                                  gint *dx, gint *dy) {
+  gint cxres = xres / 2 + 1;
+  gsize n = (gsize)xres * yres;
+  gdouble *a = fftw_alloc_real(n);
+  gdouble *b = fftw_alloc_real(n);
+  fftw_complex *fa = fftw_alloc_complex((gsize)cxres * yres);
+  fftw_complex *fb = fftw_alloc_complex((gsize)cxres * yres);
+
+  g_mutex_lock(&fftw_plan_lock);
+  fftw_plan forward_a = fftw_plan_dft_r2c_2d(yres, xres, a, fa, FFTW_ESTIMATE);
+  fftw_plan forward_b = fftw_plan_dft_r2c_2d(yres, xres, b, fb, FFTW_ESTIMATE);
+  fftw_plan backward = fftw_plan_dft_c2r_2d(yres, xres, fa, a, FFTW_ESTIMATE);
+  g_mutex_unlock(&fftw_plan_lock);
+
+  gdouble *xwin = drift_hann_window(xres);
+  gdouble *ywin = drift_hann_window(yres);
+  drift_window_frame(a_data, xres, yres, xwin, ywin, a);
+  drift_window_frame(b_data, xres, yres, xwin, ywin, b);
+  g_free(xwin);
+  g_free(ywin);
+
+  fftw_execute(forward_a);
+  fftw_execute(forward_b);
+  // Normalized conj(A) B, so that the peak is at the displacement of b
+  for (gsize k = 0; k < (gsize)cxres * yres; k++) {
+    gdouble re = fa[k][0] * fb[k][0] + fa[k][1] * fb[k][1];
+    gdouble im = fa[k][0] * fb[k][1] - fa[k][1] * fb[k][0];
+    gdouble mag = hypot(re, im);
+    fa[k][0] = mag > 0.0 ? re / mag : 0.0;
+    fa[k][1] = mag > 0.0 ? im / mag : 0.0;
+  }
+  fftw_execute(backward);
+
+  gint best_i = 0, best_j = 0;
+  gdouble best = -G_MAXDOUBLE;
+  if (seeded) {
+    gint si = (gint)floor(seed_y + 0.5);
+    gint sj = (gint)floor(seed_x + 0.5);
+    for (gint di = -radius; di <= radius; di++) {
+      for (gint dj = -radius; dj <= radius; dj++) {
+        gint i = ((si + di) % yres + yres) % yres;
+        gint j = ((sj + dj) % xres + xres) % xres;
+        if (a[(gsize)i * xres + j] > best) {
+          best = a[(gsize)i * xres + j];
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+  } else {
+    for (gsize k = 0; k < n; k++) {
+      if (a[k] > best) {
+        best = a[k];
+        best_i = k / xres;
+        best_j = k % xres;
+      }
+    }
+  }
+  *dx = drift_wrap_shift(best_j, xres);
+  *dy = drift_wrap_shift(best_i, yres);
+
+  g_mutex_lock(&fftw_plan_lock);
+  fftw_destroy_plan(forward_a);
+  fftw_destroy_plan(forward_b);
+  fftw_destroy_plan(backward);
+  g_mutex_unlock(&fftw_plan_lock);
+  fftw_free(a);
+  fftw_free(b);
+  fftw_free(fa);
+  fftw_free(fb);
+}
+
+/* Normalized cross-correlation of a and b displaced by (dx, dy) over the
+ * part of the region of a at (x0, y0) of width x height pixels that overlaps
+ * b; -G_MAXDOUBLE if the overlap is too small to mean anything. */
+gdouble drift_region_score(const gdouble *a, const gdouble *b, gint xres,
+                           gint yres, gint x0, gint y0, gint width,
+                           gint height, gint dx, gint dy) {
+  gint i0 = MAX(y0, -dy), i1 = MIN(y0 + height, yres - dy);
+  gint j0 = MAX(x0, -dx), j1 = MIN(x0 + width, xres - dx);
+  if (4 * (i1 - i0) < height || 4 * (j1 - j0) < width) {
+    return -G_MAXDOUBLE;
+  }
+
+  gdouble sa = 0.0, sb = 0.0, saa = 0.0, sbb = 0.0, sab = 0.0;
+  for (gint i = i0; i < i1; i++) {
+    const gdouble *arow = a + (gsize)i * xres;
+    const gdouble *brow = b + (gsize)(i + dy) * xres + dx;
+    for (gint j = j0; j < j1; j++) {
+      sa += arow[j];
+      sb += brow[j];
+      saa += arow[j] * arow[j];
+      sbb += brow[j] * brow[j];
+      sab += arow[j] * brow[j];
+    }
+  }
+
+  gdouble n = (gdouble)(i1 - i0) * (j1 - j0);
+  gdouble var_a = saa - sa * sa / n, var_b = sbb - sb * sb / n;
+  if (var_a <= 0.0 || var_b <= 0.0) {
+    return 0.0;
+  }
+  return (sab - sa * sb / n) / sqrt(var_a * var_b);
+}
+
+/* drift_region_score() over the whole frame */
+gdouble drift_match_score(const gdouble *a, const gdouble *b, gint xres,
+                          gint yres, gint dx, gint dy) {
+  return drift_region_score(a, b, xres, yres, 0, 0, xres, yres, dx, dy);
+}
+
+/* Moves (dx, dy) to the best match within DRIFT_REFINE_RADIUS */
+static gdouble drift_refine(const gdouble *a, const gdouble *b, gint xres,
+                            gint yres, gint *dx, gint *dy) {
+  gint best_dx = *dx, best_dy = *dy;
+  gdouble best = -G_MAXDOUBLE;
+
+  for (gint di = -DRIFT_REFINE_RADIUS; di <= DRIFT_REFINE_RADIUS; di++) {
+    for (gint dj = -DRIFT_REFINE_RADIUS; dj <= DRIFT_REFINE_RADIUS; dj++) {
+      gdouble score = drift_match_score(a, b, xres, yres, *dx + dj, *dy + di);
+      if (score > best) {
+        best = score;
+        best_dx = *dx + dj;
+        best_dy = *dy + di;
+      }
+    }
+  }
+  *dx = best_dx;
+  *dy = best_dy;
+  return best;
+}
+
+/* Vertex of the parabola through (-1, minus), (0, centre), (1, plus) */
+gdouble drift_parabola_peak(gdouble minus, gdouble centre, gdouble plus) {
+  gdouble denom = minus - 2.0 * centre + plus;
+
+  if (minus == -G_MAXDOUBLE || plus == -G_MAXDOUBLE || denom >= 0.0) {
+    return 0.0;
+  }
+  return CLAMP(0.5 * (minus - plus) / denom, -0.5, 0.5);
+}
+
+/* Displacement (x, y) of b against a in pixels, coarse to fine. With a seed,
+ * the coarse peak is only searched around (seed_x, seed_y). Returns FALSE if
+ * no displacement leaves enough overlap. */
+gboolean drift_estimate_shift(const gdouble *a_data, const gdouble *b_data,
+                              gint xres, gint yres, gboolean seeded,
+                              gdouble seed_x, gdouble seed_y, gdouble *x,
+                              gdouble *y) {
+  // Level 0 is the data itself, every further level is half the size
+  const gdouble *a[DRIFT_MAX_LEVELS], *b[DRIFT_MAX_LEVELS];
+  gint xl[DRIFT_MAX_LEVELS], yl[DRIFT_MAX_LEVELS];
+  gint n_levels = 1;
+
+  a[0] = a_data;
+  b[0] = b_data;
+  xl[0] = xres;
+  yl[0] = yres;
+  while (n_levels < DRIFT_MAX_LEVELS &&
+         MAX(xl[n_levels - 1], yl[n_levels - 1]) > DRIFT_COARSE_SIZE &&
+         MIN(xl[n_levels - 1], yl[n_levels - 1]) >= 2 * DRIFT_MIN_SIZE) {
+    gint l = n_levels++;
+    xl[l] = xl[l - 1] / 2;
+    yl[l] = yl[l - 1] / 2;
+    gdouble *la = g_new(gdouble, (gsize)xl[l] * yl[l]);
+    gdouble *lb = g_new(gdouble, (gsize)xl[l] * yl[l]);
+    decimate_buffer(a[l - 1], xl[l - 1], yl[l - 1], la, xl[l], yl[l]);
+    decimate_buffer(b[l - 1], xl[l - 1], yl[l - 1], lb, xl[l], yl[l]);
+    a[l] = la;
+    b[l] = lb;
+  }
+
+  gint top = n_levels - 1;
+  gdouble xscale = (gdouble)xl[top] / xres, yscale = (gdouble)yl[top] / yres;
+  gint radius = MAX(DRIFT_REFINE_RADIUS,
+                    (gint)ceil(DRIFT_SEED_RADIUS * MAX(xscale, yscale)));
+  gint dx, dy;
+  drift_phase_correlate(a[top], b[top], xl[top], yl[top], seeded,
+                        seed_x * xscale, seed_y * yscale, radius, &dx, &dy);
+
+  gdouble score = 0.0;
+  for (gint l = top; l >= 0; l--) {
+    if (l < top) {
+      dx = (gint)floor(dx * (gdouble)xl[l] / xl[l + 1] + 0.5);
+      dy = (gint)floor(dy * (gdouble)yl[l] / yl[l + 1] + 0.5);
+    }
+    score = drift_refine(a[l], b[l], xl[l], yl[l], &dx, &dy);
+  }
+
+  *x = dx + drift_parabola_peak(
+                 drift_match_score(a[0], b[0], xres, yres, dx - 1, dy), score,
+                 drift_match_score(a[0], b[0], xres, yres, dx + 1, dy));
+  *y = dy + drift_parabola_peak(
+                 drift_match_score(a[0], b[0], xres, yres, dx, dy - 1), score,
+                 drift_match_score(a[0], b[0], xres, yres, dx, dy + 1));
+
+  for (gint l = 1; l < n_levels; l++) {
+    g_free((gdouble *)a[l]);
+    g_free((gdouble *)b[l]);
+  }
+  return score > -G_MAXDOUBLE;
+}
+
+/* Resamples the width x height window at (x, y) of the xres wide source
+ * bilinearly into target. The window must lie inside the source. */
+void drift_resample_frame(const gdouble *source, gint xres, gdouble x,
+                          gdouble y, gdouble *target, gint width, gint height) {
+  gint ix = (gint)floor(x), iy = (gint)floor(y);
+  gdouble fx = x - ix, fy = y - iy;
+
+  for (gint i = 0; i < height; i++) {
+    const gdouble *r0 = source + (gsize)(i + iy) * xres + ix;
+    // The row below is only read with a non-zero weight
+    const gdouble *r1 = fy > 0.0 ? r0 + xres : r0;
+    row_resample(r0, r1, target + (gsize)i * width, width, fx, fy);
+  }
+}
+
+/*
+ * Feature tracking.
+ *
+ * A template is matched by normalized cross-correlation at every candidate
+ * position. The sums over the image windows come from integral images and
+ * the template products from row_dot(), so a candidate costs one SIMD dot
+ * product per template row.
+ */
+
+/* Copies the side x side window centred at (cx, cy) mean-free into tmpl and
+ * returns its norm, 0 if it has no contrast. The window must lie inside the
+ * frame. */
+gdouble track_template(const gdouble *data, gint xres, gint cx, gint cy,
+                       gint side, gdouble *tmpl) {
+  const gint half = side / 2;
+  gdouble mean = 0.0, norm = 0.0;
+
+  for (gint i = 0; i < side; i++) {
+    for (gint j = 0; j < side; j++) {
+      tmpl[i * side + j] =
+          data[(gsize)(cy - half + i) * xres + (cx - half + j)];
+      mean += tmpl[i * side + j];
+    }
+  }
+  mean /= side * side;
+  for (gint k = 0; k < side * side; k++) {
+    tmpl[k] -= mean;
+    norm += tmpl[k] * tmpl[k];
+  }
+  return sqrt(norm);
+}
+
+/* Best match of the side x side template within radius around (*x, *y), in
+ * pixels. Returns the normalized correlation, 0 if nothing could be
+ * matched. */
+gdouble track_match(const gdouble *data, gint xres, gint yres,
+                    const gdouble *tmpl, gint side, gdouble tmpl_norm,
+                    gint radius, gdouble *x, gdouble *y) {
+  const gint half = side / 2, n_scores = 2 * radius + 1;
+  gint cx = (gint)floor(*x + 0.5), cy = (gint)floor(*y + 0.5);
+
+  // Candidate centres, so that the whole template lies inside the frame
+  gint i0 = MAX(cy - radius, half), i1 = MIN(cy + radius, yres - 1 - half);
+  gint j0 = MAX(cx - radius, half), j1 = MIN(cx + radius, xres - 1 - half);
+  if (i0 > i1 || j0 > j1) {
+    return 0.0;
+  }
+
+  // Integral images of z and z^2 over the searched region
+  gint rx = j0 - half, ry = i0 - half;
+  gint rw = j1 - j0 + side, rh = i1 - i0 + side;
+  gsize stride = rw + 1;
+  gdouble *sum = g_new0(gdouble, stride * (rh + 1));
+  gdouble *sum2 = g_new0(gdouble, stride * (rh + 1));
+  for (gint i = 0; i < rh; i++) {
+    const gdouble *row = data + (gsize)(ry + i) * xres + rx;
+    gdouble s = 0.0, s2 = 0.0;
+    for (gint j = 0; j < rw; j++) {
+      s += row[j];
+      s2 += row[j] * row[j];
+      sum[(i + 1) * stride + j + 1] = sum[i * stride + j + 1] + s;
+      sum2[(i + 1) * stride + j + 1] = sum2[i * stride + j + 1] + s2;
+    }
+  }
+
+  gdouble *scores = g_new(gdouble, n_scores * n_scores);
+  for (gint k = 0; k < n_scores * n_scores; k++) {
+    scores[k] = -G_MAXDOUBLE;
+  }
+
+  gdouble n = (gdouble)side * side;
+  gdouble best = -G_MAXDOUBLE;
+  gint best_i = cy, best_j = cx;
+  for (gint i = i0; i <= i1; i++) {
+    for (gint j = j0; j <= j1; j++) {
+      gsize a = (gsize)(i - half - ry) * stride + (j - half - rx);
+      gsize b = a + side * stride;
+      gdouble s = sum[b + side] - sum[b] - sum[a + side] + sum[a];
+      gdouble s2 = sum2[b + side] - sum2[b] - sum2[a + side] + sum2[a];
+      gdouble var = s2 - s * s / n;
+      if (var <= 0.0) {
+        continue;
+      }
+
+      // The template is mean-free, so the mean of the window drops out
+      gdouble dot = 0.0;
+      const gdouble *win = data + (gsize)(i - half) * xres + (j - half);
+      for (gint r = 0; r < side; r++) {
+        dot += row_dot(tmpl + r * side, win + (gsize)r * xres, side);
+      }
+
+      gdouble score = dot / (tmpl_norm * sqrt(var));
+      scores[(i - cy + radius) * n_scores + (j - cx + radius)] = score;
+      if (score > best) {
+        best = score;
+        best_i = i;
+        best_j = j;
+      }
+    }
+  }
+
+  if (best > -G_MAXDOUBLE) {
+    gint si = best_i - cy + radius, sj = best_j - cx + radius;
+    *x = best_j;
+    *y = best_i;
+    if (sj > 0 && sj < n_scores - 1) {
+      *x += drift_parabola_peak(scores[si * n_scores + sj - 1], best,
+                                scores[si * n_scores + sj + 1]);
+    }
+    if (si > 0 && si < n_scores - 1) {
+      *y += drift_parabola_peak(scores[(si - 1) * n_scores + sj], best,
+                                scores[(si + 1) * n_scores + sj]);
+    }
+  }
+
+  g_free(scores);
+  g_free(sum);
+  g_free(sum2);
+  return MAX(best, 0.0);
+}
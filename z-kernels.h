@@ -0,0 +1,273 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef Z_KERNELS_H
+#define Z_KERNELS_H
+
+#include <glib.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define THUMBNAIL_SIZE 200
+
+/* Plane removed by level_plane_buffer() and the value range of the leveled
+ * data, which is obtained for free while subtracting the plane. */
+typedef struct {
+  gdouble a;
+  gdouble bx;
+  gdouble by;
+  gdouble min;
+  gdouble max;
+} LevelResult;
+
+/* Plane leveling and decimation, see z-kernels.c */
+void level_plane_fit(const gdouble *data, gint xres, gint yres,
+                     LevelResult *result);
+void level_plane_subtract(gdouble *data, gint xres, gint yres,
+                          LevelResult *result);
+void level_plane_buffer(gdouble *data, gint xres, gint yres,
+                        LevelResult *result);
+void level_plane_subtract_decimated(gdouble *thumb, gint width, gint height,
+                                    gint xres, gint yres, LevelResult *result);
+void decimate_buffer(const gdouble *data, gint xres, gint yres,
+                     gdouble *target, gint width, gint height);
+void thumbnail_size(gint xres, gint yres, gint *width, gint *height);
+
+/* Drift estimation and correction */
+gdouble drift_region_score(const gdouble *a, const gdouble *b, gint xres,
+                           gint yres, gint x0, gint y0, gint width,
+                           gint height, gint dx, gint dy);
+gdouble drift_match_score(const gdouble *a, const gdouble *b, gint xres,
+                          gint yres, gint dx, gint dy);
+gdouble drift_parabola_peak(gdouble minus, gdouble centre, gdouble plus);
+gboolean drift_estimate_shift(const gdouble *a_data, const gdouble *b_data,
+                              gint xres, gint yres, gboolean seeded,
+                              gdouble seed_x, gdouble seed_y, gdouble *x,
+                              gdouble *y);
+void drift_resample_frame(const gdouble *source, gint xres, gdouble x,
+                          gdouble y, gdouble *target, gint width, gint height);
+
+/* Feature tracking */
+gdouble track_template(const gdouble *data, gint xres, gint cx, gint cy,
+                       gint side, gdouble *tmpl);
+gdouble track_match(const gdouble *data, gint xres, gint yres,
+                    const gdouble *tmpl, gint side, gdouble tmpl_norm,
+                    gint radius, gdouble *x, gdouble *y);
+
+/*
+ * Row kernels.
+ *
+ * These are inlined into the loops above and in the module. The SIMD
+ * variants are picked at compile time: SSE2 is part of x86-64, AVX is only
+ * used with ./configure --enable-avx, as the module then needs a CPU that
+ * has it.
+ */
+/* Sums of z and col*z over one row */
+static inline void row_moments(const gdouble *row, gint xres, gdouble *sum_z,
+                               gdouble *sum_xz) {
+  gdouble z = 0.0, xz = 0.0;
+  gint j = 0;
+
+#if defined(__AVX__)
+  __m256d acc_z = _mm256_setzero_pd(), acc_xz = _mm256_setzero_pd();
+  __m256d cols = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+  const __m256d step = _mm256_set1_pd(4.0);
+  for (; j + 4 <= xres; j += 4) {
+    __m256d v = _mm256_loadu_pd(row + j);
+    acc_z = _mm256_add_pd(acc_z, v);
+    acc_xz = _mm256_add_pd(acc_xz, _mm256_mul_pd(v, cols));
+    cols = _mm256_add_pd(cols, step);
+  }
+  gdouble lanes_z[4], lanes_xz[4];
+  _mm256_storeu_pd(lanes_z, acc_z);
+  _mm256_storeu_pd(lanes_xz, acc_xz);
+  z = (lanes_z[0] + lanes_z[1]) + (lanes_z[2] + lanes_z[3]);
+  xz = (lanes_xz[0] + lanes_xz[1]) + (lanes_xz[2] + lanes_xz[3]);
+#elif defined(__SSE2__)
+  __m128d acc_z = _mm_setzero_pd(), acc_xz = _mm_setzero_pd();
+  __m128d cols = _mm_set_pd(1.0, 0.0);
+  const __m128d step = _mm_set1_pd(2.0);
+  for (; j + 2 <= xres; j += 2) {
+    __m128d v = _mm_loadu_pd(row + j);
+    acc_z = _mm_add_pd(acc_z, v);
+    acc_xz = _mm_add_pd(acc_xz, _mm_mul_pd(v, cols));
+    cols = _mm_add_pd(cols, step);
+  }
+  gdouble lanes_z[2], lanes_xz[2];
+  _mm_storeu_pd(lanes_z, acc_z);
+  _mm_storeu_pd(lanes_xz, acc_xz);
+  z = lanes_z[0] + lanes_z[1];
+  xz = lanes_xz[0] + lanes_xz[1];
+#endif
+
+  for (; j < xres; j++) {
+    z += row[j];
+    xz += j * row[j];
+  }
+
+  *sum_z = z;
+  *sum_xz = xz;
+}
+
+/* row[j] -= offset + ramp[j], keeping track of the range of the result */
+static inline void row_subtract(gdouble *row, const gdouble *ramp, gint xres,
+                                gdouble offset, gdouble *min, gdouble *max) {
+  gdouble lo = *min, hi = *max;
+  gint j = 0;
+
+#if defined(__AVX__)
+  __m256d off = _mm256_set1_pd(offset);
+  __m256d vlo = _mm256_set1_pd(lo), vhi = _mm256_set1_pd(hi);
+  for (; j + 4 <= xres; j += 4) {
+    __m256d v = _mm256_sub_pd(_mm256_loadu_pd(row + j),
+                              _mm256_add_pd(off, _mm256_loadu_pd(ramp + j)));
+    _mm256_storeu_pd(row + j, v);
+    vlo = _mm256_min_pd(vlo, v);
+    vhi = _mm256_max_pd(vhi, v);
+  }
+  gdouble lanes_lo[4], lanes_hi[4];
+  _mm256_storeu_pd(lanes_lo, vlo);
+  _mm256_storeu_pd(lanes_hi, vhi);
+  for (int k = 0; k < 4; k++) {
+    lo = MIN(lo, lanes_lo[k]);
+    hi = MAX(hi, lanes_hi[k]);
+  }
+#elif defined(__SSE2__)
+  __m128d off = _mm_set1_pd(offset);
+  __m128d vlo = _mm_set1_pd(lo), vhi = _mm_set1_pd(hi);
+  for (; j + 2 <= xres; j += 2) {
+    __m128d v = _mm_sub_pd(_mm_loadu_pd(row + j),
+                           _mm_add_pd(off, _mm_loadu_pd(ramp + j)));
+    _mm_storeu_pd(row + j, v);
+    vlo = _mm_min_pd(vlo, v);
+    vhi = _mm_max_pd(vhi, v);
+  }
+  gdouble lanes_lo[2], lanes_hi[2];
+  _mm_storeu_pd(lanes_lo, vlo);
+  _mm_storeu_pd(lanes_hi, vhi);
+  lo = MIN(lo, MIN(lanes_lo[0], lanes_lo[1]));
+  hi = MAX(hi, MAX(lanes_hi[0], lanes_hi[1]));
+#endif
+
+  for (; j < xres; j++) {
+    gdouble v = row[j] - (offset + ramp[j]);
+    row[j] = v;
+    lo = MIN(lo, v);
+    hi = MAX(hi, v);
+  }
+
+  *min = lo;
+  *max = hi;
+}
+
+/* out[j] = bilinear interpolation between r0[j], r0[j+1], r1[j] and r1[j+1]
+ * with the fixed fractions fx and fy. With fx == 0 the column j+1 is never
+ * read. out may point at or before r0, as when resampling in place. */
+static inline void row_resample(const gdouble *r0, const gdouble *r1,
+                                gdouble *out, gint n, gdouble fx, gdouble fy) {
+  gdouble w00 = (1.0 - fx) * (1.0 - fy), w01 = fx * (1.0 - fy);
+  gdouble w10 = (1.0 - fx) * fy, w11 = fx * fy;
+  gint j = 0;
+
+  if (fx == 0.0) {
+#if defined(__AVX__)
+    __m256d v0 = _mm256_set1_pd(w00), v1 = _mm256_set1_pd(w10);
+    for (; j + 4 <= n; j += 4) {
+      __m256d v = _mm256_add_pd(_mm256_mul_pd(v0, _mm256_loadu_pd(r0 + j)),
+                                _mm256_mul_pd(v1, _mm256_loadu_pd(r1 + j)));
+      _mm256_storeu_pd(out + j, v);
+    }
+#elif defined(__SSE2__)
+    __m128d v0 = _mm_set1_pd(w00), v1 = _mm_set1_pd(w10);
+    for (; j + 2 <= n; j += 2) {
+      __m128d v = _mm_add_pd(_mm_mul_pd(v0, _mm_loadu_pd(r0 + j)),
+                             _mm_mul_pd(v1, _mm_loadu_pd(r1 + j)));
+      _mm_storeu_pd(out + j, v);
+    }
+#endif
+    for (; j < n; j++) {
+      out[j] = w00 * r0[j] + w10 * r1[j];
+    }
+    return;
+  }
+
+#if defined(__AVX__)
+  __m256d v00 = _mm256_set1_pd(w00), v01 = _mm256_set1_pd(w01);
+  __m256d v10 = _mm256_set1_pd(w10), v11 = _mm256_set1_pd(w11);
+  for (; j + 4 <= n; j += 4) {
+    __m256d top =
+        _mm256_add_pd(_mm256_mul_pd(v00, _mm256_loadu_pd(r0 + j)),
+                      _mm256_mul_pd(v01, _mm256_loadu_pd(r0 + j + 1)));
+    __m256d bottom =
+        _mm256_add_pd(_mm256_mul_pd(v10, _mm256_loadu_pd(r1 + j)),
+                      _mm256_mul_pd(v11, _mm256_loadu_pd(r1 + j + 1)));
+    _mm256_storeu_pd(out + j, _mm256_add_pd(top, bottom));
+  }
+#elif defined(__SSE2__)
+  __m128d v00 = _mm_set1_pd(w00), v01 = _mm_set1_pd(w01);
+  __m128d v10 = _mm_set1_pd(w10), v11 = _mm_set1_pd(w11);
+  for (; j + 2 <= n; j += 2) {
+    __m128d top = _mm_add_pd(_mm_mul_pd(v00, _mm_loadu_pd(r0 + j)),
+                             _mm_mul_pd(v01, _mm_loadu_pd(r0 + j + 1)));
+    __m128d bottom = _mm_add_pd(_mm_mul_pd(v10, _mm_loadu_pd(r1 + j)),
+                                _mm_mul_pd(v11, _mm_loadu_pd(r1 + j + 1)));
+    _mm_storeu_pd(out + j, _mm_add_pd(top, bottom));
+  }
+#endif
+  for (; j < n; j++) {
+    out[j] = w00 * r0[j] + w01 * r0[j + 1] + w10 * r1[j] + w11 * r1[j + 1];
+  }
+}
+
+/* Dot product of a and b */
+static inline gdouble row_dot(const gdouble *a, const gdouble *b, gint n) {
+  gdouble sum = 0.0;
+  gint j = 0;
+
+#if defined(__AVX__)
+  __m256d acc = _mm256_setzero_pd();
+  for (; j + 4 <= n; j += 4) {
+    acc = _mm256_add_pd(
+        acc, _mm256_mul_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+  }
+  gdouble lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__SSE2__)
+  __m128d acc = _mm_setzero_pd();
+  for (; j + 2 <= n; j += 2) {
+    acc = _mm_add_pd(acc,
+                     _mm_mul_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j)));
+  }
+  gdouble lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+
+  for (; j < n; j++) {
+    sum += a[j] * b[j];
+  }
+  return sum;
+}
+
+#endif
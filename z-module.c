@@ -33,6 +33,7 @@
 #include "libprocess/gwyprocessenums.h"
 #include <app/gwyapp.h>
 #include <app/gwymoduleutils.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <libgwyddion/gwymacros.h>
 #include <libgwyddion/gwymath.h>
@@ -42,10 +43,15 @@
 #include <libprocess/filters.h>
 #include <libprocess/level.h>
 #include <libprocess/stats.h>
+#include <libdraw/gwygradient.h>
+#include <libdraw/gwypixfield.h>
 #include <stdbool.h>
 #include <stdio.h>
 
-#include <dirent.h>
+#include "z-io.h"
+#include "z-kernels.h"
+#include "z-sheet.h"
+#include "z-stats.h"
 
 #define MOD_NAME PACKAGE_NAME
 
@@ -57,25 +63,77 @@ typedef struct DriftCorrectionData DriftCorrectionData;
 struct SelectedImage;
 typedef struct SelectedImage SelectedImage;
 
+struct DriftPair;
+typedef struct DriftPair DriftPair;
+
+struct LevelBatch;
+typedef struct LevelBatch LevelBatch;
+
+typedef void (*WorkFunc)(gpointer user_data);
+
 static gboolean module_register(void);
 static void level_all(GwyContainer *data, GwyRunType run,
                       G_GNUC_UNUSED const gchar *name);
+static void level_all_open(GwyContainer *data, GwyRunType run,
+                           G_GNUC_UNUSED const gchar *name);
 static void focus_main_window(GwyContainer *data, GwyRunType run,
                               G_GNUC_UNUSED const gchar *name);
-static void level_plane(GwyDataField *data_field);
+static void performance_stats(GwyContainer *data, GwyRunType run,
+                              G_GNUC_UNUSED const gchar *name);
+static GdkPixbuf *create_thumbnail(GwyContainer *container, gint img_id,
+                                   const gdouble *thumb, gint width,
+                                   gint height, const LevelResult *level);
+
+static void worker_pool_push(WorkFunc func, gpointer user_data);
+static LevelBatch *level_batch_new(void);
+static void level_batch_add_container(GwyContainer *container,
+                                      LevelBatch *batch);
+static void level_batch_run(LevelBatch *batch);
 
 static void container_overview(GwyContainer *data, GwyRunType run,
                                G_GNUC_UNUSED const gchar *name);
 static gboolean present_if_exists(const gchar *title);
+typedef struct OverviewFile OverviewFile;
 static GtkWidget *create_iconview(GwyContainer *data);
+static GtkWidget *iconview_new(void);
+static GtkWidget *iconview_scrolled(GtkIconView *icon_view);
+static OverviewFile *iconview_append_file(GtkIconView *icon_view,
+                                          const gchar *filename,
+                                          const gchar *cache_key,
+                                          gboolean indexed);
+static void iconview_append_channel(GtkIconView *icon_view,
+                                    GwyContainer *container, gint img_id,
+                                    OverviewFile *file);
+static GwyContainer *open_overview_file(GtkListStore *store,
+                                        const gchar *filename);
 static gboolean on_icon_dbl_click(GtkIconView *icon_view, GtkTreePath *path);
-
+static void resident_container_add(GwyContainer *container);
+static void resident_container_touch(GwyContainer *container);
+static void resident_container_drop(gint container_id);
+static GtkWidget *memory_budget_spin_new(void);
+static GtkWidget *sheet_button_new(GtkWidget *icon_view);
+static void iconview_remove_file(GtkIconView *icon_view, OverviewFile *file,
+                                 GArray *container_ids);
+
+typedef struct FolderEntry FolderEntry;
 static void folder_overview(GwyContainer *data, GwyRunType run,
                             G_GNUC_UNUSED const gchar *name);
-static void dirname(const char *path, char *dir);
 static void basename(const char *path, char *base);
 static bool endswith(const char *str, const char *suffix);
-static char *concat_path(const char *dir, const char *filename, char *fullpath);
+static gchar *thumbnail_cache_key(const gchar *filename);
+static gchar *thumbnail_cache_file(const gchar *key, gint img_id);
+static void thumbnail_cache_remove(gpointer user_data);
+static void thumbnail_cache_init(void);
+static void thumbnail_cache_prune(gpointer user_data);
+static gboolean thumbnail_cache_lookup(FolderEntry *entry);
+static void thumbnail_cache_store_index(const gchar *filename,
+                                        const gchar *key, const gint *img_ids,
+                                        gchar **titles, gint n_channels,
+                                        const MulImageInfo *labels);
+static void thumbnail_cache_store_container(const gchar *filename,
+                                            const gchar *key,
+                                            GwyContainer *container);
+static gboolean folder_read_indexed_file(FolderEntry *entry, gint64 file_time);
 
 static void drift_correction(GwyContainer *data, GwyRunType run,
                              G_GNUC_UNUSED const gchar *name);
@@ -92,6 +150,29 @@ static void on_next_btn_click(GtkButton *select_btn,
                               DriftCorrectionData *drift_correction_data);
 static void on_run_btn_click(GtkButton *run_btn,
                              DriftCorrectionData *drift_correction_data);
+static void on_stream_check_toggled(GtkToggleButton *stream_check,
+                                    DriftCorrectionData *dc_data);
+static gboolean drift_estimate_finish(gpointer user_data);
+static gboolean drift_pair_finish(gpointer user_data);
+static void drift_estimate_start(DriftCorrectionData *dc_data,
+                                 GtkWidget *run_btn);
+static gboolean drift_apply_frame_finish(gpointer user_data);
+static gboolean drift_apply_finish(gpointer user_data);
+static void drift_apply_start(DriftCorrectionData *dc_data,
+                              const gchar *stream_dir, gboolean as_brick);
+static GwyDataField *dc_preview_field_new(GwyDataField *source);
+static void dc_ring_reset(DriftCorrectionData *dc_data);
+static void dc_show_frame(DriftCorrectionData *dc_data, gint index);
+static void dc_show_frame_label(DriftCorrectionData *dc_data);
+static void dc_set_status(DriftCorrectionData *dc_data, const gchar *text);
+static void on_dc_window_destroy(GtkWidget *window,
+                                 DriftCorrectionData *dc_data);
+static DriftCorrectionData *dc_data_ref(DriftCorrectionData *dc_data);
+static void dc_data_unref(DriftCorrectionData *dc_data);
+static gboolean dc_data_cancelled(DriftCorrectionData *dc_data);
+static void dc_report_missing(DriftCorrectionData *dc_data, gint index);
+static void on_track_btn_click(GtkButton *track_btn,
+                               DriftCorrectionData *dc_data);
 
 /* The module info. */
 static GwyModuleInfo module_info = {
@@ -119,6 +200,11 @@ static gboolean module_register(void) {
                             GWY_MENU_FLAG_DATA,
                             N_("Level all data in container."));
 
+  gwy_process_func_register(
+      "level_all_open", (GwyProcessFunc)&level_all_open,
+      N_("/Zzz/Level All Open Files"), NULL, GWY_RUN_IMMEDIATE,
+      GWY_MENU_FLAG_DATA, N_("Level all data in all open containers."));
+
   gwy_process_func_register(
       "container_overview", (GwyProcessFunc)&container_overview,
       N_("/Zzz/Container Overview"), NULL, GWY_RUN_INTERACTIVE,
@@ -139,6 +225,13 @@ static gboolean module_register(void) {
       N_("/Zzz/Drift correction"), NULL, GWY_RUN_INTERACTIVE,
       GWY_MENU_FLAG_DATA, N_("Drift correction"));
 
+  gwy_process_func_register(
+      "performance_stats", (GwyProcessFunc)&performance_stats,
+      N_("/Zzz/Performance Stats"), NULL, GWY_RUN_INTERACTIVE, 0,
+      N_("Show timing statistics of the module"));
+
+  z_stats_init();
+  thumbnail_cache_init();
   return TRUE;
 }
 
@@ -150,23 +243,298 @@ static gboolean module_register(void) {
  */
 static void level_all(GwyContainer *data, GwyRunType run,
                       G_GNUC_UNUSED const gchar *name) {
-  gint *data_ids = gwy_app_data_browser_get_data_ids(data);
+  LevelBatch *batch = level_batch_new();
+  level_batch_add_container(data, batch);
+  level_batch_run(batch);
+}
+
+/* Same as level_all(), but for every container in the data browser */
+static void level_all_open(GwyContainer *data, GwyRunType run,
+                           G_GNUC_UNUSED const gchar *name) {
+  LevelBatch *batch = level_batch_new();
+  gwy_app_data_browser_foreach(
+      (GwyAppDataForeachFunc)level_batch_add_container, batch);
+  level_batch_run(batch);
+}
+
+/* Renders a decimated, already leveled buffer with the palette and the
+ * colour range mode of the channel (the defaults if container is NULL). The
+ * full range is the one found by the leveling, the data are not scanned once
+ * more. */
+static GdkPixbuf *create_thumbnail(GwyContainer *container, gint img_id,
+                                   const gdouble *thumb, gint width,
+                                   gint height, const LevelResult *level) {
+  GwyDataField *small = gwy_data_field_new(width, height, width, height, FALSE);
+  memcpy(gwy_data_field_get_data(small), thumb,
+         (gsize)width * height * sizeof(gdouble));
+
+  const guchar *gradient_name = NULL;
+  guint range_type = GWY_LAYER_BASIC_RANGE_FULL;
+  gdouble min = level->min, max = level->max;
+  if (container) {
+    gchar key[32];
+    g_snprintf(key, sizeof(key), "/%d/base/palette", img_id);
+    gwy_container_gis_string_by_name(container, key, &gradient_name);
+    g_snprintf(key, sizeof(key), "/%d/base/range-type", img_id);
+    gwy_container_gis_enum_by_name(container, key, &range_type);
+    if (range_type == GWY_LAYER_BASIC_RANGE_FIXED) {
+      g_snprintf(key, sizeof(key), "/%d/base/min", img_id);
+      gwy_container_gis_double_by_name(container, key, &min);
+      g_snprintf(key, sizeof(key), "/%d/base/max", img_id);
+      gwy_container_gis_double_by_name(container, key, &max);
+    }
+  }
+  GwyGradient *gradient =
+      gwy_gradients_get_gradient((const gchar *)gradient_name);
+
+  GdkPixbuf *thumbnail =
+      gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  if (range_type == GWY_LAYER_BASIC_RANGE_ADAPT) {
+    gwy_pixbuf_draw_data_field_adaptive(thumbnail, small, gradient);
+  } else {
+    if (range_type == GWY_LAYER_BASIC_RANGE_AUTO) {
+      gwy_data_field_get_autorange(small, &min, &max);
+    }
+    gwy_pixbuf_draw_data_field_with_range(thumbnail, small, gradient, min,
+                                          max);
+  }
+  g_object_unref(small);
+
+  return thumbnail;
+}
+
+typedef struct {
+  WorkFunc func;
+  gpointer user_data;
+} WorkItem;
+
+static void work_item_run(gpointer data, G_GNUC_UNUSED gpointer pool_data) {
+  WorkItem *item = data;
+  item->func(item->user_data);
+  g_free(item);
+}
+
+/* All background work of the module runs on one pool sized to the number of
+ * cores. Functions pushed here must not call GTK or emit signals; results are
+ * handed back to the main loop with g_idle_add(). */
+static void worker_pool_push(WorkFunc func, gpointer user_data) {
+  static GThreadPool *pool = NULL;
+
+  if (g_once_init_enter(&pool)) {
+    GThreadPool *new_pool = g_thread_pool_new(
+        work_item_run, NULL, g_get_num_processors(), FALSE, NULL);
+    g_once_init_leave(&pool, new_pool);
+  }
+
+  WorkItem *item = g_new(WorkItem, 1);
+  item->func = func;
+  item->user_data = user_data;
+  g_thread_pool_push(pool, item, NULL);
+}
+
+/* Set on data fields while a level job for them is running, so that
+ * repeated invocations do not level the same field twice */
+#define LEVEL_PENDING_KEY "z-module-level-pending"
+
+/* Fields that change while they are leveled are tried again
+ * LEVEL_RETRY_DELAY ms later, at most LEVEL_MAX_RETRIES times */
+#define LEVEL_RETRY_DELAY 500
+#define LEVEL_MAX_RETRIES 20
+
+/* Plane fitted to a data field, kept until the data change. A plane of all
+ * zeros marks data leveled by this module. */
+#define LEVEL_CACHE_KEY "z-module-level-cache"
+
+static void level_cache_invalidate(GwyDataField *data_field,
+                                   G_GNUC_UNUSED gpointer user_data) {
+  g_object_set_data(G_OBJECT(data_field), LEVEL_CACHE_KEY, NULL);
+}
+
+/* Returns the cached plane of the field, or NULL */
+static const LevelResult *level_cache_get(GwyDataField *data_field) {
+  return g_object_get_data(G_OBJECT(data_field), LEVEL_CACHE_KEY);
+}
+
+static void level_cache_set(GwyDataField *data_field,
+                            const LevelResult *level) {
+  if (!g_signal_handler_find(data_field, G_SIGNAL_MATCH_FUNC, 0, 0, NULL,
+                             level_cache_invalidate, NULL)) {
+    g_signal_connect(data_field, "data-changed",
+                     G_CALLBACK(level_cache_invalidate), NULL);
+  }
+  g_object_set_data_full(G_OBJECT(data_field), LEVEL_CACHE_KEY,
+                         g_memdup(level, sizeof(LevelResult)), g_free);
+}
+
+/* TRUE if this module leveled the field and it did not change since */
+static gboolean level_cache_is_level(GwyDataField *data_field) {
+  const LevelResult *level = level_cache_get(data_field);
+
+  return level && level->a == 0.0 && level->bx == 0.0 && level->by == 0.0;
+}
+
+typedef struct {
+  LevelBatch *batch;
+  GwyDataField *data_field;
+  gdouble *data; // private copy, written back by level_batch_finish()
+  gint xres;
+  gint yres;
+  gboolean have_plane; // the plane is known from the cache
+  LevelResult level;
+  gulong changed_id;
+  gboolean changed; // the field changed meanwhile, the copy is stale
+} LevelJob;
+
+struct LevelBatch {
+  GPtrArray *jobs;
+  GPtrArray *retry; // data fields to try again, referenced
+  gint retries;
+  gint pending;
+};
+
+static LevelBatch *level_batch_new(void) {
+  LevelBatch *batch = g_new0(LevelBatch, 1);
+  batch->jobs = g_ptr_array_new();
+  batch->retry = g_ptr_array_new_with_free_func(g_object_unref);
+  return batch;
+}
+
+static void level_job_mark_changed(LevelJob *job) {
+  job->changed = TRUE;
+}
+
+static void level_batch_add(LevelBatch *batch, GwyDataField *data_field) {
+  // Fields being leveled by another batch are taken care of there
+  if (g_object_get_data(G_OBJECT(data_field), LEVEL_PENDING_KEY) ||
+      level_cache_is_level(data_field)) {
+    return;
+  }
+  g_object_set_data(G_OBJECT(data_field), LEVEL_PENDING_KEY,
+                    GINT_TO_POINTER(1));
+
+  LevelJob *job = g_new0(LevelJob, 1);
+  const LevelResult *cached = level_cache_get(data_field);
+  if (cached) {
+    job->have_plane = TRUE;
+    job->level = *cached;
+  }
+  job->batch = batch;
+  job->data_field = g_object_ref(data_field);
+  job->xres = gwy_data_field_get_xres(data_field);
+  job->yres = gwy_data_field_get_yres(data_field);
+  job->data = g_memdup(gwy_data_field_get_data_const(data_field),
+                       (gsize)job->xres * job->yres * sizeof(gdouble));
+  job->changed_id = g_signal_connect_swapped(
+      data_field, "data-changed", G_CALLBACK(level_job_mark_changed), job);
+  g_ptr_array_add(batch->jobs, job);
+}
+
+static void level_batch_add_container(GwyContainer *container,
+                                      LevelBatch *batch) {
+  gint *data_ids = gwy_app_data_browser_get_data_ids(container);
 
   for (int i = 0; data_ids[i] != -1; i++) {
     GQuark key = gwy_app_get_data_key_for_id(data_ids[i]);
-    GwyDataField *data_field = gwy_container_get_object(data, key);
-    level_plane(data_field);
-    gwy_data_field_data_changed(data_field);
+    GwyDataField *data_field = gwy_container_get_object(container, key);
+    level_batch_add(batch, data_field);
   }
 
   g_free(data_ids);
 }
 
-static void level_plane(GwyDataField *data_field) {
-  gdouble a, bx, by;
+static void level_batch_report(guint n_skipped) {
+  GtkWidget *dialog = gtk_message_dialog_new(
+      GTK_WINDOW(gwy_app_main_window_get()), GTK_DIALOG_DESTROY_WITH_PARENT,
+      GTK_MESSAGE_WARNING, GTK_BUTTONS_CLOSE,
+      "%u channels kept changing and have not been leveled.", n_skipped);
+  g_signal_connect(dialog, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+  gtk_widget_show(dialog);
+}
+
+static gboolean level_batch_retry(gpointer user_data) {
+  LevelBatch *retry = user_data;
+  LevelBatch *batch = level_batch_new();
+
+  batch->retries = retry->retries;
+  for (guint i = 0; i < retry->retry->len; i++) {
+    level_batch_add(batch, g_ptr_array_index(retry->retry, i));
+  }
+  g_ptr_array_free(retry->jobs, TRUE);
+  g_ptr_array_free(retry->retry, TRUE);
+  g_free(retry);
+
+  level_batch_run(batch);
+  return FALSE;
+}
+
+/* Runs in the main loop once every job of the batch is done. Copies the
+ * leveled data back, unless the field changed in the meantime; these fields
+ * are leveled again a bit later. */
+static gboolean level_batch_finish(gpointer user_data) {
+  LevelBatch *batch = user_data;
+
+  for (guint i = 0; i < batch->jobs->len; i++) {
+    LevelJob *job = g_ptr_array_index(batch->jobs, i);
+    GwyDataField *data_field = job->data_field;
+    g_signal_handler_disconnect(data_field, job->changed_id);
+    g_object_set_data(G_OBJECT(data_field), LEVEL_PENDING_KEY, NULL);
+    if (job->changed ||
+        gwy_data_field_get_xres(data_field) != job->xres ||
+        gwy_data_field_get_yres(data_field) != job->yres) {
+      g_ptr_array_add(batch->retry, g_object_ref(data_field));
+    } else {
+      memcpy(gwy_data_field_get_data(data_field), job->data,
+             (gsize)job->xres * job->yres * sizeof(gdouble));
+      gwy_data_field_invalidate(data_field);
+      gwy_data_field_data_changed(data_field);
+      // Set after data-changed, which drops the old plane
+      LevelResult leveled = {0};
+      level_cache_set(data_field, &leveled);
+    }
+    g_object_unref(data_field);
+    g_free(job->data);
+    g_free(job);
+  }
+  g_ptr_array_set_size(batch->jobs, 0);
+
+  if (batch->retry->len && batch->retries < LEVEL_MAX_RETRIES) {
+    batch->retries++;
+    g_timeout_add(LEVEL_RETRY_DELAY, level_batch_retry, batch);
+    return FALSE;
+  }
+  if (batch->retry->len) {
+    level_batch_report(batch->retry->len);
+  }
+  g_ptr_array_free(batch->jobs, TRUE);
+  g_ptr_array_free(batch->retry, TRUE);
+  g_free(batch);
+  return FALSE;
+}
+
+static void level_job_run(gpointer user_data) {
+  LevelJob *job = user_data;
+  gint64 start = z_stats_begin();
+
+  if (!job->have_plane) {
+    level_plane_fit(job->data, job->xres, job->yres, &job->level);
+  }
+  level_plane_subtract(job->data, job->xres, job->yres, &job->level);
+  z_stats_end(Z_STAT_LEVEL, start, (gint64)job->xres * job->yres);
+  if (g_atomic_int_dec_and_test(&job->batch->pending)) {
+    g_idle_add(level_batch_finish, job->batch);
+  }
+}
+
+static void level_batch_run(LevelBatch *batch) {
+  if (batch->jobs->len == 0) {
+    level_batch_finish(batch);
+    return;
+  }
 
-  gwy_data_field_fit_plane(data_field, &a, &bx, &by);
-  gwy_data_field_plane_level(data_field, a, bx, by);
+  batch->pending = batch->jobs->len;
+  for (guint i = 0; i < batch->jobs->len; i++) {
+    worker_pool_push(level_job_run, g_ptr_array_index(batch->jobs, i));
+  }
 }
 
 /* This function only exists to be able to create a keyboard shortcut for
@@ -177,14 +545,31 @@ static void focus_main_window(GwyContainer *data, GwyRunType run,
   gtk_window_present(main_window);
 }
 
+/* Timing statistics of the stages of this module, see z-stats.c */
+static void performance_stats(GwyContainer *data, GwyRunType run,
+                              G_GNUC_UNUSED const gchar *name) {
+  z_stats_window_show();
+}
+
 typedef enum {
   IMG_ID_COL = 0,
   TITLE_COL = 1,
   THUMBNAIL_COL = 2,
   CONTAINER_ID_COL = 3,
-  N_COLS = 4,
+  FILENAME_COL = 4,
+  IMG_INDEX_COL = 5, // position in the file while IMG_ID_COL is not known
+  FILE_COL = 6,
+  THUMB_STATE_COL = 7,
+  N_COLS = 8,
 } StoreColumns;
 
+typedef enum {
+  THUMB_NONE = 0,
+  THUMB_QUEUED = 1,
+  THUMB_LOADED = 2,
+  THUMB_HEADER = 3, // file name row of the Folder Overview
+} ThumbnailState;
+
 static void container_overview(GwyContainer *data, GwyRunType run,
                                G_GNUC_UNUSED const gchar *name) {
   const gchar *filename = gwy_file_get_filename_sys(data);
@@ -193,28 +578,31 @@ static void container_overview(GwyContainer *data, GwyRunType run,
     return;
   }
 
+  gint64 start = z_stats_begin();
   GtkWidget *main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
   gtk_window_set_title(GTK_WINDOW(main_window), filename);
   gtk_window_set_default_size(GTK_WINDOW(main_window), 1350, 750);
   // gtk_window_set_resizable(GTK_WINDOW(main_window), FALSE);
-  gwy_app_wait_start(GTK_WINDOW(main_window), "Creating Overview");
 
   GtkWidget *icon_view = create_iconview(data);
   g_signal_connect(icon_view, "item-activated", G_CALLBACK(on_icon_dbl_click),
                    NULL);
 
-  GtkWidget *scroll_area = gtk_scrolled_window_new(NULL, NULL);
-  gtk_scrolled_window_add_with_viewport(GTK_SCROLLED_WINDOW(scroll_area),
-                                        icon_view);
+  GtkWidget *scroll_area = iconview_scrolled(GTK_ICON_VIEW(icon_view));
+
+  GtkWidget *hbox = gtk_hbox_new(FALSE, 5);
+  gtk_box_pack_end(GTK_BOX(hbox), sheet_button_new(icon_view), FALSE, FALSE,
+                   0);
 
   GtkWidget *vbox = gtk_vbox_new(FALSE, 0);
   gtk_container_add(GTK_CONTAINER(main_window), vbox);
 
   gtk_box_pack_start(GTK_BOX(vbox), scroll_area, TRUE, TRUE, 1);
+  gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 1);
 
-  gwy_app_wait_finish();
   gwy_app_data_browser_set_keep_invisible(data, TRUE);
   gtk_widget_show_all(main_window);
+  z_stats_end(Z_STAT_WIDGETS, start, 1);
 }
 
 static gboolean present_if_exists(const gchar *title) {
@@ -239,650 +627,4384 @@ static gboolean present_if_exists(const gchar *title) {
   return FALSE;
 }
 
-static GtkWidget *create_iconview(GwyContainer *data) {
-  gint *data_ids = gwy_app_data_browser_get_data_ids(data);
+/*
+ * Thumbnails of an icon view are only materialized for the rows around the
+ * visible range. Whenever the view scrolls, rows entering that window get
+ * their thumbnail from the on-disk cache or from a job in the worker pool,
+ * and rows far outside of it drop theirs again, so the memory used does not
+ * depend on the number of rows. At most one job per core is in flight and
+ * visible rows are dispatched first; finished thumbnails are pushed into the
+ * list store from idle callbacks.
+ */
+typedef struct {
+  GtkIconView *icon_view; // NULL once the view is destroyed
+  GtkListStore *store;
+  GPtrArray *files; // OverviewFile, owned by the queue
+  GQueue pending;   // ThumbnailJob waiting for a free slot
+  GQueue loaded;    // GtkTreeRowReference of rows showing a real thumbnail
+  gint in_flight;
+  gint ref_count;
+  guint update_id;
+} ThumbnailQueue;
+
+struct OverviewFile {
+  gchar *filename;
+  gchar *cache_key; // NULL if the file is not cached
+  gboolean indexed; // channels are addressed by position, see mul_read_index()
+  MulImageInfo *labels; // of an indexed file by position, without previews
+  gint n_labels;
+};
 
-  GtkListStore *list_store = gtk_list_store_new(
-      N_COLS, G_TYPE_INT, G_TYPE_STRING, GDK_TYPE_PIXBUF, G_TYPE_INT);
-  GtkTreeIter iter;
+typedef struct {
+  ThumbnailQueue *queue;
+  GtkTreeRowReference *row;
+  OverviewFile *file;
+  // Source of the data, either a channel of an open container...
+  GwyContainer *container;
+  GwyDataField *data_field;
+  gint img_id;
+  // ...or an image of an indexed .mul file
+  gint img_index;
+  gboolean have_plane; // the plane of the full data is known from the cache
+  gdouble *data; // private copy, the worker never sees the live channel
+
+  gint xres;
+  gint yres;
+  gdouble *thumb;
+  gint width;
+  gint height;
+  LevelResult level;
+} ThumbnailJob;
+
+#define THUMBNAIL_QUEUE_KEY "z-module-thumbnail-queue"
+
+static void thumbnail_queue_dispatch(ThumbnailQueue *queue);
+
+static void overview_file_free(gpointer p) {
+  OverviewFile *file = p;
+
+  g_free(file->filename);
+  g_free(file->cache_key);
+  g_free(file->labels);
+  g_free(file);
+}
 
-  for (int i = 0; data_ids[i] != -1; i++) {
-    gint img_id = data_ids[i];
-    GQuark key = gwy_app_get_data_key_for_id(img_id);
-    GwyDataField *data_field = gwy_container_get_object(data, key);
-    level_plane(data_field);
-    // gwy_data_field_data_changed(data_field);
-    GdkPixbuf *thumbnail =
-        gwy_app_get_channel_thumbnail(data, img_id, 200, 200);
-    char *data_field_title = gwy_app_get_data_field_title(data, img_id);
+static void thumbnail_queue_unref(ThumbnailQueue *queue) {
+  if (--queue->ref_count) {
+    return;
+  }
+  g_object_unref(queue->store);
+  g_ptr_array_free(queue->files, TRUE);
+  g_free(queue);
+}
+
+static void thumbnail_job_free(ThumbnailJob *job) {
+  gtk_tree_row_reference_free(job->row);
+  if (job->data_field) {
+    g_object_unref(job->data_field);
+    g_object_unref(job->container);
+  }
+  g_free(job->data);
+  g_free(job->thumb);
+  g_free(job);
+}
+
+static void on_iconview_destroy(GtkWidget *icon_view, ThumbnailQueue *queue) {
+  ThumbnailJob *job;
+  GtkTreeRowReference *row;
+
+  queue->icon_view = NULL;
+  if (queue->update_id) {
+    g_source_remove(queue->update_id);
+  }
+  while ((job = g_queue_pop_head(&queue->pending))) {
+    thumbnail_job_free(job);
+  }
+  while ((row = g_queue_pop_head(&queue->loaded))) {
+    gtk_tree_row_reference_free(row);
+  }
+  thumbnail_queue_unref(queue);
+}
 
-    int title_length = snprintf(NULL, 0, "%s", /*filename,*/ data_field_title);
-    char *title = malloc(title_length + 1);
-    snprintf(title, title_length + 1, "%s", /*filename,*/ data_field_title);
+static GdkPixbuf *placeholder_thumbnail(void) {
+  static GdkPixbuf *placeholder = NULL;
 
-    int id_length = snprintf(NULL, 0, "%i", img_id);
-    char *id_str = malloc(id_length + 1);
-    snprintf(id_str, id_length + 1, "%d", img_id);
+  if (!placeholder) {
+    placeholder = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, THUMBNAIL_SIZE,
+                                 THUMBNAIL_SIZE);
+    gdk_pixbuf_fill(placeholder, 0xd0d0d0ff);
+  }
+  return placeholder;
+}
 
-    gint container_id = gwy_app_data_browser_get_number(data);
+static gboolean thumbnail_queue_update(gpointer user_data);
 
-    gtk_list_store_append(list_store, &iter);
-    gtk_list_store_set(list_store, &iter, IMG_ID_COL, img_id, TITLE_COL, title,
-                       THUMBNAIL_COL, thumbnail, CONTAINER_ID_COL, container_id,
-                       -1);
+static void thumbnail_queue_schedule_update(ThumbnailQueue *queue) {
+  if (queue->icon_view && !queue->update_id) {
+    queue->update_id = g_idle_add(thumbnail_queue_update, queue);
   }
+}
+
+static GtkWidget *iconview_new(void) {
+  GtkListStore *list_store = gtk_list_store_new(
+      N_COLS, G_TYPE_INT, G_TYPE_STRING, GDK_TYPE_PIXBUF, G_TYPE_INT,
+      G_TYPE_STRING, G_TYPE_INT, G_TYPE_POINTER, G_TYPE_INT);
 
   GtkWidget *icon_view = gtk_icon_view_new();
   gtk_icon_view_set_model(GTK_ICON_VIEW(icon_view), GTK_TREE_MODEL(list_store));
-  gtk_icon_view_set_text_column(GTK_ICON_VIEW(icon_view), 1);
-  gtk_icon_view_set_pixbuf_column(GTK_ICON_VIEW(icon_view), 2);
+  gtk_icon_view_set_markup_column(GTK_ICON_VIEW(icon_view), TITLE_COL);
+  gtk_icon_view_set_pixbuf_column(GTK_ICON_VIEW(icon_view), THUMBNAIL_COL);
+
+  ThumbnailQueue *queue = g_new0(ThumbnailQueue, 1);
+  queue->icon_view = GTK_ICON_VIEW(icon_view);
+  queue->store = list_store;
+  queue->files = g_ptr_array_new_with_free_func(overview_file_free);
+  queue->ref_count = 1;
+  g_queue_init(&queue->pending);
+  g_queue_init(&queue->loaded);
+  g_object_set_data(G_OBJECT(icon_view), THUMBNAIL_QUEUE_KEY, queue);
+  g_signal_connect(icon_view, "destroy", G_CALLBACK(on_iconview_destroy),
+                   queue);
+  g_signal_connect_swapped(icon_view, "size-allocate",
+                           G_CALLBACK(thumbnail_queue_schedule_update), queue);
 
   return icon_view;
 }
 
-static gboolean on_icon_dbl_click(GtkIconView *icon_view,
-                                  GtkTreePath *tree_path) {
-  GtkTreeIter iter;
-  GtkListStore *store;
-  gint img_id;
-  gint container_id;
+/* Puts the icon view into a scrolled window. The icon view must do its own
+ * scrolling (no viewport), otherwise everything counts as visible. */
+static GtkWidget *iconview_scrolled(GtkIconView *icon_view) {
+  ThumbnailQueue *queue =
+      g_object_get_data(G_OBJECT(icon_view), THUMBNAIL_QUEUE_KEY);
+  GtkWidget *scroll_area = gtk_scrolled_window_new(NULL, NULL);
 
-  // Get the associated list store
-  store = GTK_LIST_STORE(gtk_icon_view_get_model(icon_view));
-  // Convert the path to an iter
-  gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, tree_path);
-  // Get the value of the first column (assuming it's an integer)
-  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, IMG_ID_COL, &img_id, -1);
-  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, CONTAINER_ID_COL,
-                     &container_id, -1);
+  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll_area),
+                                 GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_container_add(GTK_CONTAINER(scroll_area), GTK_WIDGET(icon_view));
+  g_signal_connect_swapped(
+      gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scroll_area)),
+      "value-changed", G_CALLBACK(thumbnail_queue_schedule_update), queue);
 
-  g_print("Activated item: %d\n", img_id);
+  return scroll_area;
+}
 
-  int vis_len = snprintf(NULL, 0, "/%i/data/visible", img_id);
-  char *visible_ident = malloc(vis_len + 1);
-  snprintf(visible_ident, vis_len + 1, "/%i/data/visible", img_id);
+static void iconview_append_row(GtkIconView *icon_view, OverviewFile *file,
+                                gint container_id, gint img_id,
+                                gint img_index, const gchar *title) {
+  ThumbnailQueue *queue =
+      g_object_get_data(G_OBJECT(icon_view), THUMBNAIL_QUEUE_KEY);
+  gchar *markup = g_markup_escape_text(title ? title : "", -1);
+  GtkTreeIter iter;
 
-  GwyContainer *container_data = gwy_app_data_browser_get(container_id);
-  gboolean is_visible =
-      gwy_container_get_boolean_by_name(container_data, visible_ident);
-  if (is_visible) {
-    GtkWindow *img_window =
-        gwy_app_find_window_for_channel(container_data, img_id);
-    gtk_window_present(img_window);
-  } else {
-    gwy_container_set_boolean_by_name(container_data, visible_ident, TRUE);
-  }
+  gtk_list_store_append(queue->store, &iter);
+  gtk_list_store_set(queue->store, &iter, IMG_ID_COL, img_id, TITLE_COL,
+                     markup, THUMBNAIL_COL, placeholder_thumbnail(),
+                     CONTAINER_ID_COL, container_id, FILENAME_COL,
+                     file ? file->filename : NULL, IMG_INDEX_COL, img_index,
+                     FILE_COL, file, THUMB_STATE_COL, THUMB_NONE, -1);
+  g_free(markup);
 
-  return TRUE;
+  thumbnail_queue_schedule_update(queue);
 }
 
-static void folder_overview(GwyContainer *data, GwyRunType run,
-                            G_GNUC_UNUSED const gchar *name) {
-  const gchar *filename = gwy_file_get_filename_sys(data);
-  char dir[256];
-  dirname(filename, dir);
-  printf("dirname: %s\n", dir);
-
-  GtkWidget *main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-  gtk_window_set_title(GTK_WINDOW(main_window), "Folder Overview");
-  gtk_window_set_default_size(GTK_WINDOW(main_window), 1350, 750);
-  // gtk_window_set_resizable(GTK_WINDOW(main_window), FALSE);
+/* Adds a file to the view, shown as a header row followed by its channels */
+static OverviewFile *iconview_append_file(GtkIconView *icon_view,
+                                          const gchar *filename,
+                                          const gchar *cache_key,
+                                          gboolean indexed) {
+  ThumbnailQueue *queue =
+      g_object_get_data(G_OBJECT(icon_view), THUMBNAIL_QUEUE_KEY);
+  OverviewFile *file = g_new0(OverviewFile, 1);
+  gchar *basename = g_path_get_basename(filename);
+  gchar *markup = g_markup_printf_escaped("<b>%s</b>", basename);
+  GtkTreeIter iter;
 
-  gwy_app_wait_start(GTK_WINDOW(main_window), "Creating Overview");
+  file->filename = g_strdup(filename);
+  file->cache_key = g_strdup(cache_key);
+  file->indexed = indexed;
+  g_ptr_array_add(queue->files, file);
 
-  GtkWidget *scroll_area = gtk_scrolled_window_new(NULL, NULL);
-  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll_area),
-                                 GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_list_store_append(queue->store, &iter);
+  gtk_list_store_set(queue->store, &iter, IMG_ID_COL, -1, TITLE_COL, markup,
+                     CONTAINER_ID_COL, -1, FILENAME_COL, filename,
+                     IMG_INDEX_COL, -1, FILE_COL, file, THUMB_STATE_COL,
+                     THUMB_HEADER, -1);
+  g_free(markup);
+  g_free(basename);
 
-  GtkWidget *scroll_vbox = gtk_vbox_new(FALSE, 5);
+  return file;
+}
 
-  DIR *dfd;
-  if ((dfd = opendir(dir)) == NULL) {
-    fprintf(stderr, "Can't open %s\n", dir);
+/* Removes the header and channel rows of a file and adds the containers they
+ * showed to container_ids, once each. The file itself stays with the queue,
+ * thumbnail jobs still running may use it. */
+static void iconview_remove_file(GtkIconView *icon_view, OverviewFile *file,
+                                 GArray *container_ids) {
+  ThumbnailQueue *queue =
+      g_object_get_data(G_OBJECT(icon_view), THUMBNAIL_QUEUE_KEY);
+  GtkTreeModel *model = GTK_TREE_MODEL(queue->store);
+  GtkTreeIter iter;
+  gboolean valid = gtk_tree_model_get_iter_first(model, &iter);
+
+  while (valid) {
+    OverviewFile *row_file;
+    gint container_id;
+    gtk_tree_model_get(model, &iter, FILE_COL, &row_file, CONTAINER_ID_COL,
+                       &container_id, -1);
+    if (row_file == file) {
+      guint k = 0;
+      while (k < container_ids->len &&
+             g_array_index(container_ids, gint, k) != container_id) {
+        k++;
+      }
+      if (container_id >= 0 && k == container_ids->len) {
+        g_array_append_val(container_ids, container_id);
+      }
+      valid = gtk_list_store_remove(queue->store, &iter);
+    } else {
+      valid = gtk_tree_model_iter_next(model, &iter);
+    }
   }
+  thumbnail_queue_schedule_update(queue);
+}
 
-  struct dirent *dp;
-  while ((dp = readdir(dfd)) != NULL) {
-    if (endswith(dp->d_name, ".mul")) {
-      char full_path[PATH_MAX + 1];
-      concat_path(dir, dp->d_name, full_path);
-      printf("fullpath: %s\n", full_path);
-      // GwyContainer* data_container = gwy_app_file_load(NULL, full_path,
-      // NULL);
-      GwyContainer *data_container =
-          gwy_file_load(full_path, GWY_RUN_IMMEDIATE, NULL);
-      gwy_app_data_browser_add(data_container);
-      gwy_app_data_browser_set_keep_invisible(data_container, TRUE);
+/* Adds a row for a channel of an open container */
+static void iconview_append_channel(GtkIconView *icon_view,
+                                    GwyContainer *container, gint img_id,
+                                    OverviewFile *file) {
+  gchar *title = gwy_app_get_data_field_title(container, img_id);
 
-      GtkWidget *icon_view = create_iconview(data_container);
-      g_signal_connect(icon_view, "item-activated",
-                       G_CALLBACK(on_icon_dbl_click), NULL);
-      // gtk_scrolled_window_add_with_viewport(GTK_SCROLLED_WINDOW(scroll_area),
-      // icon_view);
-      gtk_box_pack_start(GTK_BOX(scroll_vbox), icon_view, TRUE, TRUE, 0);
-    }
-  }
+  iconview_append_row(icon_view, file,
+                      gwy_app_data_browser_get_number(container), img_id, -1,
+                      title);
+  g_free(title);
+}
 
-  // gtk_container_add(GTK_CONTAINER(scroll_area), scroll_vbox);
-  gtk_scrolled_window_add_with_viewport(GTK_SCROLLED_WINDOW(scroll_area),
-                                        scroll_vbox);
+static GtkWidget *create_iconview(GwyContainer *data) {
+  gint *data_ids = gwy_app_data_browser_get_data_ids(data);
+  GtkWidget *icon_view = iconview_new();
 
-  GtkWidget *vbox = gtk_vbox_new(FALSE, 0);
-  gtk_container_add(GTK_CONTAINER(main_window), vbox);
+  for (int i = 0; data_ids[i] != -1; i++) {
+    iconview_append_channel(GTK_ICON_VIEW(icon_view), data, data_ids[i], NULL);
+  }
 
-  gtk_box_pack_start(GTK_BOX(vbox), scroll_area, TRUE, TRUE, 1);
+  g_free(data_ids);
+  return icon_view;
+}
 
-  gwy_app_wait_finish();
-  gtk_widget_show_all(main_window);
+static void thumbnail_queue_set_loaded(ThumbnailQueue *queue,
+                                       GtkTreeIter *iter,
+                                       GdkPixbuf *thumbnail) {
+  GtkTreePath *path =
+      gtk_tree_model_get_path(GTK_TREE_MODEL(queue->store), iter);
+
+  gtk_list_store_set(queue->store, iter, THUMBNAIL_COL, thumbnail,
+                     THUMB_STATE_COL, THUMB_LOADED, -1);
+  g_queue_push_tail(&queue->loaded, gtk_tree_row_reference_new(
+                                        GTK_TREE_MODEL(queue->store), path));
+  gtk_tree_path_free(path);
 }
 
-static void dirname(const char *path, char *dir) {
-  size_t len = strlen(path);
+/* Main loop part of a thumbnail job */
+static gboolean thumbnail_job_finish(gpointer user_data) {
+  ThumbnailJob *job = user_data;
+  ThumbnailQueue *queue = job->queue;
+  GtkTreePath *path = gtk_tree_row_reference_get_path(job->row);
+  GtkTreeIter iter;
+  gint state = THUMB_NONE;
+  if (path) {
+    gtk_tree_model_get_iter(GTK_TREE_MODEL(queue->store), &iter, path);
+    gtk_tree_model_get(GTK_TREE_MODEL(queue->store), &iter, THUMB_STATE_COL,
+                       &state, -1);
+  }
+  // Rows leaving the window while in flight were reset to THUMB_NONE
+  if (queue->icon_view && state == THUMB_QUEUED && job->thumb) {
+    GdkPixbuf *thumbnail =
+        create_thumbnail(job->container, job->img_id, job->thumb, job->width,
+                         job->height, &job->level);
+    thumbnail_queue_set_loaded(queue, &iter, thumbnail);
+    if (job->file && job->file->cache_key) {
+      gchar *cache_file = thumbnail_cache_file(
+          job->file->cache_key, job->file->indexed ? job->img_index
+                                                   : job->img_id);
+      gdk_pixbuf_save(thumbnail, cache_file, "png", NULL, NULL);
+      g_free(cache_file);
+    }
+    g_object_unref(thumbnail);
+  } else if (queue->icon_view && state == THUMB_QUEUED) {
+    gtk_list_store_set(queue->store, &iter, THUMB_STATE_COL, THUMB_NONE, -1);
+  }
+  gtk_tree_path_free(path);
+  thumbnail_job_free(job);
 
-  // If the path is empty, return the current directory "."
-  if (len == 0) {
-    strcpy(dir, ".");
-    return;
+  queue->in_flight--;
+  if (queue->icon_view) {
+    thumbnail_queue_dispatch(queue);
   }
+  thumbnail_queue_unref(queue);
 
-  // Find the last occurrence of either slash '/' or backslash '\'
-  const char *last_fwd_slash = strrchr(path, '/');
-  const char *last_bck_slash = strrchr(path, '\\');
-  const char *last_slash =
-      last_fwd_slash > last_bck_slash ? last_fwd_slash : last_bck_slash;
+  return FALSE;
+}
 
-  // Handle the cases:
-  // 1. No slash found
-  // 2. The path is just a single slash or backslash
-  if (!last_slash || last_slash == path || last_slash == path + 1) {
-    strcpy(dir, last_slash == path || last_slash == path + 1 ? "\\" : ".");
-    return;
+/* Leveled thumbnail of the data of a channel. The channel itself stays as it
+ * is, only the thumbnail is leveled: the full data is only read once for the
+ * decimation, everything else is done on the small grid. With have_plane,
+ * level holds the plane of the full data. */
+static gdouble *thumbnail_from_data(const gdouble *data, gint xres, gint yres,
+                                    gboolean have_plane, LevelResult *level,
+                                    gint *width, gint *height) {
+  thumbnail_size(xres, yres, width, height);
+  gdouble *thumb = g_new(gdouble, (gsize)*width * *height);
+  decimate_buffer(data, xres, yres, thumb, *width, *height);
+  if (have_plane) {
+    level_plane_subtract_decimated(thumb, *width, *height, xres, yres, level);
+  } else {
+    level_plane_buffer(thumb, *width, *height, level);
   }
+  return thumb;
+}
 
-  // Calculate the length of the directory part
-  size_t dir_len = last_slash - path;
+/* Worker part of a thumbnail job */
+static void thumbnail_job_run(gpointer user_data) {
+  ThumbnailJob *job = user_data;
+  gint64 start = z_stats_begin();
+
+  if (job->data_field) {
+    job->thumb =
+        thumbnail_from_data(job->data, job->xres, job->yres, job->have_plane,
+                            &job->level, &job->width, &job->height);
+  } else {
+    job->thumb = mul_read_image_preview(job->file->filename,
+                                        &job->file->labels[job->img_index],
+                                        &job->width, &job->height);
+    if (job->thumb) {
+      level_plane_buffer(job->thumb, job->width, job->height, &job->level);
+    }
+  }
+  if (job->thumb) {
+    z_stats_end(Z_STAT_THUMBNAIL, start,
+                job->data_field ? (gint64)job->xres * job->yres
+                                : (gint64)job->width * job->height);
+  }
 
-  // Copy the directory part to the output buffer
-  strncpy(dir, path, dir_len);
-  dir[dir_len] = '\0';
+  g_idle_add(thumbnail_job_finish, job);
 }
 
-static void basename(const char *path, char *base) {
-  size_t len = strlen(path);
+static void thumbnail_queue_dispatch(ThumbnailQueue *queue) {
+  ThumbnailJob *job;
+
+  while (queue->in_flight < (gint)g_get_num_processors() &&
+         (job = g_queue_pop_head(&queue->pending))) {
+    if (job->data_field) {
+      job->xres = gwy_data_field_get_xres(job->data_field);
+      job->yres = gwy_data_field_get_yres(job->data_field);
+      const LevelResult *cached = level_cache_get(job->data_field);
+      if (cached) {
+        job->have_plane = TRUE;
+        job->level = *cached;
+      }
+      // Taken here, the channel may change or go away while the job runs
+      job->data = g_memdup(gwy_data_field_get_data_const(job->data_field),
+                           (gsize)job->xres * job->yres * sizeof(gdouble));
+    }
 
-  // If the path is empty, return the current directory "."
-  if (len == 0) {
-    strcpy(base, ".");
-    return;
+    queue->in_flight++;
+    queue->ref_count++;
+    worker_pool_push(thumbnail_job_run, job);
   }
+}
 
-  // Find the last occurrence of either slash '/' or backslash '\'
-  const char *last_fwd_slash = strrchr(path, '/');
-  const char *last_bck_slash = strrchr(path, '\\');
-  const char *last_slash =
-      last_fwd_slash > last_bck_slash ? last_fwd_slash : last_bck_slash;
+/* Gives the row its thumbnail, from the cache if possible, otherwise by
+ * queueing a job */
+static void thumbnail_queue_request(ThumbnailQueue *queue, GtkTreeIter *iter) {
+  OverviewFile *file;
+  gint state, container_id, img_id, img_index;
 
-  // If no slash is found, the entire path is the basename
-  if (!last_slash) {
-    strcpy(base, path);
+  gtk_tree_model_get(GTK_TREE_MODEL(queue->store), iter, THUMB_STATE_COL,
+                     &state, FILE_COL, &file, CONTAINER_ID_COL, &container_id,
+                     IMG_ID_COL, &img_id, IMG_INDEX_COL, &img_index, -1);
+  if (state != THUMB_NONE) {
     return;
   }
 
-  // Move past the last slash to get the basename
-  strcpy(base, last_slash + 1);
-}
+  if (file && file->cache_key) {
+    gchar *cache_file = thumbnail_cache_file(
+        file->cache_key, img_index >= 0 ? img_index : img_id);
+    GdkPixbuf *thumbnail = gdk_pixbuf_new_from_file(cache_file, NULL);
+    g_free(cache_file);
+    if (thumbnail) {
+      thumbnail_queue_set_loaded(queue, iter, thumbnail);
+      g_object_unref(thumbnail);
+      return;
+    }
+  }
 
-static bool endswith(const char *str, const char *suffix) {
-  size_t str_len = strlen(str);
-  size_t suffix_len = strlen(suffix);
+  GwyContainer *container =
+      container_id >= 0 ? gwy_app_data_browser_get(container_id) : NULL;
+  if (!container && !(file && img_index >= 0 && img_index < file->n_labels)) {
+    return;
+  }
 
-  if (str_len < suffix_len) {
-    return false;
+  ThumbnailJob *job = g_new0(ThumbnailJob, 1);
+  GtkTreePath *path =
+      gtk_tree_model_get_path(GTK_TREE_MODEL(queue->store), iter);
+  job->queue = queue;
+  job->row = gtk_tree_row_reference_new(GTK_TREE_MODEL(queue->store), path);
+  job->file = file;
+  job->img_id = img_id;
+  job->img_index = img_index;
+  if (container) {
+    GQuark key = gwy_app_get_data_key_for_id(img_id);
+    job->container = g_object_ref(container);
+    job->data_field = g_object_ref(gwy_container_get_object(container, key));
   }
+  gtk_tree_path_free(path);
 
-  return strcmp(str + (str_len - suffix_len), suffix) == 0;
+  gtk_list_store_set(queue->store, iter, THUMB_STATE_COL, THUMB_QUEUED, -1);
+  g_queue_push_tail(&queue->pending, job);
+}
+
+static gint row_index(GtkTreeRowReference *row) {
+  GtkTreePath *path = gtk_tree_row_reference_get_path(row);
+  gint index = path ? gtk_tree_path_get_indices(path)[0] : -1;
+
+  gtk_tree_path_free(path);
+  return index;
 }
 
-char *concat_path(const char *dir, const char *filename, char *fullpath) {
-  strcpy(fullpath, dir);
+/* Brings the materialized rows in line with the visible range */
+static gboolean thumbnail_queue_update(gpointer user_data) {
+  ThumbnailQueue *queue = user_data;
+  GtkTreeModel *model = GTK_TREE_MODEL(queue->store);
+  GtkTreePath *start, *end;
+  GtkTreeIter iter;
+  GList *l, *next;
 
-  size_t len = strlen(fullpath);
-  // Determine the appropriate separator based on the directory path
-  char separator = (strchr(dir, '\\') != NULL) ? '\\' : '/';
+  queue->update_id = 0;
+  if (!gtk_icon_view_get_visible_range(queue->icon_view, &start, &end)) {
+    return FALSE;
+  }
+  gint first = gtk_tree_path_get_indices(start)[0];
+  gint last = gtk_tree_path_get_indices(end)[0];
+  gtk_tree_path_free(start);
+  gtk_tree_path_free(end);
+
+  // Prefetch one screen in both directions, keep up to two screens
+  gint page = last - first + 1;
+  gint lo = MAX(0, first - page), hi = last + page;
+  gint keep_lo = first - 2 * page, keep_hi = last + 2 * page;
+
+  for (l = queue->pending.head; l; l = next) {
+    ThumbnailJob *job = l->data;
+    gint index = row_index(job->row);
+    next = l->next;
+    if (index < lo || index > hi) {
+      if (index >= 0 && gtk_tree_model_iter_nth_child(model, &iter, NULL,
+                                                      index)) {
+        gtk_list_store_set(queue->store, &iter, THUMB_STATE_COL, THUMB_NONE,
+                           -1);
+      }
+      g_queue_delete_link(&queue->pending, l);
+      thumbnail_job_free(job);
+    }
+  }
 
-  // Add the separator if it's not already at the end of the directory path
-  if (fullpath[len - 1] != '/' && fullpath[len - 1] != '\\') {
-    fullpath[len] = separator;
-    fullpath[len + 1] = '\0';
+  for (l = queue->loaded.head; l; l = next) {
+    GtkTreeRowReference *row = l->data;
+    gint index = row_index(row);
+    next = l->next;
+    // Rows removed from the store have no index any more
+    if (index < 0 || index < keep_lo || index > keep_hi) {
+      if (index >= 0 && gtk_tree_model_iter_nth_child(model, &iter, NULL,
+                                                      index)) {
+        gtk_list_store_set(queue->store, &iter, THUMBNAIL_COL,
+                           placeholder_thumbnail(), THUMB_STATE_COL,
+                           THUMB_NONE, -1);
+      }
+      gtk_tree_row_reference_free(row);
+      g_queue_delete_link(&queue->loaded, l);
+    }
   }
 
-  strcat(fullpath, filename);
+  // Visible rows first, then the prefetch window
+  gint n_rows = gtk_tree_model_iter_n_children(model, NULL);
+  for (gint i = first; i <= last && i < n_rows; i++) {
+    if (gtk_tree_model_iter_nth_child(model, &iter, NULL, i)) {
+      thumbnail_queue_request(queue, &iter);
+    }
+  }
+  for (gint i = lo; i <= hi && i < n_rows; i++) {
+    if ((i < first || i > last) &&
+        gtk_tree_model_iter_nth_child(model, &iter, NULL, i)) {
+      thumbnail_queue_request(queue, &iter);
+    }
+  }
 
-  return fullpath;
+  thumbnail_queue_dispatch(queue);
+  return FALSE;
 }
 
-struct DriftCorrectionData {
-  gint preview_container_id;
-  gint preview_datafield_id;
-  SelectedImage *images;
-  int images_len;
-  int images_cap;
-  SelectedImage *selected_imgs;
-  int selected_images_len;
-  int selected_images_cap;
-  GtkWidget *preview_img;
-  int current_preview;
-  SelectedImage *current_preview_img;
-};
+static gboolean on_icon_dbl_click(GtkIconView *icon_view,
+                                  GtkTreePath *tree_path) {
+  GtkTreeIter iter;
+  GtkListStore *store;
+  gint img_id;
+  gint container_id;
+  gint state;
+  gchar *filename;
 
-struct SelectedImage {
+  // Get the associated list store
+  store = GTK_LIST_STORE(gtk_icon_view_get_model(icon_view));
+  // Convert the path to an iter
+  gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, tree_path);
+  // Get the value of the first column (assuming it's an integer)
+  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, IMG_ID_COL, &img_id, -1);
+  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, CONTAINER_ID_COL,
+                     &container_id, FILENAME_COL, &filename, THUMB_STATE_COL,
+                     &state, -1);
+  if (state == THUMB_HEADER) {
+    g_free(filename);
+    return TRUE;
+  }
+
+  // Rows of files that were only indexed have no container yet
+  GwyContainer *container_data =
+      container_id >= 0 ? gwy_app_data_browser_get(container_id) : NULL;
+  if (!container_data && filename) {
+    container_data = open_overview_file(store, filename);
+    gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, IMG_ID_COL, &img_id, -1);
+  }
+  g_free(filename);
+  if (!container_data || img_id < 0) {
+    return TRUE;
+  }
+  resident_container_touch(container_data);
+
+  int vis_len = snprintf(NULL, 0, "/%i/data/visible", img_id);
+  char *visible_ident = malloc(vis_len + 1);
+  snprintf(visible_ident, vis_len + 1, "/%i/data/visible", img_id);
+
+  gboolean is_visible = FALSE;
+  gwy_container_gis_boolean_by_name(container_data, visible_ident,
+                                    &is_visible);
+  if (is_visible) {
+    GtkWindow *img_window =
+        gwy_app_find_window_for_channel(container_data, img_id);
+    gtk_window_present(img_window);
+  } else {
+    gwy_container_set_boolean_by_name(container_data, visible_ident, TRUE);
+  }
+  free(visible_ident);
+
+  return TRUE;
+}
+
+typedef struct {
+  const gchar *filename;
+  GwyContainer *container;
+} FindContainerData;
+
+static void find_container_by_filename(GwyContainer *container,
+                                       FindContainerData *find) {
+  if (!find->container &&
+      g_strcmp0(gwy_file_get_filename_sys(container), find->filename) == 0) {
+    find->container = container;
+  }
+}
+
+/* TRUE if title contains number, not as part of a longer number */
+static gboolean title_has_number(const gchar *title, const gchar *number) {
+  gsize len = strlen(number);
+
+  for (const gchar *p = strstr(title, number); p; p = strstr(p + 1, number)) {
+    if ((p == title || !g_ascii_isdigit(p[-1])) && !g_ascii_isdigit(p[len])) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Channel ids of the labels of a .mul file as loaded by Gwyddion, -1 for
+ * labels without a channel. Gwyddion's loader may skip labels this reader
+ * keeps or vice versa, so a channel is matched by its title: the title of the
+ * label, or its image number. Only if nothing matches, the position is
+ * used. Every channel is used once. */
+static gint *mul_match_labels(GPtrArray *images, const gint *data_ids,
+                              gchar **titles, gint n_ids) {
+  gint *channels = g_new(gint, images->len);
+  gboolean *used = g_new0(gboolean, n_ids);
+
+  for (guint k = 0; k < images->len; k++) {
+    const MulImageInfo *info = g_ptr_array_index(images, k);
+    gchar number[16];
+    gint best = -1, best_rank = 0;
+
+    g_snprintf(number, sizeof(number), "%d", info->id);
+    for (gint i = 0; i < n_ids; i++) {
+      gint rank = 0;
+      if (used[i] || !titles[i]) {
+        continue;
+      }
+      if (g_strcmp0(titles[i], info->title) == 0) {
+        rank = 3;
+      } else if (strstr(titles[i], info->title)) {
+        rank = 2;
+      } else if (title_has_number(titles[i], number)) {
+        rank = 1;
+      }
+      if (rank > best_rank) {
+        best = i;
+        best_rank = rank;
+      }
+    }
+    if (best < 0 && (gint)k < n_ids && !used[k]) {
+      best = k;
+    }
+    channels[k] = best >= 0 ? data_ids[best] : -1;
+    if (best >= 0) {
+      used[best] = TRUE;
+    }
+  }
+  g_free(used);
+  return channels;
+}
+
+/* mul_match_labels() for an open container */
+static gint *mul_match_container(GPtrArray *images, GwyContainer *container) {
+  gint *data_ids = gwy_app_data_browser_get_data_ids(container);
+  gint n_ids = 0;
+  while (data_ids[n_ids] != -1) {
+    n_ids++;
+  }
+
+  gchar **titles = g_new0(gchar *, n_ids + 1);
+  for (gint i = 0; i < n_ids; i++) {
+    titles[i] = gwy_app_get_data_field_title(container, data_ids[i]);
+  }
+  gint *channels = mul_match_labels(images, data_ids, titles, n_ids);
+
+  g_strfreev(titles);
+  g_free(data_ids);
+  return channels;
+}
+
+/* Returns the container of an overview file, loading it if it is not open,
+ * and updates the container and channel ids of all rows coming from the
+ * file. */
+static GwyContainer *open_overview_file(GtkListStore *store,
+                                        const gchar *filename) {
+  FindContainerData find = {filename, NULL};
+  gwy_app_data_browser_foreach(
+      (GwyAppDataForeachFunc)find_container_by_filename, &find);
+
+  GwyContainer *container = find.container;
+  if (!container) {
+    GError *error = NULL;
+    container = gwy_file_load(filename, GWY_RUN_IMMEDIATE, &error);
+    if (!container) {
+      fprintf(stderr, "Can't load %s: %s\n", filename,
+              error ? error->message : "unknown error");
+      g_clear_error(&error);
+      return NULL;
+    }
+    gwy_app_data_browser_add(container);
+    gwy_app_data_browser_set_keep_invisible(container, TRUE);
+    g_object_unref(container);
+    resident_container_add(container);
+  }
+
+  gint container_id = gwy_app_data_browser_get_number(container);
+  GPtrArray *images = NULL;
+  gint *label_channels = NULL;
+  gboolean labels_read = FALSE;
+
+  GtkTreeIter iter;
+  gboolean valid =
+      gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store), &iter);
+  while (valid) {
+    gchar *row_filename;
+    gint img_index;
+    gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, FILENAME_COL,
+                       &row_filename, IMG_INDEX_COL, &img_index, -1);
+    if (g_strcmp0(row_filename, filename) == 0) {
+      gtk_list_store_set(store, &iter, CONTAINER_ID_COL, container_id, -1);
+      // IMG_INDEX_COL stays, the cached thumbnails are named after it
+      if (img_index >= 0 && !labels_read) {
+        labels_read = TRUE;
+        if ((images = mul_read_index(filename, -1))) {
+          label_channels = mul_match_container(images, container);
+        }
+      }
+      if (img_index >= 0) {
+        gtk_list_store_set(store, &iter, IMG_ID_COL,
+                           images && img_index < (gint)images->len
+                               ? label_channels[img_index]
+                               : -1,
+                           -1);
+      }
+    }
+    g_free(row_filename);
+    valid = gtk_tree_model_iter_next(GTK_TREE_MODEL(store), &iter);
+  }
+  if (images) {
+    g_ptr_array_free(images, TRUE);
+  }
+  g_free(label_channels);
+
+  return container;
+}
+
+/*
+ * Containers opened by the Folder Overview are kept in the data browser only
+ * up to a memory budget, shared by all overview windows. Past it, the least
+ * recently activated ones are removed from the data browser again. Their
+ * rows keep the old container id, which gwy_app_data_browser_get() no longer
+ * knows, so the thumbnails stay and on_icon_dbl_click() opens the file
+ * again. A container whose file was rewritten or deleted is removed right
+ * away, as its rows are. Containers with unsaved changes, with a window of
+ * any of their data open or with frames in an open Drift correction window
+ * are never removed. The budget is kept in the settings in MiB.
+ */
+#define MEMORY_BUDGET_KEY "/module/z_module/memory_budget"
+#define MEMORY_BUDGET_DEFAULT 1024
+
+typedef struct {
   gint container_id;
-  gint img_id;
-  gdouble x_selection;
-  gdouble y_selection;
+  gsize size;
+} ResidentContainer;
+
+static GQueue resident_containers = G_QUEUE_INIT; // most recently used first
+// Container id -> number of Drift correction windows reading from it
+static GHashTable *drift_containers = NULL;
+
+/* Data of a container that can be shown in a window, and its visibility key */
+static const struct {
+  gint *(*get_ids)(GwyContainer *container);
+  const gchar *visible_key;
+} container_views[] = {
+    {gwy_app_data_browser_get_data_ids, "/%d/data/visible"},
+    {gwy_app_data_browser_get_graph_ids, "/0/graph/graph/%d/visible"},
+    {gwy_app_data_browser_get_volume_ids, "/brick/%d/visible"},
+    {gwy_app_data_browser_get_xyz_ids, "/xyz/%d/visible"},
 };
 
-static void drift_correction(GwyContainer *data, GwyRunType run,
-                             G_GNUC_UNUSED const gchar *name) {
-  printf("Drift correction\n");
-  DriftCorrectionData *drift_correction_data =
-      malloc(sizeof(DriftCorrectionData));
-  drift_correction_data->images_len = 0;
-  drift_correction_data->images_cap = 32;
-  drift_correction_data->images =
-      malloc(drift_correction_data->images_cap * sizeof(SelectedImage));
+static gint memory_budget_get(void) {
+  gint32 budget = MEMORY_BUDGET_DEFAULT;
 
-  drift_correction_data->selected_images_len = 0;
-  drift_correction_data->selected_images_cap = 32;
-  drift_correction_data->selected_imgs =
-      malloc(drift_correction_data->images_cap * sizeof(SelectedImage));
+  gwy_container_gis_int32_by_name(gwy_app_settings_get(), MEMORY_BUDGET_KEY,
+                                  &budget);
+  return MAX(budget, 1);
+}
 
-  drift_correction_data->current_preview = 0;
+static gsize container_data_size(GwyContainer *container) {
+  gint *data_ids = gwy_app_data_browser_get_data_ids(container);
+  gsize size = 0;
 
-  // // Collect all images from all currently opened files
-  gwy_app_data_browser_foreach(*(GwyAppDataForeachFunc)setup_dc_data,
-                               drift_correction_data);
-  for (int i = 0; i < drift_correction_data->images_len; i++) {
-    printf("ALL IMAGES: container id : %d, img_id : %d\n",
-           drift_correction_data->images[i].container_id,
-           drift_correction_data->images[i].img_id);
+  for (gint i = 0; data_ids[i] != -1; i++) {
+    GwyDataField *data_field = gwy_container_get_object(
+        container, gwy_app_get_data_key_for_id(data_ids[i]));
+    size += (gsize)gwy_data_field_get_xres(data_field) *
+            gwy_data_field_get_yres(data_field) * sizeof(gdouble);
   }
+  g_free(data_ids);
+  return size;
+}
 
-  // GtkWidget* prompt_dialog = gwy_dialog_new("Select Images");
-  GtkWidget *prompt_dialog =
-      gtk_dialog_new_with_buttons("Select Images", NULL, 0,
-                                  // _("_Reset"), RESPONSE_RESET,
-                                  GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
-                                  GTK_STOCK_OK, GTK_RESPONSE_OK, NULL);
-  gtk_window_set_default_size(GTK_WINDOW(prompt_dialog), 1350, 750);
+static gboolean container_is_pinned(GwyContainer *container) {
+  gint container_id = gwy_app_data_browser_get_number(container);
 
-  // gwy_dialog_add_buttons(GWY_DIALOG(prompt_dialog), GWY_RESPONSE_RESET,
-  // GTK_RESPONSE_CANCEL, GTK_RESPONSE_OK, 0);
-  gtk_dialog_set_default_response(GTK_DIALOG(prompt_dialog), GTK_RESPONSE_OK);
+  if (gwy_undo_container_get_modified(container) ||
+      (drift_containers && g_hash_table_lookup(
+                               drift_containers,
+                               GINT_TO_POINTER(container_id)))) {
+    return TRUE;
+  }
 
-  GtkListStore *list_store = gtk_list_store_new(
-      N_COLS, G_TYPE_INT, G_TYPE_STRING, GDK_TYPE_PIXBUF, G_TYPE_INT);
-  GtkTreeIter iter;
+  gboolean pinned = FALSE;
+  for (guint k = 0; !pinned && k < G_N_ELEMENTS(container_views); k++) {
+    gint *ids = container_views[k].get_ids(container);
+    for (gint i = 0; !pinned && ids[i] != -1; i++) {
+      gchar visible_key[40];
+      g_snprintf(visible_key, sizeof(visible_key),
+                 container_views[k].visible_key, ids[i]);
+      gwy_container_gis_boolean_by_name(container, visible_key, &pinned);
+    }
+    g_free(ids);
+  }
+  return pinned;
+}
+
+/* Keeps a container that a Drift correction window reads from, until as
+ * many calls with pin FALSE */
+static void drift_container_pin(gint container_id, gboolean pin) {
+  if (!drift_containers) {
+    drift_containers = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+
+  gpointer key = GINT_TO_POINTER(container_id);
+  gint count = GPOINTER_TO_INT(g_hash_table_lookup(drift_containers, key));
+  count += pin ? 1 : -1;
+  if (count > 0) {
+    g_hash_table_insert(drift_containers, key, GINT_TO_POINTER(count));
+  } else {
+    g_hash_table_remove(drift_containers, key);
+  }
+}
+
+/* Removes containers from the tail until the rest fits into the budget. The
+ * most recently used one always stays. */
+static void resident_containers_trim(void) {
+  gsize budget = (gsize)memory_budget_get() << 20;
+  gsize total = 0;
+  GList *l, *prev;
+
+  // Containers the user closed in the data browser meanwhile are dropped
+  for (l = resident_containers.head; l; l = prev) {
+    ResidentContainer *resident = l->data;
+    prev = l->next;
+    if (gwy_app_data_browser_get(resident->container_id)) {
+      total += resident->size;
+    } else {
+      g_queue_delete_link(&resident_containers, l);
+      g_free(resident);
+    }
+  }
+
+  for (l = resident_containers.tail; l && l->prev && total > budget;
+       l = prev) {
+    ResidentContainer *resident = l->data;
+    GwyContainer *container = gwy_app_data_browser_get(resident->container_id);
+    prev = l->prev;
+    if (container_is_pinned(container)) {
+      continue;
+    }
+    gwy_app_data_browser_remove(container);
+    total -= resident->size;
+    g_queue_delete_link(&resident_containers, l);
+    g_free(resident);
+  }
+}
+
+/* Puts a container the Folder Overview opened under the memory budget */
+static void resident_container_add(GwyContainer *container) {
+  ResidentContainer *resident = g_new0(ResidentContainer, 1);
+
+  resident->container_id = gwy_app_data_browser_get_number(container);
+  resident->size = container_data_size(container);
+  g_queue_push_head(&resident_containers, resident);
+  resident_containers_trim();
+}
+
+/* Marks a container as used; containers not under the budget are ignored */
+static void resident_container_touch(GwyContainer *container) {
+  gint container_id = gwy_app_data_browser_get_number(container);
+
+  for (GList *l = resident_containers.head; l; l = l->next) {
+    ResidentContainer *resident = l->data;
+    if (resident->container_id == container_id) {
+      g_queue_unlink(&resident_containers, l);
+      g_queue_push_head_link(&resident_containers, l);
+      resident_containers_trim();
+      return;
+    }
+  }
+}
+
+/* Removes a container the Folder Overview opened once its file was rewritten
+ * or deleted, unless it is pinned. Containers not under the budget, which the
+ * user opened, are left alone. */
+static void resident_container_drop(gint container_id) {
+  for (GList *l = resident_containers.head; l; l = l->next) {
+    ResidentContainer *resident = l->data;
+    if (resident->container_id != container_id) {
+      continue;
+    }
 
-  for (int i = 0; i < drift_correction_data->images_len; i++) {
-    gint img_id = drift_correction_data->images[i].img_id;
-    gint container_id = drift_correction_data->images[i].container_id;
     GwyContainer *container = gwy_app_data_browser_get(container_id);
-    GQuark key = gwy_app_get_data_key_for_id(img_id);
-    GwyDataField *data_field = gwy_container_get_object(container, key);
-    level_plane(data_field);
-    // gwy_data_field_data_changed(data_field);
-    GdkPixbuf *thumbnail =
-        gwy_app_get_channel_thumbnail(container, img_id, 200, 200);
-    char *data_field_title = gwy_app_get_data_field_title(container, img_id);
+    if (container && container_is_pinned(container)) {
+      return;
+    }
+    if (container) {
+      gwy_app_data_browser_remove(container);
+    }
+    g_queue_delete_link(&resident_containers, l);
+    g_free(resident);
+    return;
+  }
+}
 
-    int title_length = snprintf(NULL, 0, "%s", /*filename,*/ data_field_title);
-    char *title = malloc(title_length + 1);
-    snprintf(title, title_length + 1, "%s", /*filename,*/ data_field_title);
+static void on_memory_budget_changed(GtkSpinButton *spin) {
+  gwy_container_set_int32_by_name(gwy_app_settings_get(), MEMORY_BUDGET_KEY,
+                                  gtk_spin_button_get_value_as_int(spin));
+  resident_containers_trim();
+}
+
+/* Spin button for the budget, in MiB */
+static GtkWidget *memory_budget_spin_new(void) {
+  GtkWidget *spin = gtk_spin_button_new_with_range(64, 1 << 20, 64);
 
-    int id_length = snprintf(NULL, 0, "%i", img_id);
-    char *id_str = malloc(id_length + 1);
-    snprintf(id_str, id_length + 1, "%d", img_id);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), memory_budget_get());
+  g_signal_connect(spin, "value-changed",
+                   G_CALLBACK(on_memory_budget_changed), NULL);
+  return spin;
+}
 
-    gtk_list_store_append(list_store, &iter);
-    gtk_list_store_set(list_store, &iter, IMG_ID_COL, img_id, TITLE_COL, title,
-                       THUMBNAIL_COL, thumbnail, CONTAINER_ID_COL, container_id,
-                       -1);
+/*
+ * Export of an overview as contact sheet, see z-sheet.c.
+ *
+ * The sources of all tiles are collected from the list store on the main
+ * thread: the cached thumbnail if there is one, otherwise the channel of an
+ * open container or the image of an indexed .mul file. The sheet is written
+ * by a thread of its own and the tiles are rendered by the workers of
+ * z-sheet.c, so the overview stays usable meanwhile. Channels are never
+ * read by the workers: a tile has the main loop decimate its channel, as it
+ * is at that moment, and only levels and colours the small copy.
+ */
+#define SHEET_COLUMNS 10
+
+typedef struct {
+  gchar *title;
+  gchar *cache_file; // rendered thumbnail, if cached
+  // A channel of an open container...
+  GwyDataField *data_field;
+  const guchar *lut; // palette of the channel, owned by the export
+  // ...or an image of an indexed .mul file
+  gchar *filename;
+  MulImageInfo label;
+} SheetSource;
+
+typedef struct {
+  GtkWidget *button;
+  GPtrArray *sources;
+  GHashTable *luts; // gradient name -> 256 RGB triplets
+  gchar *filename;
+  gint columns;
+  gint per_page;
+  gint done;
+  guint progress_id;
+  gboolean ok;
+  gint64 start;
+  GMutex lock; // for the tiles waiting on the main loop
+  GCond cond;
+} SheetExport;
+
+/* A tile waiting for the main loop to decimate its channel */
+typedef struct {
+  SheetExport *export;
+  SheetSource *source;
+  gdouble *thumb;
+  gint width;
+  gint height;
+  LevelResult level;
+  gboolean done;
+} SheetHold;
+
+static void sheet_source_free(gpointer p) {
+  SheetSource *source = p;
+
+  if (source->data_field) {
+    g_object_unref(source->data_field);
   }
+  g_free(source->title);
+  g_free(source->cache_file);
+  g_free(source->filename);
+  g_free(source);
+}
 
-  GtkWidget *icon_view = gtk_icon_view_new();
-  gtk_icon_view_set_model(GTK_ICON_VIEW(icon_view), GTK_TREE_MODEL(list_store));
-  gtk_icon_view_set_text_column(GTK_ICON_VIEW(icon_view), TITLE_COL);
-  gtk_icon_view_set_pixbuf_column(GTK_ICON_VIEW(icon_view), THUMBNAIL_COL);
-  gtk_icon_view_set_selection_mode(GTK_ICON_VIEW(icon_view),
-                                   GTK_SELECTION_MULTIPLE);
+/* Samples the palette of a channel the way the thumbnails are drawn */
+static const guchar *sheet_export_lut(SheetExport *export,
+                                      GwyContainer *container, gint img_id) {
+  const guchar *gradient_name = NULL;
+  gchar palette_key[32];
+
+  g_snprintf(palette_key, sizeof(palette_key), "/%d/base/palette", img_id);
+  gwy_container_gis_string_by_name(container, palette_key, &gradient_name);
+  GwyGradient *gradient =
+      gwy_gradients_get_gradient((const gchar *)gradient_name);
+  const gchar *name = gwy_resource_get_name(GWY_RESOURCE(gradient));
+
+  guchar *lut = g_hash_table_lookup(export->luts, name);
+  if (!lut) {
+    lut = g_new(guchar, 3 * 256);
+    for (gint k = 0; k < 256; k++) {
+      GwyRGBA rgba;
+      gwy_gradient_get_color(gradient, k / 255.0, &rgba);
+      lut[3 * k] = (guchar)(255.999 * rgba.r);
+      lut[3 * k + 1] = (guchar)(255.999 * rgba.g);
+      lut[3 * k + 2] = (guchar)(255.999 * rgba.b);
+    }
+    g_hash_table_insert(export->luts, g_strdup(name), lut);
+  }
+  return lut;
+}
 
-  GtkWidget *scroll_area = gtk_scrolled_window_new(NULL, NULL);
-  gtk_scrolled_window_add_with_viewport(GTK_SCROLLED_WINDOW(scroll_area),
-                                        icon_view);
-  // gwy_dialog_add_content(GWY_DIALOG(prompt_dialog), scroll_area, TRUE, TRUE,
-  // 0);
-  //
-  // gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(prompt_dialog))),
-  // scroll_area, TRUE, TRUE, 2);
-  GtkWidget *content_area =
-      gtk_dialog_get_content_area(GTK_DIALOG(prompt_dialog));
-  gtk_container_add(GTK_CONTAINER(content_area), scroll_area);
+static void sheet_export_add_row(SheetExport *export, GtkTreeModel *model,
+                                 GtkTreeIter *iter) {
+  OverviewFile *file;
+  gchar *markup;
+  gint state, container_id, img_id, img_index;
+
+  gtk_tree_model_get(model, iter, THUMB_STATE_COL, &state, TITLE_COL, &markup,
+                     FILE_COL, &file, CONTAINER_ID_COL, &container_id,
+                     IMG_ID_COL, &img_id, IMG_INDEX_COL, &img_index, -1);
+  if (state == THUMB_HEADER) {
+    g_free(markup);
+    return;
+  }
 
-  // GwyDialogOutcome prompt_outcome =
-  // gwy_dialog_run(GWY_DIALOG(prompt_dialog));
-  gtk_widget_show_all(prompt_dialog);
-  gint prompt_response = gtk_dialog_run(GTK_DIALOG(prompt_dialog));
+  SheetSource *source = g_new0(SheetSource, 1);
+  gchar *title = NULL;
+  if (!markup ||
+      !pango_parse_markup(markup, -1, 0, NULL, &title, NULL, NULL)) {
+    title = g_strdup(markup ? markup : "");
+  }
+  g_free(markup);
+  if (file) {
+    gchar *basename = g_path_get_basename(file->filename);
+    source->title = g_strdup_printf("%s: %s", basename, title);
+    g_free(basename);
+    g_free(title);
+  } else {
+    source->title = title;
+  }
 
-  // if (prompt_outcome == GWY_DIALOG_PROCEED) {
-  switch (prompt_response) {
-  case GTK_RESPONSE_OK:
-    printf("OK");
-    gtk_icon_view_selected_foreach(
-        GTK_ICON_VIEW(icon_view),
-        (GtkIconViewForeachFunc)dc_data_append_selected_images,
-        drift_correction_data);
-    for (int i = 0; i < drift_correction_data->selected_images_len; i++) {
-      printf("SELECTED IMAGES: img_id: %d, container_id: %d\n",
-             drift_correction_data->selected_imgs[i].img_id,
-             drift_correction_data->selected_imgs[i].container_id);
+  if (file && file->cache_key) {
+    source->cache_file = thumbnail_cache_file(
+        file->cache_key, img_index >= 0 ? img_index : img_id);
+    if (!g_file_test(source->cache_file, G_FILE_TEST_EXISTS)) {
+      g_clear_pointer(&source->cache_file, g_free);
     }
-    gtk_widget_destroy(prompt_dialog);
-    break;
+  }
+
+  GwyContainer *container =
+      container_id >= 0 ? gwy_app_data_browser_get(container_id) : NULL;
+  GwyDataField *data_field = NULL;
+  if (!source->cache_file && container && img_id >= 0 &&
+      gwy_container_gis_object(container, gwy_app_get_data_key_for_id(img_id),
+                               &data_field)) {
+    source->data_field = g_object_ref(data_field);
+    source->lut = sheet_export_lut(export, container, img_id);
+  } else if (!source->cache_file && file && img_index >= 0 &&
+             img_index < file->n_labels) {
+    source->filename = g_strdup(file->filename);
+    source->label = file->labels[img_index];
+  }
+
+  g_ptr_array_add(export->sources, source);
+}
+
+/* Main loop part of a tile: decimates the channel as it is now, the worker
+ * gets the leveled thumbnail only */
+static gboolean sheet_source_decimate(gpointer user_data) {
+  SheetHold *hold = user_data;
+  GwyDataField *data_field = hold->source->data_field;
+  const LevelResult *cached = level_cache_get(data_field);
+
+  if (cached) {
+    hold->level = *cached;
+  }
+  hold->thumb = thumbnail_from_data(gwy_data_field_get_data_const(data_field),
+                                    gwy_data_field_get_xres(data_field),
+                                    gwy_data_field_get_yres(data_field),
+                                    cached != NULL, &hold->level,
+                                    &hold->width, &hold->height);
+
+  g_mutex_lock(&hold->export->lock);
+  hold->done = TRUE;
+  g_cond_broadcast(&hold->export->cond);
+  g_mutex_unlock(&hold->export->lock);
+  return FALSE;
+}
+
+/* Worker part of a tile */
+static void sheet_export_tile(gint index, SheetTile *tile,
+                              gpointer user_data) {
+  SheetExport *export = user_data;
+  SheetSource *source = g_ptr_array_index(export->sources, index);
+  LevelResult level;
+  gdouble *thumb = NULL;
+  gint width, height;
+
+  tile->title = g_strdup(source->title);
+  if (source->cache_file) {
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(source->cache_file, NULL);
+    if (pixbuf) {
+      gint n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+      gint rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+      const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+      tile->width = gdk_pixbuf_get_width(pixbuf);
+      tile->height = gdk_pixbuf_get_height(pixbuf);
+      tile->pixels = g_new(guchar, (gsize)3 * tile->width * tile->height);
+      for (gint i = 0; i < tile->height; i++) {
+        for (gint j = 0; j < tile->width; j++) {
+          memcpy(tile->pixels + 3 * ((gsize)i * tile->width + j),
+                 pixels + (gsize)i * rowstride + n_channels * j, 3);
+        }
+      }
+      g_object_unref(pixbuf);
+      return;
+    }
+  }
+
+  if (source->data_field) {
+    SheetHold hold = {.export = export, .source = source};
+    g_idle_add(sheet_source_decimate, &hold);
+    g_mutex_lock(&export->lock);
+    while (!hold.done) {
+      g_cond_wait(&export->cond, &export->lock);
+    }
+    g_mutex_unlock(&export->lock);
+
+    thumb = hold.thumb;
+    width = hold.width;
+    height = hold.height;
+    level = hold.level;
+  } else if (source->filename) {
+    thumb = mul_read_image_preview(source->filename, &source->label, &width,
+                                   &height);
+    if (thumb) {
+      level_plane_buffer(thumb, width, height, &level);
+    }
+  }
+  if (thumb) {
+    sheet_tile_set_data(tile, thumb, width, height, &level, source->lut);
+    g_free(thumb);
+  }
+}
+
+static gboolean sheet_export_progress(gint done, G_GNUC_UNUSED gint n_tiles,
+                                      gpointer user_data) {
+  SheetExport *export = user_data;
+
+  g_atomic_int_set(&export->done, done);
+  return TRUE;
+}
+
+static gboolean sheet_export_show_progress(gpointer user_data) {
+  SheetExport *export = user_data;
+  gchar *label = g_strdup_printf("Exporting %d/%u",
+                                 g_atomic_int_get(&export->done),
+                                 export->sources->len);
+
+  gtk_button_set_label(GTK_BUTTON(export->button), label);
+  g_free(label);
+  return TRUE;
+}
+
+/* Main loop part of the export */
+static gboolean sheet_export_finish(gpointer user_data) {
+  SheetExport *export = user_data;
+
+  z_stats_end(Z_STAT_SHEET_EXPORT, export->start, export->sources->len);
+  if (export->ok) {
+    g_debug("Sheet with %u images written to %s", export->sources->len,
+            export->filename);
+  } else {
+    GtkWidget *dialog = gtk_message_dialog_new(
+        GTK_WINDOW(gtk_widget_get_toplevel(export->button)),
+        GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+        "The sheet could not be written to %s.", export->filename);
+    g_signal_connect(dialog, "response", G_CALLBACK(gtk_widget_destroy),
+                     NULL);
+    gtk_widget_show(dialog);
+  }
+
+  g_source_remove(export->progress_id);
+  gtk_button_set_label(GTK_BUTTON(export->button), "Export Sheet...");
+  gtk_widget_set_sensitive(export->button, TRUE);
+  g_object_unref(export->button);
+  g_ptr_array_free(export->sources, TRUE);
+  g_hash_table_destroy(export->luts);
+  g_mutex_clear(&export->lock);
+  g_cond_clear(&export->cond);
+  g_free(export->filename);
+  g_free(export);
+  return FALSE;
+}
+
+static gpointer sheet_export_run(gpointer user_data) {
+  SheetExport *export = user_data;
+
+  export->ok = contact_sheet_write(export->filename, export->sources->len,
+                                   export->columns, export->per_page,
+                                   sheet_export_tile, sheet_export_progress,
+                                   export);
+  g_idle_add(sheet_export_finish, export);
+  return NULL;
+}
+
+/* Asks for the file and the layout, FALSE if cancelled */
+static gboolean sheet_export_ask(GtkWidget *parent, gchar **filename,
+                                 gint *columns, gint *per_page) {
+  GtkWidget *dialog = gtk_file_chooser_dialog_new(
+      "Export Sheet", GTK_WINDOW(parent), GTK_FILE_CHOOSER_ACTION_SAVE,
+      GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_SAVE,
+      GTK_RESPONSE_ACCEPT, NULL);
+  gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog),
+                                                 TRUE);
+  gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "overview.png");
+
+  GtkWidget *columns_spin = gtk_spin_button_new_with_range(1, 100, 1);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(columns_spin), SHEET_COLUMNS);
+  // 0 puts everything on a single sheet
+  GtkWidget *per_page_spin = gtk_spin_button_new_with_range(0, 100000, 10);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(per_page_spin), 0);
+  GtkWidget *hbox = gtk_hbox_new(FALSE, 5);
+  gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new("Columns:"), FALSE, FALSE,
+                     0);
+  gtk_box_pack_start(GTK_BOX(hbox), columns_spin, FALSE, FALSE, 0);
+  gtk_box_pack_start(GTK_BOX(hbox),
+                     gtk_label_new("Images per page (0 for one page):"),
+                     FALSE, FALSE, 10);
+  gtk_box_pack_start(GTK_BOX(hbox), per_page_spin, FALSE, FALSE, 0);
+  gtk_widget_show_all(hbox);
+  gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(dialog), hbox);
+
+  gboolean ok = gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT;
+  if (ok) {
+    *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+    *columns = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(columns_spin));
+    *per_page =
+        gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(per_page_spin));
+  }
+  gtk_widget_destroy(dialog);
+  return ok && *filename;
+}
+
+static void on_sheet_btn_click(GtkButton *button, GtkIconView *icon_view) {
+  ThumbnailQueue *queue =
+      g_object_get_data(G_OBJECT(icon_view), THUMBNAIL_QUEUE_KEY);
+  GtkTreeModel *model = GTK_TREE_MODEL(queue->store);
+  gchar *filename = NULL;
+  gint columns, per_page;
+
+  if (!sheet_export_ask(gtk_widget_get_toplevel(GTK_WIDGET(button)),
+                        &filename, &columns, &per_page)) {
+    return;
+  }
+
+  SheetExport *export = g_new0(SheetExport, 1);
+  export->start = z_stats_begin();
+  export->sources = g_ptr_array_new_with_free_func(sheet_source_free);
+  export->luts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  export->filename = filename;
+  export->columns = columns;
+  export->per_page = per_page;
+
+  GtkTreeIter iter;
+  gboolean valid = gtk_tree_model_get_iter_first(model, &iter);
+  while (valid) {
+    sheet_export_add_row(export, model, &iter);
+    valid = gtk_tree_model_iter_next(model, &iter);
+  }
+  if (!export->sources->len) {
+    fprintf(stderr, "Nothing to export\n");
+    g_ptr_array_free(export->sources, TRUE);
+    g_hash_table_destroy(export->luts);
+    g_free(export->filename);
+    g_free(export);
+    return;
+  }
+
+  g_mutex_init(&export->lock);
+  g_cond_init(&export->cond);
+  export->button = g_object_ref(button);
+  gtk_widget_set_sensitive(GTK_WIDGET(button), FALSE);
+  export->progress_id = g_timeout_add(250, sheet_export_show_progress, export);
+  sheet_export_show_progress(export);
+  g_thread_unref(g_thread_new("sheet-export", sheet_export_run, export));
+}
+
+/* Button exporting the icon view as contact sheet */
+static GtkWidget *sheet_button_new(GtkWidget *icon_view) {
+  GtkWidget *button = gtk_button_new_with_label("Export Sheet...");
+
+  g_signal_connect(button, "clicked", G_CALLBACK(on_sheet_btn_click),
+                   icon_view);
+  return button;
+}
+
+/*
+ * Filters of the Folder Overview, asked for before the scan and remembered
+ * in the settings. The extensions are checked on the names while walking the
+ * directories. Everything else is checked in the worker before a file is
+ * loaded: .mul files by the labels read by mul_read_index(), where every
+ * image is checked on its own, other files by their modification time only.
+ * Files that are not indexed can't tell their scan size or channel names
+ * without being loaded, so they are skipped while one of these is set.
+ */
+#define FOLDER_SETTINGS_PREFIX "/module/z_module/folder/"
+
+typedef struct {
+  gboolean recursive;
+  gchar **extensions; // lower case, with the dot
+  gint64 date_from;   // 0 for no limit
+  gint64 date_to;     // exclusive, 0 for no limit
+  gdouble size_min;   // in m, 0 for no limit
+  gdouble size_max;
+  gchar *channel; // case folded, NULL for any
+} FolderFilter;
+
+static void folder_filter_clear(FolderFilter *filter) {
+  g_strfreev(filter->extensions);
+  g_free(filter->channel);
+}
+
+static gboolean folder_filter_has_image_filters(const FolderFilter *filter) {
+  return filter->size_min > 0.0 || filter->size_max > 0.0 || filter->channel;
+}
+
+static gboolean folder_filter_accepts_name(const FolderFilter *filter,
+                                           const gchar *name) {
+  gchar *lower = g_ascii_strdown(name, -1);
+  gboolean ok = FALSE;
+
+  for (gint i = 0; !ok && filter->extensions[i]; i++) {
+    ok = endswith(lower, filter->extensions[i]);
+  }
+  g_free(lower);
+  return ok;
+}
+
+static gboolean folder_filter_accepts_time(const FolderFilter *filter,
+                                           gint64 timestamp) {
+  return (!filter->date_from || timestamp >= filter->date_from) &&
+         (!filter->date_to || timestamp < filter->date_to);
+}
+
+/* An image of a .mul file; file_time stands in for unknown timestamps */
+static gboolean folder_filter_accepts_image(const FolderFilter *filter,
+                                            const MulImageInfo *info,
+                                            gint64 file_time) {
+  gdouble size = MAX(info->xreal, info->yreal);
+  if (!folder_filter_accepts_time(
+          filter, info->timestamp ? info->timestamp : file_time) ||
+      (filter->size_min > 0.0 && size < filter->size_min) ||
+      (filter->size_max > 0.0 && size > filter->size_max)) {
+    return FALSE;
+  }
+  if (!filter->channel) {
+    return TRUE;
+  }
+
+  gchar *title = g_utf8_casefold(info->title, -1);
+  gboolean ok = strstr(title, filter->channel) != NULL;
+  g_free(title);
+  return ok;
+}
+
+/* Any other file, before it is loaded */
+static gboolean folder_filter_accepts_file(const FolderFilter *filter,
+                                           gint64 file_time) {
+  return !folder_filter_has_image_filters(filter) &&
+         folder_filter_accepts_time(filter, file_time);
+}
+
+/* Start of the day given as YYYY-MM-DD, plus days; 0 if empty or invalid */
+static gint64 parse_date(const gchar *text, gint days) {
+  gint year, month, day;
+  gint64 timestamp = 0;
+
+  if (!*text) {
+    return 0;
+  }
+  if (sscanf(text, "%d-%d-%d", &year, &month, &day) == 3) {
+    GDateTime *date = g_date_time_new_local(year, month, day, 0, 0, 0);
+    if (date) {
+      GDateTime *shifted = g_date_time_add_days(date, days);
+      timestamp = g_date_time_to_unix(shifted);
+      g_date_time_unref(shifted);
+      g_date_time_unref(date);
+    }
+  }
+  if (!timestamp) {
+    fprintf(stderr, "Ignoring invalid date %s\n", text);
+  }
+  return timestamp;
+}
+
+static gchar **parse_extensions(const gchar *text) {
+  gchar **words = g_strsplit_set(text, " ,;", -1);
+  GPtrArray *extensions = g_ptr_array_new();
+
+  for (gint i = 0; words[i]; i++) {
+    if (*words[i]) {
+      gchar *lower = g_ascii_strdown(words[i], -1);
+      g_ptr_array_add(extensions,
+                      g_strconcat(*lower == '.' ? "" : ".", lower, NULL));
+      g_free(lower);
+    }
+  }
+  if (!extensions->len) {
+    g_ptr_array_add(extensions, g_strdup(".mul"));
+  }
+  g_ptr_array_add(extensions, NULL);
+  g_strfreev(words);
+  return (gchar **)g_ptr_array_free(extensions, FALSE);
+}
+
+static const gchar *settings_get_string(const gchar *name,
+                                        const gchar *fallback) {
+  gchar key[64];
+  const guchar *value = (const guchar *)fallback;
+
+  g_snprintf(key, sizeof(key), FOLDER_SETTINGS_PREFIX "%s", name);
+  gwy_container_gis_string_by_name(gwy_app_settings_get(), key, &value);
+  return (const gchar *)value;
+}
+
+static GtkWidget *folder_filter_entry(GtkWidget *table, gint row,
+                                      const gchar *label, const gchar *name,
+                                      const gchar *fallback) {
+  GtkWidget *entry = gtk_entry_new();
+
+  gtk_entry_set_text(GTK_ENTRY(entry), settings_get_string(name, fallback));
+  gtk_table_attach(GTK_TABLE(table), gtk_label_new(label), 0, 1, row, row + 1,
+                   GTK_FILL, 0, 0, 0);
+  gtk_table_attach(GTK_TABLE(table), entry, 1, 2, row, row + 1,
+                   GTK_EXPAND | GTK_FILL, 0, 0, 0);
+  return entry;
+}
+
+/* Takes the text of an entry into the settings */
+static const gchar *folder_filter_entry_store(GtkWidget *entry,
+                                              const gchar *name) {
+  gchar key[64];
+
+  g_snprintf(key, sizeof(key), FOLDER_SETTINGS_PREFIX "%s", name);
+  gwy_container_set_const_string_by_name(
+      gwy_app_settings_get(), key,
+      (const guchar *)gtk_entry_get_text(GTK_ENTRY(entry)));
+  return settings_get_string(name, "");
+}
+
+/* Asks for the scan mode and the filters. Returns FALSE if cancelled. */
+static gboolean folder_filter_dialog(FolderFilter *filter) {
+  GwyContainer *settings = gwy_app_settings_get();
+  gboolean recursive = FALSE;
+  gdouble size_min = 0.0, size_max = 0.0;
+
+  gwy_container_gis_boolean_by_name(settings,
+                                    FOLDER_SETTINGS_PREFIX "recursive",
+                                    &recursive);
+  gwy_container_gis_double_by_name(settings, FOLDER_SETTINGS_PREFIX "size_min",
+                                   &size_min);
+  gwy_container_gis_double_by_name(settings, FOLDER_SETTINGS_PREFIX "size_max",
+                                   &size_max);
+
+  GtkWidget *dialog = gtk_dialog_new_with_buttons(
+      "Folder Overview", NULL, GTK_DIALOG_MODAL, GTK_STOCK_CANCEL,
+      GTK_RESPONSE_CANCEL, GTK_STOCK_OK, GTK_RESPONSE_OK, NULL);
+  gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+
+  GtkWidget *table = gtk_table_new(7, 2, FALSE);
+  gtk_table_set_row_spacings(GTK_TABLE(table), 5);
+  gtk_table_set_col_spacings(GTK_TABLE(table), 10);
+  gtk_container_set_border_width(GTK_CONTAINER(table), 5);
+
+  GtkWidget *recursive_check =
+      gtk_check_button_new_with_label("Include subdirectories");
+  gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(recursive_check), recursive);
+  gtk_table_attach(GTK_TABLE(table), recursive_check, 0, 2, 0, 1, GTK_FILL, 0,
+                   0, 0);
+  GtkWidget *extensions_entry = folder_filter_entry(
+      table, 1, "Extensions:", "extensions", ".mul");
+  GtkWidget *from_entry = folder_filter_entry(
+      table, 2, "Recorded from (YYYY-MM-DD):", "date_from", "");
+  GtkWidget *to_entry = folder_filter_entry(
+      table, 3, "Recorded until (YYYY-MM-DD):", "date_to", "");
+  GtkWidget *channel_entry = folder_filter_entry(
+      table, 6, "Channel name contains:", "channel", "");
+
+  GtkWidget *min_spin = gtk_spin_button_new_with_range(0, 1e6, 10);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(min_spin), size_min);
+  gtk_table_attach(GTK_TABLE(table), gtk_label_new("Min. scan size (nm):"), 0,
+                   1, 4, 5, GTK_FILL, 0, 0, 0);
+  gtk_table_attach(GTK_TABLE(table), min_spin, 1, 2, 4, 5, GTK_FILL, 0, 0, 0);
+  GtkWidget *max_spin = gtk_spin_button_new_with_range(0, 1e6, 10);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(max_spin), size_max);
+  gtk_table_attach(GTK_TABLE(table), gtk_label_new("Max. scan size (nm):"), 0,
+                   1, 5, 6, GTK_FILL, 0, 0, 0);
+  gtk_table_attach(GTK_TABLE(table), max_spin, 1, 2, 5, 6, GTK_FILL, 0, 0, 0);
+
+  gtk_box_pack_start(
+      GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), table, TRUE,
+      TRUE, 0);
+  gtk_widget_show_all(table);
+
+  gboolean ok = gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK;
+  if (ok) {
+    recursive =
+        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(recursive_check));
+    size_min = gtk_spin_button_get_value(GTK_SPIN_BUTTON(min_spin));
+    size_max = gtk_spin_button_get_value(GTK_SPIN_BUTTON(max_spin));
+    gwy_container_set_boolean_by_name(
+        settings, FOLDER_SETTINGS_PREFIX "recursive", recursive);
+    gwy_container_set_double_by_name(
+        settings, FOLDER_SETTINGS_PREFIX "size_min", size_min);
+    gwy_container_set_double_by_name(
+        settings, FOLDER_SETTINGS_PREFIX "size_max", size_max);
+
+    const gchar *channel = folder_filter_entry_store(channel_entry, "channel");
+    filter->recursive = recursive;
+    filter->extensions = parse_extensions(
+        folder_filter_entry_store(extensions_entry, "extensions"));
+    filter->date_from =
+        parse_date(folder_filter_entry_store(from_entry, "date_from"), 0);
+    filter->date_to =
+        parse_date(folder_filter_entry_store(to_entry, "date_to"), 1);
+    filter->size_min = 1e-9 * size_min;
+    filter->size_max = 1e-9 * size_max;
+    filter->channel = *channel ? g_utf8_casefold(channel, -1) : NULL;
+  }
+  gtk_widget_destroy(dialog);
+  return ok;
+}
+
+/*
+ * The Folder Overview is filled by a pipeline: FOLDER_WALKERS threads list
+ * the directory and, in recursive mode, its subdirectories, one job per
+ * directory, and queue every file with a matching extension in the worker
+ * pool. There it is filtered and indexed from the cache or from its labels.
+ * Finished files are appended to the icon view from idle callbacks; files
+ * the workers could not index are loaded completely there, because file
+ * modules and the data browser may only be used from the main loop. At most
+ * FOLDER_MAX_QUEUED files are between discovery and the icon view, so a huge
+ * directory does not flood the pool. Cancelling or closing the window stops
+ * the discovery, skips the files not started yet and throws away the ones
+ * that finish afterwards.
+ *
+ * Afterwards the top directory stays watched by a GFileMonitor (inotify on
+ * Linux). Files that were written, moved in or deleted are collected for
+ * FOLDER_WATCH_DELAY ms and then only these go through the same pipeline;
+ * their old rows are replaced by the new ones at the end of the view. Every
+ * load of a file gets a generation number, so a load overtaken by a newer
+ * one for the same file is thrown away.
+ */
+#define FOLDER_MAX_QUEUED 64
+#define FOLDER_WALKERS 4
+#define FOLDER_WATCH_DELAY 500
+
+typedef struct {
+  GtkWidget *icon_view; // NULL once the window is destroyed
+  GtkWidget *progress;
+  GtkWidget *cancel_btn;
+  gchar *dir;
+  FolderFilter filter;
+  GThreadPool *walkers;
+  GMutex lock;
+  GCond cond;
+  gint dirs_pending; // directories not listed yet
+  gint queued;       // discovered, but not appended yet
+  gint total;
+  gint done;
+  gboolean discovered;
+  gint cancelled;
+  gint ref_count;
+  // Main loop only
+  GFileMonitor *monitor;
+  GHashTable *shown;       // filename -> OverviewFile in the icon view
+  GHashTable *generations; // filename -> newest load, 0 for discovery
+  GHashTable *changed;     // filenames waiting for FOLDER_WATCH_DELAY
+  guint changed_id;
+} FolderScan;
+
+struct FolderEntry {
+  FolderScan *scan;
+  gchar *filename;
+  gint generation;
+  gchar *cache_key;
+  gboolean indexed;
+  gint n_channels;
+  gint *img_ids; // positions in the file if indexed
+  gchar **titles;
+  MulImageInfo *labels; // all of them if indexed, without previews
+  gint n_labels;
+  gboolean needs_load; // neither cached nor indexed
+  GwyContainer *container; // only if the file had to be loaded
+};
+
+static FolderScan *folder_scan_ref(FolderScan *scan) {
+  g_atomic_int_inc(&scan->ref_count);
+  return scan;
+}
+
+static void folder_scan_unref(FolderScan *scan) {
+  if (!g_atomic_int_dec_and_test(&scan->ref_count)) {
+    return;
+  }
+  g_mutex_clear(&scan->lock);
+  g_cond_clear(&scan->cond);
+  folder_filter_clear(&scan->filter);
+  g_free(scan->dir);
+  g_free(scan);
+}
+
+static void folder_scan_cancel(FolderScan *scan) {
+  g_atomic_int_set(&scan->cancelled, TRUE);
+  g_mutex_lock(&scan->lock);
+  g_cond_broadcast(&scan->cond);
+  g_mutex_unlock(&scan->lock);
+  if (scan->cancel_btn) {
+    gtk_widget_set_sensitive(scan->cancel_btn, FALSE);
+  }
+  // An incomplete view is not kept up to date either
+  if (scan->monitor) {
+    g_signal_handlers_disconnect_by_data(scan->monitor, scan);
+    g_file_monitor_cancel(scan->monitor);
+    g_clear_object(&scan->monitor);
+  }
+  if (scan->changed_id) {
+    g_source_remove(scan->changed_id);
+    scan->changed_id = 0;
+  }
+}
+
+static void on_folder_window_destroy(GtkWidget *window, FolderScan *scan) {
+  scan->icon_view = NULL;
+  scan->progress = NULL;
+  scan->cancel_btn = NULL;
+  folder_scan_cancel(scan);
+  g_hash_table_destroy(scan->shown);
+  g_hash_table_destroy(scan->generations);
+  g_hash_table_destroy(scan->changed);
+  folder_scan_unref(scan);
+}
+
+static void folder_scan_update_progress(FolderScan *scan) {
+  if (!scan->progress) {
+    return;
+  }
+
+  g_mutex_lock(&scan->lock);
+  gint done = scan->done, total = scan->total;
+  gboolean discovered = scan->discovered;
+  g_mutex_unlock(&scan->lock);
+
+  gchar *text;
+  if (g_atomic_int_get(&scan->cancelled)) {
+    text = g_strdup_printf("Cancelled after %d of %d files", done, total);
+  } else if (!discovered) {
+    text = g_strdup_printf("Loaded %d of %d files found so far", done, total);
+  } else if (done < total) {
+    text = g_strdup_printf("Loaded %d of %d files", done, total);
+  } else {
+    // Reloaded files count more than once in total
+    text = g_strdup_printf("%u files%s", g_hash_table_size(scan->shown),
+                           scan->monitor ? ", watching for changes" : "");
+    gtk_widget_set_sensitive(scan->cancel_btn, FALSE);
+  }
+  gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(scan->progress),
+                                total ? (gdouble)done / total : 0.0);
+  gtk_progress_bar_set_text(GTK_PROGRESS_BAR(scan->progress), text);
+  g_free(text);
+}
+
+static gboolean folder_scan_discovered(gpointer user_data) {
+  FolderScan *scan = user_data;
+
+  g_thread_pool_free(scan->walkers, FALSE, TRUE);
+  scan->walkers = NULL;
+  folder_scan_update_progress(scan);
+  folder_scan_unref(scan);
+  return FALSE;
+}
+
+static void folder_entry_free(FolderEntry *entry) {
+  if (entry->container) {
+    g_object_unref(entry->container);
+  }
+  g_strfreev(entry->titles);
+  g_free(entry->img_ids);
+  g_free(entry->labels);
+  g_free(entry->cache_key);
+  g_free(entry->filename);
+  folder_scan_unref(entry->scan);
+  g_free(entry);
+}
+
+/* Removes the rows of a file, the containers loaded from it before and its
+ * cache entry, unless the new load has the same key */
+static void folder_scan_drop_file(FolderScan *scan, const gchar *filename,
+                                  const gchar *new_key) {
+  OverviewFile *file = g_hash_table_lookup(scan->shown, filename);
+  if (!file) {
+    return;
+  }
+
+  if (file->cache_key && g_strcmp0(file->cache_key, new_key) != 0) {
+    worker_pool_push(thumbnail_cache_remove, g_strdup(file->cache_key));
+  }
+  GArray *container_ids = g_array_new(FALSE, FALSE, sizeof(gint));
+  iconview_remove_file(GTK_ICON_VIEW(scan->icon_view), file, container_ids);
+  g_hash_table_remove(scan->shown, filename);
+  for (guint k = 0; k < container_ids->len; k++) {
+    resident_container_drop(g_array_index(container_ids, gint, k));
+  }
+  g_array_free(container_ids, TRUE);
+}
+
+/* Loads a file the workers could not index and caches its channels. Main
+ * loop only. */
+static void folder_entry_load_container(FolderEntry *entry) {
+  gint64 start = z_stats_begin();
+  GError *error = NULL;
+
+  entry->container =
+      gwy_file_load(entry->filename, GWY_RUN_NONINTERACTIVE, &error);
+  if (!entry->container) {
+    fprintf(stderr, "Can't load %s: %s\n", entry->filename,
+            error ? error->message : "unknown error");
+    g_clear_error(&error);
+    return;
+  }
+
+  gint *data_ids = gwy_app_data_browser_get_data_ids(entry->container);
+  gint n_ids = 0;
+  while (data_ids[n_ids] != -1) {
+    n_ids++;
+  }
+  entry->img_ids = data_ids;
+  entry->n_channels = n_ids;
+  thumbnail_cache_store_container(entry->filename, entry->cache_key,
+                                  entry->container);
+  z_stats_end(Z_STAT_FILE_LOAD, start, 1);
+}
+
+/* Main loop part of a folder entry */
+static gboolean folder_entry_finish(gpointer user_data) {
+  FolderEntry *entry = user_data;
+  FolderScan *scan = entry->scan;
+  GtkIconView *icon_view =
+      scan->icon_view ? GTK_ICON_VIEW(scan->icon_view) : NULL;
+
+  g_mutex_lock(&scan->lock);
+  scan->queued--;
+  scan->done++;
+  g_cond_signal(&scan->cond);
+  g_mutex_unlock(&scan->lock);
+
+  // Also drops a container nobody has seen yet, and loads overtaken by a
+  // newer one of the same file
+  if (!icon_view || g_atomic_int_get(&scan->cancelled) ||
+      entry->generation < GPOINTER_TO_INT(g_hash_table_lookup(
+                              scan->generations, entry->filename))) {
+    folder_entry_free(entry);
+    folder_scan_update_progress(scan);
+    return FALSE;
+  }
+
+  if (entry->needs_load) {
+    folder_entry_load_container(entry);
+  }
+  folder_scan_drop_file(scan, entry->filename, entry->cache_key);
+
+  OverviewFile *file;
+  if (entry->container) {
+    gwy_app_data_browser_add(entry->container);
+    gwy_app_data_browser_set_keep_invisible(entry->container, TRUE);
+    file = iconview_append_file(icon_view, entry->filename, entry->cache_key,
+                                FALSE);
+    for (gint i = 0; i < entry->n_channels; i++) {
+      iconview_append_channel(icon_view, entry->container, entry->img_ids[i],
+                              file);
+    }
+    resident_container_add(entry->container);
+    g_hash_table_insert(scan->shown, g_strdup(entry->filename), file);
+  } else if (entry->n_channels) {
+    file = iconview_append_file(icon_view, entry->filename, entry->cache_key,
+                                entry->indexed);
+    file->labels = entry->labels;
+    file->n_labels = entry->n_labels;
+    entry->labels = NULL;
+    g_hash_table_insert(scan->shown, g_strdup(entry->filename), file);
+    for (gint i = 0; i < entry->n_channels; i++) {
+      iconview_append_row(icon_view, file, -1,
+                          entry->indexed ? -1 : entry->img_ids[i],
+                          entry->indexed ? entry->img_ids[i] : -1,
+                          entry->titles[i]);
+    }
+  }
+
+  folder_entry_free(entry);
+  folder_scan_update_progress(scan);
+  return FALSE;
+}
+
+/* Worker part of a folder entry */
+static void folder_entry_load(gpointer user_data) {
+  FolderEntry *entry = user_data;
+
+  if (g_atomic_int_get(&entry->scan->cancelled)) {
+    g_idle_add(folder_entry_finish, entry);
+    return;
+  }
+
+  gint64 start = z_stats_begin();
+  const FolderFilter *filter = &entry->scan->filter;
+  GStatBuf st;
+  gint64 file_time = g_stat(entry->filename, &st) == 0 ? st.st_mtime : 0;
+  entry->cache_key = thumbnail_cache_key(entry->filename);
+  // The cache knows neither times nor sizes, so filtered scans read the
+  // labels again; files that are not indexed may still come from it
+  gboolean filtered = filter->date_from || filter->date_to ||
+                      folder_filter_has_image_filters(filter);
+  gboolean handled = !filtered && thumbnail_cache_lookup(entry);
+  if (!handled) {
+    handled = folder_read_indexed_file(entry, file_time) ||
+              !folder_filter_accepts_file(filter, file_time) ||
+              thumbnail_cache_lookup(entry);
+  }
+  // Left to folder_entry_finish, which also counts it
+  entry->needs_load = !handled;
+  if (handled) {
+    z_stats_end(Z_STAT_FILE_LOAD, start, 1);
+  }
+
+  g_idle_add(folder_entry_finish, entry);
+}
+
+/* Queues a file in the worker pool once there is room. Returns FALSE if the
+ * scan was cancelled meanwhile. */
+static gboolean folder_scan_add_file(FolderScan *scan, const gchar *filename) {
+  g_mutex_lock(&scan->lock);
+  while (scan->queued >= FOLDER_MAX_QUEUED &&
+         !g_atomic_int_get(&scan->cancelled)) {
+    g_cond_wait(&scan->cond, &scan->lock);
+  }
+  if (g_atomic_int_get(&scan->cancelled)) {
+    g_mutex_unlock(&scan->lock);
+    return FALSE;
+  }
+  scan->queued++;
+  scan->total++;
+  g_mutex_unlock(&scan->lock);
+
+  FolderEntry *entry = g_new0(FolderEntry, 1);
+  entry->scan = folder_scan_ref(scan);
+  entry->filename = g_strdup(filename);
+  worker_pool_push(folder_entry_load, entry);
+  return TRUE;
+}
+
+/* Lists one directory, run by the walkers */
+static void folder_scan_walk(gpointer data, gpointer user_data) {
+  gchar *dir = data;
+  FolderScan *scan = user_data;
+  GError *error = NULL;
+  GDir *gdir = NULL;
+
+  if (!g_atomic_int_get(&scan->cancelled) &&
+      !(gdir = g_dir_open(dir, 0, &error))) {
+    fprintf(stderr, "Can't open %s: %s\n", dir, error->message);
+    g_clear_error(&error);
+  }
+
+  const gchar *name;
+  while (gdir && (name = g_dir_read_name(gdir))) {
+    gchar *path = g_build_filename(dir, name, NULL);
+    gboolean ok = TRUE;
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+      // Linked directories could form loops
+      if (scan->filter.recursive &&
+          !g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+        g_mutex_lock(&scan->lock);
+        scan->dirs_pending++;
+        g_mutex_unlock(&scan->lock);
+        g_thread_pool_push(scan->walkers, g_strdup(path), NULL);
+      }
+    } else if (folder_filter_accepts_name(&scan->filter, name)) {
+      ok = folder_scan_add_file(scan, path);
+    }
+    g_free(path);
+    if (!ok) {
+      break;
+    }
+  }
+  if (gdir) {
+    g_dir_close(gdir);
+  }
+  g_free(dir);
+
+  g_mutex_lock(&scan->lock);
+  gboolean discovered = --scan->dirs_pending == 0;
+  scan->discovered = discovered;
+  g_mutex_unlock(&scan->lock);
+  if (discovered) {
+    g_idle_add(folder_scan_discovered, scan);
+  }
+}
+
+/* Reloads the files collected by on_folder_changed, or removes the ones that
+ * are gone */
+static gboolean folder_scan_flush_changes(gpointer user_data) {
+  FolderScan *scan = user_data;
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init(&iter, scan->changed);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    const gchar *filename = key;
+    gint generation = GPOINTER_TO_INT(
+                          g_hash_table_lookup(scan->generations, filename)) +
+                      1;
+    g_hash_table_replace(scan->generations, g_strdup(filename),
+                         GINT_TO_POINTER(generation));
+
+    if (!g_file_test(filename, G_FILE_TEST_IS_REGULAR)) {
+      folder_scan_drop_file(scan, filename, NULL);
+      continue;
+    }
+
+    g_mutex_lock(&scan->lock);
+    scan->queued++;
+    scan->total++;
+    g_mutex_unlock(&scan->lock);
+
+    FolderEntry *entry = g_new0(FolderEntry, 1);
+    entry->scan = folder_scan_ref(scan);
+    entry->filename = g_strdup(filename);
+    entry->generation = generation;
+    worker_pool_push(folder_entry_load, entry);
+  }
+  g_hash_table_remove_all(scan->changed);
+  scan->changed_id = 0;
+
+  folder_scan_update_progress(scan);
+  return FALSE;
+}
+
+static void folder_scan_file_changed(FolderScan *scan, GFile *file) {
+  if (!file) {
+    return;
+  }
+  gchar *name = g_file_get_basename(file);
+  if (folder_filter_accepts_name(&scan->filter, name)) {
+    // Same key as the walkers use
+    g_hash_table_add(scan->changed, g_build_filename(scan->dir, name, NULL));
+    if (!scan->changed_id) {
+      scan->changed_id =
+          g_timeout_add(FOLDER_WATCH_DELAY, folder_scan_flush_changes, scan);
+    }
+  }
+  g_free(name);
+}
+
+static void on_folder_changed(G_GNUC_UNUSED GFileMonitor *monitor,
+                              GFile *file, GFile *other_file,
+                              GFileMonitorEvent event, FolderScan *scan) {
+  switch (event) {
+  // Files still being written show up with CHANGES_DONE_HINT
+  case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+  case G_FILE_MONITOR_EVENT_DELETED:
+  case G_FILE_MONITOR_EVENT_MOVED_IN:
+  case G_FILE_MONITOR_EVENT_MOVED_OUT:
+    folder_scan_file_changed(scan, file);
+    break;
+  case G_FILE_MONITOR_EVENT_RENAMED:
+    folder_scan_file_changed(scan, file);
+    folder_scan_file_changed(scan, other_file);
+    break;
+  default:
+    break;
+  }
+}
+
+static void folder_overview(GwyContainer *data, GwyRunType run,
+                            G_GNUC_UNUSED const gchar *name) {
+  FolderFilter filter = {0};
+  if (!folder_filter_dialog(&filter)) {
+    return;
+  }
+
+  const gchar *filename = gwy_file_get_filename_sys(data);
+  gchar *dir = g_path_get_dirname(filename);
+
+  gint64 start = z_stats_begin();
+  GtkWidget *main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title(GTK_WINDOW(main_window), "Folder Overview");
+  gtk_window_set_default_size(GTK_WINDOW(main_window), 1350, 750);
+  // gtk_window_set_resizable(GTK_WINDOW(main_window), FALSE);
+
+  // One icon view for the whole folder, each file starts with a header row
+  GtkWidget *icon_view = iconview_new();
+  g_signal_connect(icon_view, "item-activated", G_CALLBACK(on_icon_dbl_click),
+                   NULL);
+  GtkWidget *scroll_area = iconview_scrolled(GTK_ICON_VIEW(icon_view));
+
+  FolderScan *scan = g_new0(FolderScan, 1);
+  scan->icon_view = icon_view;
+  scan->progress = gtk_progress_bar_new();
+  scan->cancel_btn = gtk_button_new_from_stock(GTK_STOCK_CANCEL);
+  scan->dir = dir;
+  scan->filter = filter;
+  scan->ref_count = 2; // window and discovery
+  g_mutex_init(&scan->lock);
+  g_cond_init(&scan->cond);
+  g_signal_connect(main_window, "destroy",
+                   G_CALLBACK(on_folder_window_destroy), scan);
+  g_signal_connect_swapped(scan->cancel_btn, "clicked",
+                           G_CALLBACK(folder_scan_cancel), scan);
+  scan->shown = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  scan->generations =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  scan->changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  GError *error = NULL;
+  GFile *gdir = g_file_new_for_path(dir);
+  scan->monitor = g_file_monitor_directory(gdir, G_FILE_MONITOR_WATCH_MOVES,
+                                           NULL, &error);
+  if (scan->monitor) {
+    g_signal_connect(scan->monitor, "changed", G_CALLBACK(on_folder_changed),
+                     scan);
+  } else {
+    fprintf(stderr, "Can't watch %s: %s\n", dir,
+            error ? error->message : "unknown error");
+    g_clear_error(&error);
+  }
+  g_object_unref(gdir);
+
+  GtkWidget *hbox = gtk_hbox_new(FALSE, 5);
+  gtk_box_pack_start(GTK_BOX(hbox), scan->progress, TRUE, TRUE, 0);
+  gtk_box_pack_start(GTK_BOX(hbox), scan->cancel_btn, FALSE, FALSE, 0);
+  gtk_box_pack_start(GTK_BOX(hbox), sheet_button_new(icon_view), FALSE, FALSE,
+                     0);
+  gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new("Memory budget (MiB):"),
+                     FALSE, FALSE, 0);
+  gtk_box_pack_start(GTK_BOX(hbox), memory_budget_spin_new(), FALSE, FALSE, 0);
+
+  GtkWidget *vbox = gtk_vbox_new(FALSE, 0);
+  gtk_container_add(GTK_CONTAINER(main_window), vbox);
+
+  gtk_box_pack_start(GTK_BOX(vbox), scroll_area, TRUE, TRUE, 1);
+  gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 1);
+
+  folder_scan_update_progress(scan);
+  gtk_widget_show_all(main_window);
+  z_stats_end(Z_STAT_WIDGETS, start, 1);
+
+  worker_pool_push(thumbnail_cache_prune, NULL);
+  scan->dirs_pending = 1;
+  scan->walkers = g_thread_pool_new(folder_scan_walk, scan, FOLDER_WALKERS,
+                                    FALSE, NULL);
+  g_thread_pool_push(scan->walkers, g_strdup(dir), NULL);
+}
+
+static void basename(const char *path, char *base) {
+  size_t len = strlen(path);
+
+  // If the path is empty, return the current directory "."
+  if (len == 0) {
+    strcpy(base, ".");
+    return;
+  }
+
+  // Find the last occurrence of either slash '/' or backslash '\'
+  const char *last_fwd_slash = strrchr(path, '/');
+  const char *last_bck_slash = strrchr(path, '\\');
+  const char *last_slash =
+      last_fwd_slash > last_bck_slash ? last_fwd_slash : last_bck_slash;
+
+  // If no slash is found, the entire path is the basename
+  if (!last_slash) {
+    strcpy(base, path);
+    return;
+  }
+
+  // Move past the last slash to get the basename
+  strcpy(base, last_slash + 1);
+}
+
+static bool endswith(const char *str, const char *suffix) {
+  size_t str_len = strlen(str);
+  size_t suffix_len = strlen(suffix);
+
+  if (str_len < suffix_len) {
+    return false;
+  }
+
+  return strcmp(str + (str_len - suffix_len), suffix) == 0;
+}
+
+/*
+ * Thumbnail cache of the Folder Overview.
+ *
+ * For every file there is a key file <key>.ini with the ids and titles of its
+ * channels, and one <key>-<id>.png per channel, where <key> is a hash of the
+ * path, size and modification time of the file. A changed file thus simply
+ * gets a new key. An entry is only used when all its thumbnails are present.
+ * Files that were only indexed by mul_read_index() store the positions of the
+ * channels in the file instead of their ids.
+ *
+ * The entry of a file shown in the Folder Overview is deleted as soon as the
+ * file gets a new key or is deleted. Every Folder Overview also prunes the
+ * cache once in the background: entries of files that changed meanwhile or
+ * are gone are deleted, then the least recently written ones until the
+ * cache fits into THUMBNAIL_CACHE_MAX_SIZE. Entries written since Gwyddion
+ * started are left alone, as they may still be written by thumbnail jobs
+ * and scans running at the same time.
+ */
+#define THUMBNAIL_CACHE_MAX_SIZE ((gint64)256 << 20)
+
+static gint64 thumbnail_cache_session_start; // in s, like st_mtime
+
+static void thumbnail_cache_init(void) {
+  thumbnail_cache_session_start = g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static gchar *thumbnail_cache_dir(void) {
+  return g_build_filename(g_get_user_cache_dir(), MOD_NAME, "thumbnails",
+                          NULL);
+}
+
+/* Returns NULL if the file can't be stat()ed */
+static gchar *thumbnail_cache_key(const gchar *filename) {
+  GStatBuf st;
+  if (g_stat(filename, &st) != 0) {
+    return NULL;
+  }
+
+  gchar *id = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT,
+                              filename, (gint64)st.st_size,
+                              (gint64)st.st_mtime);
+  gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+  g_free(id);
+  return key;
+}
+
+static gchar *thumbnail_cache_file(const gchar *key, gint img_id) {
+  gchar *dir = thumbnail_cache_dir();
+  gchar *name = img_id < 0 ? g_strdup_printf("%s.ini", key)
+                           : g_strdup_printf("%s-%d.png", key, img_id);
+  gchar *path = g_build_filename(dir, name, NULL);
+
+  g_free(name);
+  g_free(dir);
+  return path;
+}
+
+/* Deletes all files of a cache entry. Run in the worker pool, the key is
+ * freed. */
+static void thumbnail_cache_remove(gpointer user_data) {
+  gchar *key = user_data;
+  gchar *dir = thumbnail_cache_dir();
+  GDir *gdir = g_dir_open(dir, 0, NULL);
+  gsize key_len = strlen(key);
+  const gchar *name;
+
+  while (gdir && (name = g_dir_read_name(gdir))) {
+    if (strncmp(name, key, key_len) == 0 &&
+        (name[key_len] == '.' || name[key_len] == '-')) {
+      gchar *path = g_build_filename(dir, name, NULL);
+      g_unlink(path);
+      g_free(path);
+    }
+  }
+  if (gdir) {
+    g_dir_close(gdir);
+  }
+  g_free(dir);
+  g_free(key);
+}
+
+typedef struct {
+  gchar *key;
+  gint64 size;
+  gint64 mtime;
+  gboolean stale; // the file changed, is gone, or the index is missing
+} CacheEntry;
+
+static void cache_entry_free(gpointer p) {
+  CacheEntry *entry = p;
+
+  g_free(entry->key);
+  g_free(entry);
+}
+
+static gint compare_cache_entries(gconstpointer a, gconstpointer b) {
+  const CacheEntry *ea = *(const CacheEntry *const *)a;
+  const CacheEntry *eb = *(const CacheEntry *const *)b;
+
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* Deletes the entries of files that changed or are gone, then the oldest
+ * ones until the cache fits into THUMBNAIL_CACHE_MAX_SIZE. Run in the worker
+ * pool. */
+static void thumbnail_cache_prune(G_GNUC_UNUSED gpointer user_data) {
+  gchar *dir = thumbnail_cache_dir();
+  GDir *gdir = g_dir_open(dir, 0, NULL);
+  if (!gdir) {
+    g_free(dir);
+    return;
+  }
+
+  GHashTable *entries =
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, cache_entry_free);
+  const gchar *name;
+  while ((name = g_dir_read_name(gdir))) {
+    const gchar *end = strpbrk(name, ".-");
+    if (!end) {
+      continue;
+    }
+    gchar *key = g_strndup(name, end - name);
+    CacheEntry *entry = g_hash_table_lookup(entries, key);
+    if (!entry) {
+      entry = g_new0(CacheEntry, 1);
+      entry->key = key;
+      entry->stale = TRUE;
+      g_hash_table_insert(entries, entry->key, entry);
+    } else {
+      g_free(key);
+    }
+
+    gchar *path = g_build_filename(dir, name, NULL);
+    GStatBuf st;
+    if (g_stat(path, &st) == 0) {
+      entry->size += st.st_size;
+      entry->mtime = MAX(entry->mtime, (gint64)st.st_mtime);
+    }
+    if (g_str_has_suffix(name, ".ini")) {
+      GKeyFile *index = g_key_file_new();
+      gchar *filename = NULL;
+      if (g_key_file_load_from_file(index, path, G_KEY_FILE_NONE, NULL)) {
+        filename = g_key_file_get_string(index, "file", "path", NULL);
+      }
+      gchar *current = filename ? thumbnail_cache_key(filename) : NULL;
+      entry->stale = g_strcmp0(current, entry->key) != 0;
+      g_free(current);
+      g_free(filename);
+      g_key_file_free(index);
+    }
+    g_free(path);
+  }
+  g_dir_close(gdir);
+  g_free(dir);
+
+  GPtrArray *sorted = g_ptr_array_new();
+  GHashTableIter iter;
+  gpointer value;
+  gint64 total = 0;
+  g_hash_table_iter_init(&iter, entries);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    CacheEntry *entry = value;
+    if (entry->mtime >= thumbnail_cache_session_start) {
+      // Possibly half written, still counts against the size
+      total += entry->size;
+    } else if (entry->stale) {
+      thumbnail_cache_remove(g_strdup(entry->key));
+    } else {
+      total += entry->size;
+      g_ptr_array_add(sorted, entry);
+    }
+  }
+  g_ptr_array_sort(sorted, compare_cache_entries);
+  for (guint i = 0; i < sorted->len && total > THUMBNAIL_CACHE_MAX_SIZE;
+       i++) {
+    CacheEntry *entry = g_ptr_array_index(sorted, i);
+    thumbnail_cache_remove(g_strdup(entry->key));
+    total -= entry->size;
+  }
+
+  g_ptr_array_free(sorted, TRUE);
+  g_hash_table_destroy(entries);
+}
+
+/* Fills the entry from the cache. Returns FALSE, leaving the entry untouched,
+ * if there is no valid entry for the file. The thumbnails themselves are only
+ * loaded once their rows are scrolled into view; indexed files can always
+ * recreate them, so only the others need all of them. Safe to call from a
+ * worker. */
+static gboolean thumbnail_cache_lookup(FolderEntry *entry) {
+  const gchar *key = entry->cache_key;
+  if (!key) {
+    return FALSE;
+  }
+
+  gchar *index_file = thumbnail_cache_file(key, -1);
+  GKeyFile *index = g_key_file_new();
+  gboolean ok =
+      g_key_file_load_from_file(index, index_file, G_KEY_FILE_NONE, NULL);
+  g_free(index_file);
+
+  gchar *cached_name = NULL;
+  gint *img_ids = NULL;
+  gsize n_ids = 0;
+  gboolean indexed = FALSE;
+  if (ok) {
+    cached_name = g_key_file_get_string(index, "file", "path", NULL);
+    indexed = g_key_file_get_boolean(index, "file", "indexed", NULL);
+    ok = g_strcmp0(cached_name, entry->filename) == 0;
+  }
+  if (ok) {
+    img_ids = g_key_file_get_integer_list(index, "file", "channels", &n_ids,
+                                          NULL);
+    ok = img_ids != NULL;
+  }
+
+  gchar **titles = g_new0(gchar *, n_ids + 1);
+  MulImageInfo *labels = indexed ? g_new0(MulImageInfo, n_ids) : NULL;
+  for (gsize i = 0; ok && i < n_ids; i++) {
+    gchar *group = g_strdup_printf("channel-%d", img_ids[i]);
+    titles[i] = g_key_file_get_string(index, group, "title", NULL);
+    ok = titles[i] != NULL;
+    if (ok && indexed) {
+      // Entries written before the offsets were cached lack them
+      MulImageInfo *label = &labels[i];
+      label->data_offset =
+          g_key_file_get_int64(index, group, "offset", NULL);
+      label->xres = g_key_file_get_integer(index, group, "xres", NULL);
+      label->yres = g_key_file_get_integer(index, group, "yres", NULL);
+      g_strlcpy(label->title, titles[i], sizeof(label->title));
+      ok = label->data_offset > 0 && label->xres > 0 && label->yres > 0;
+    } else if (ok) {
+      gchar *thumbnail_file = thumbnail_cache_file(key, img_ids[i]);
+      ok = g_file_test(thumbnail_file, G_FILE_TEST_IS_REGULAR);
+      g_free(thumbnail_file);
+    }
+    g_free(group);
+  }
+
+  if (ok) {
+    entry->indexed = indexed;
+    entry->n_channels = n_ids;
+    entry->img_ids = img_ids;
+    entry->titles = titles;
+    entry->labels = labels;
+    entry->n_labels = indexed ? n_ids : 0;
+  } else {
+    g_strfreev(titles);
+    g_free(img_ids);
+    g_free(labels);
+  }
+  g_free(cached_name);
+  g_key_file_free(index);
+
+  return ok;
+}
+
+/* Records the file and its channels; the thumbnails themselves are saved
+ * separately as they are finished. The labels of an indexed file, by
+ * position, let its previews be read without walking the label chain. */
+static void thumbnail_cache_store_index(const gchar *filename,
+                                        const gchar *key, const gint *img_ids,
+                                        gchar **titles, gint n_channels,
+                                        const MulImageInfo *labels) {
+  if (!key) {
+    return;
+  }
+
+  gchar *dir = thumbnail_cache_dir();
+  if (g_mkdir_with_parents(dir, 0755) != 0) {
+    fprintf(stderr, "Can't create %s\n", dir);
+    g_free(dir);
+    return;
+  }
+  g_free(dir);
+
+  GKeyFile *index = g_key_file_new();
+  g_key_file_set_string(index, "file", "path", filename);
+  g_key_file_set_boolean(index, "file", "indexed", labels != NULL);
+  g_key_file_set_integer_list(index, "file", "channels", (gint *)img_ids,
+                              n_channels);
+  for (gint i = 0; i < n_channels; i++) {
+    gchar *group = g_strdup_printf("channel-%d", img_ids[i]);
+    g_key_file_set_string(index, group, "title", titles[i]);
+    if (labels) {
+      const MulImageInfo *label = &labels[img_ids[i]];
+      g_key_file_set_int64(index, group, "offset", label->data_offset);
+      g_key_file_set_integer(index, group, "xres", label->xres);
+      g_key_file_set_integer(index, group, "yres", label->yres);
+    }
+    g_free(group);
+  }
+
+  gchar *index_file = thumbnail_cache_file(key, -1);
+  gchar *contents = g_key_file_to_data(index, NULL, NULL);
+  g_file_set_contents(index_file, contents, -1, NULL);
+
+  g_free(contents);
+  g_free(index_file);
+  g_key_file_free(index);
+}
+
+static void thumbnail_cache_store_container(const gchar *filename,
+                                            const gchar *key,
+                                            GwyContainer *container) {
+  gint *data_ids = gwy_app_data_browser_get_data_ids(container);
+  gint n_ids = 0;
+  while (data_ids[n_ids] != -1) {
+    n_ids++;
+  }
+
+  gchar **titles = g_new0(gchar *, n_ids + 1);
+  for (gint i = 0; i < n_ids; i++) {
+    titles[i] = gwy_app_get_data_field_title(container, data_ids[i]);
+  }
+  thumbnail_cache_store_index(filename, key, data_ids, titles, n_ids, NULL);
+
+  g_strfreev(titles);
+  g_free(data_ids);
+}
+
+/* Fills the entry from the labels read by mul_read_index() and caches the
+ * index. Only the images passing the filter of the scan are kept. The file
+ * is neither loaded nor added to the data browser, the thumbnails are
+ * rendered from the previews once the rows become visible. Safe to call from
+ * a worker. */
+static gboolean folder_read_indexed_file(FolderEntry *entry,
+                                         gint64 file_time) {
+  GPtrArray *images = mul_read_index(entry->filename, -1);
+  if (!images) {
+    return FALSE;
+  }
+
+  entry->indexed = TRUE;
+  entry->img_ids = g_new(gint, images->len);
+  entry->titles = g_new0(gchar *, images->len + 1);
+  entry->labels = g_new(MulImageInfo, images->len);
+  entry->n_labels = images->len;
+  for (guint i = 0; i < images->len; i++) {
+    MulImageInfo *info = g_ptr_array_index(images, i);
+    entry->img_ids[i] = i;
+    entry->titles[i] = g_strdup(info->title);
+    entry->labels[i] = *info;
+    entry->labels[i].preview = NULL;
+  }
+  thumbnail_cache_store_index(entry->filename, entry->cache_key,
+                              entry->img_ids, entry->titles, images->len,
+                              entry->labels);
+
+  for (guint i = 0; i < images->len; i++) {
+    gchar *title = entry->titles[i];
+    entry->titles[i] = NULL;
+    if (folder_filter_accepts_image(&entry->scan->filter,
+                                    g_ptr_array_index(images, i),
+                                    file_time)) {
+      entry->img_ids[entry->n_channels] = i;
+      entry->titles[entry->n_channels++] = title;
+    } else {
+      g_free(title);
+    }
+  }
+
+  g_ptr_array_free(images, TRUE);
+  return TRUE;
+}
+
+#define DC_PREVIEW_SIZE 512
+#define DC_PREFETCH 2
+#define DC_RING_SIZE (2 * DC_PREFETCH + 1)
+
+typedef struct {
+  gint index; // frame shown by the slot, -1 if unused
+  GwyDataField *field;
+  gboolean ready;
+} PreviewSlot;
+
+struct DriftCorrectionData {
+  gint preview_container_id;
+  gint preview_datafield_id;
+  SelectedImage *images;
+  int images_len;
+  int images_cap;
+  SelectedImage *selected_imgs;
+  int selected_images_len;
+  int selected_images_cap;
+  GtkWidget *preview_img;
+  int current_preview;
+  SelectedImage *current_preview_img;
+  GwySelection *selection; // the point selection of the preview
+  GtkWidget *frame_label;
+  gchar *status; // shown below the frame label, see dc_set_status()
+  GtkWidget *model_check;
+  GtkWidget *stream_check;
+  GtkWidget *brick_check;
+  gchar *stream_dir; // where the corrected frames are streamed to, or NULL
+  GArray *pinned_ids; // containers of the frames, kept while the window is
+                      // open, see drift_container_pin()
+  PreviewSlot ring[DC_RING_SIZE];
+  gboolean has_offsets;
+  gint cancelled; // the window is gone, jobs stop and leave the widgets alone
+  gint ref_count; // held by the window and by every running job
+};
+
+struct SelectedImage {
+  gint container_id;
+  gint img_id;
+  gboolean has_selection;
+  gboolean manual; // the point was clicked, tracking leaves it alone
+  gdouble confidence; // of a tracked point, the match score
+  gdouble x_selection;
+  gdouble y_selection;
+  gdouble x_offset; // drift against the first frame, in pixels
+  gdouble y_offset;
+};
+
+/* A frame held for a worker, see dc_frame_acquire() */
+typedef struct {
+  GwyContainer *container;
+  GwyDataField *field; // private copy of the channel
+} DcFrame;
+
+static GwyDataField *dc_data_get_field(SelectedImage *img);
+static gboolean dc_frame_acquire(SelectedImage *img, DcFrame *frame);
+static void dc_frame_release(DcFrame *frame);
+
+static void drift_correction(GwyContainer *data, GwyRunType run,
+                             G_GNUC_UNUSED const gchar *name) {
+  gint64 start = z_stats_begin();
+  DriftCorrectionData *drift_correction_data =
+      malloc(sizeof(DriftCorrectionData));
+  drift_correction_data->images_len = 0;
+  drift_correction_data->images_cap = 32;
+  drift_correction_data->images =
+      malloc(drift_correction_data->images_cap * sizeof(SelectedImage));
+
+  drift_correction_data->selected_images_len = 0;
+  drift_correction_data->selected_images_cap = 32;
+  drift_correction_data->selected_imgs =
+      malloc(drift_correction_data->images_cap * sizeof(SelectedImage));
+
+  drift_correction_data->current_preview = 0;
+  drift_correction_data->current_preview_img = NULL;
+  drift_correction_data->has_offsets = FALSE;
+  drift_correction_data->stream_dir = NULL;
+  drift_correction_data->pinned_ids = NULL;
+  drift_correction_data->status = NULL;
+  drift_correction_data->cancelled = FALSE;
+  drift_correction_data->ref_count = 1;
+  for (int i = 0; i < DC_RING_SIZE; i++) {
+    drift_correction_data->ring[i].index = -1;
+    drift_correction_data->ring[i].field = NULL;
+    drift_correction_data->ring[i].ready = FALSE;
+  }
+
+  // // Collect all images from all currently opened files
+  gwy_app_data_browser_foreach(*(GwyAppDataForeachFunc)setup_dc_data,
+                               drift_correction_data);
+
+  // GtkWidget* prompt_dialog = gwy_dialog_new("Select Images");
+  GtkWidget *prompt_dialog =
+      gtk_dialog_new_with_buttons("Select Images", NULL, 0,
+                                  // _("_Reset"), RESPONSE_RESET,
+                                  GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                  GTK_STOCK_OK, GTK_RESPONSE_OK, NULL);
+  gtk_window_set_default_size(GTK_WINDOW(prompt_dialog), 1350, 750);
+
+  // gwy_dialog_add_buttons(GWY_DIALOG(prompt_dialog), GWY_RESPONSE_RESET,
+  // GTK_RESPONSE_CANCEL, GTK_RESPONSE_OK, 0);
+  gtk_dialog_set_default_response(GTK_DIALOG(prompt_dialog), GTK_RESPONSE_OK);
+
+  GtkWidget *icon_view = iconview_new();
+  for (int i = 0; i < drift_correction_data->images_len; i++) {
+    gint img_id = drift_correction_data->images[i].img_id;
+    gint container_id = drift_correction_data->images[i].container_id;
+    GwyContainer *container = gwy_app_data_browser_get(container_id);
+    iconview_append_channel(GTK_ICON_VIEW(icon_view), container, img_id,
+                            NULL);
+  }
+  gtk_icon_view_set_selection_mode(GTK_ICON_VIEW(icon_view),
+                                   GTK_SELECTION_MULTIPLE);
+
+  GtkWidget *scroll_area = iconview_scrolled(GTK_ICON_VIEW(icon_view));
+  // gwy_dialog_add_content(GWY_DIALOG(prompt_dialog), scroll_area, TRUE, TRUE,
+  // 0);
+  //
+  // gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(prompt_dialog))),
+  // scroll_area, TRUE, TRUE, 2);
+  GtkWidget *content_area =
+      gtk_dialog_get_content_area(GTK_DIALOG(prompt_dialog));
+  gtk_container_add(GTK_CONTAINER(content_area), scroll_area);
+
+  // GwyDialogOutcome prompt_outcome =
+  // gwy_dialog_run(GWY_DIALOG(prompt_dialog));
+  gtk_widget_show_all(prompt_dialog);
+  z_stats_end(Z_STAT_WIDGETS, start, 1);
+  gint prompt_response = gtk_dialog_run(GTK_DIALOG(prompt_dialog));
+
+  // if (prompt_outcome == GWY_DIALOG_PROCEED) {
+  switch (prompt_response) {
+  case GTK_RESPONSE_OK:
+    gtk_icon_view_selected_foreach(
+        GTK_ICON_VIEW(icon_view),
+        (GtkIconViewForeachFunc)dc_data_append_selected_images,
+        drift_correction_data);
+    // Drops the pending thumbnails; running ones work on copies and finish
+    // on their own
+    gtk_widget_destroy(prompt_dialog);
+    break;
+
+  case GTK_RESPONSE_CANCEL:
+    gtk_widget_destroy(prompt_dialog);
+    g_free(drift_correction_data);
+    return;
+  }
+
+  // The Folder Overview must not close the files of the frames meanwhile
+  drift_correction_data->pinned_ids = g_array_new(FALSE, FALSE, sizeof(gint));
+  for (gint i = 0; i < drift_correction_data->selected_images_len; i++) {
+    gint container_id = drift_correction_data->selected_imgs[i].container_id;
+    GArray *ids = drift_correction_data->pinned_ids;
+    guint k = 0;
+    while (k < ids->len && g_array_index(ids, gint, k) != container_id) {
+      k++;
+    }
+    if (k == ids->len) {
+      g_array_append_val(ids, container_id);
+      drift_container_pin(container_id, TRUE);
+    }
+  }
+
+  // The frames are only read until the correction is applied, which writes
+  // the corrected copies into dc_container. Up to then it holds nothing but
+  // the preview.
+  start = z_stats_begin();
+  GwyContainer *dc_container = gwy_container_new();
+  gwy_app_data_browser_add(dc_container);
+  gwy_app_data_browser_set_keep_invisible(dc_container, TRUE);
+  drift_correction_data->preview_container_id =
+      gwy_app_data_browser_get_number(dc_container);
+
+  GwyContainer *first_img_container = gwy_app_data_browser_get(
+      drift_correction_data->selected_imgs[0].container_id);
+  GQuark first_img_key = gwy_app_get_data_key_for_id(
+      drift_correction_data->selected_imgs[0].img_id);
+  GwyDataField *first_df =
+      gwy_container_get_object(first_img_container, first_img_key);
+  GwyDataField *preview_datafield = dc_preview_field_new(first_df);
+  drift_correction_data->preview_datafield_id =
+      gwy_app_data_browser_add_data_field(preview_datafield, dc_container,
+                                          TRUE);
+
+  // Main Window
+  GtkWidget *stack_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  g_signal_connect(stack_window, "destroy", G_CALLBACK(on_dc_window_destroy),
+                   drift_correction_data);
+
+  // Start with first image
+  drift_correction_data->preview_img = gwy_create_preview(
+      dc_container, drift_correction_data->preview_datafield_id, 512, FALSE);
+  // Box where preview image and previous and next buttons live in
+  GtkWidget *preview_vbox = gtk_vbox_new(FALSE, 4);
+
+  GwyPixmapLayer *view_layer = gwy_data_view_get_base_layer(
+      GWY_DATA_VIEW(drift_correction_data->preview_img));
+  if (view_layer == NULL) {
+    g_warning("Drift correction preview has no base layer");
+  }
+  GwyVectorLayer *vec_layer = gwy_data_view_get_top_layer(
+      GWY_DATA_VIEW(drift_correction_data->preview_img));
+  if (vec_layer == NULL) {
+    vec_layer = g_object_new(g_type_from_name("GwyLayerPoint"), NULL);
+    gwy_data_view_set_top_layer(
+        GWY_DATA_VIEW(drift_correction_data->preview_img), vec_layer);
+  }
+
+  gwy_vector_layer_set_selection_key(vec_layer, "/0/select/dc/point");
+  GwySelection *selection = gwy_vector_layer_ensure_selection(vec_layer);
+  gwy_selection_set_max_objects(selection, 1);
+  drift_correction_data->selection = selection;
+  drift_correction_data->frame_label = gtk_label_new(NULL);
+  dc_show_frame(drift_correction_data, 0);
+
+  g_signal_connect(selection, "finished", G_CALLBACK(on_selection_finish),
+                   drift_correction_data);
+
+  // Box where previous and next buttons live in
+  GtkWidget *preview_controls_hbox = gtk_hbox_new(FALSE, 4);
+
+  GtkWidget *prev_btn = gtk_button_new_with_label("<");
+  g_signal_connect(prev_btn, "clicked", G_CALLBACK(on_prev_btn_click),
+                   drift_correction_data);
+  GtkWidget *next_btn = gtk_button_new_with_label(">");
+  g_signal_connect(next_btn, "clicked", G_CALLBACK(on_next_btn_click),
+                   drift_correction_data);
+  GtkWidget *run_btn = gtk_button_new_with_label("Ok");
+  g_signal_connect(run_btn, "clicked", G_CALLBACK(on_run_btn_click),
+                   drift_correction_data);
+  GtkWidget *track_btn = gtk_button_new_with_label("Track");
+  g_signal_connect(track_btn, "clicked", G_CALLBACK(on_track_btn_click),
+                   drift_correction_data);
+
+  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), prev_btn, TRUE, TRUE, 4);
+  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), track_btn, TRUE, TRUE, 4);
+  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), run_btn, TRUE, TRUE, 4);
+  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), next_btn, TRUE, TRUE, 4);
+  gtk_box_pack_start(GTK_BOX(preview_vbox), drift_correction_data->preview_img,
+                     FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(preview_vbox), drift_correction_data->frame_label,
+                     FALSE, FALSE, 4);
+  drift_correction_data->model_check =
+      gtk_check_button_new_with_label("Predict drift from acquisition times");
+  gtk_box_pack_start(GTK_BOX(preview_vbox), drift_correction_data->model_check,
+                     FALSE, FALSE, 4);
+  drift_correction_data->stream_check =
+      gtk_check_button_new_with_label("Write corrected frames to disk");
+  gtk_box_pack_start(GTK_BOX(preview_vbox), drift_correction_data->stream_check,
+                     FALSE, FALSE, 4);
+  drift_correction_data->brick_check =
+      gtk_check_button_new_with_label("Store corrected frames as volume");
+  gtk_box_pack_start(GTK_BOX(preview_vbox), drift_correction_data->brick_check,
+                     FALSE, FALSE, 4);
+  g_signal_connect(drift_correction_data->stream_check, "toggled",
+                   G_CALLBACK(on_stream_check_toggled), drift_correction_data);
+  gtk_box_pack_start(GTK_BOX(preview_vbox), preview_controls_hbox, FALSE, FALSE,
+                     4);
+
+  gtk_container_add(GTK_CONTAINER(stack_window), preview_vbox);
+
+  gtk_widget_show_all(stack_window);
+  z_stats_end(Z_STAT_WIDGETS, start, 1);
+}
+
+/* Lets the Folder Overview close the files of the frames again and stops
+ * the jobs of the window; the last of them frees the data */
+static void on_dc_window_destroy(G_GNUC_UNUSED GtkWidget *window,
+                                 DriftCorrectionData *dc_data) {
+  for (guint k = 0; k < dc_data->pinned_ids->len; k++) {
+    drift_container_pin(g_array_index(dc_data->pinned_ids, gint, k), FALSE);
+  }
+  g_array_free(dc_data->pinned_ids, TRUE);
+  dc_data->pinned_ids = NULL;
+
+  g_atomic_int_set(&dc_data->cancelled, TRUE);
+  // The selection lives in dc_container, which may outlive the window
+  g_signal_handlers_disconnect_by_data(dc_data->selection, dc_data);
+  dc_data->preview_img = NULL;
+  dc_data->selection = NULL;
+  dc_data->frame_label = NULL;
+  dc_data->model_check = NULL;
+  dc_data->stream_check = NULL;
+  dc_data->brick_check = NULL;
+  dc_data_unref(dc_data);
+}
+
+static DriftCorrectionData *dc_data_ref(DriftCorrectionData *dc_data) {
+  g_atomic_int_inc(&dc_data->ref_count);
+  return dc_data;
+}
+
+/* The preview goes with the data; dc_container itself stays as long as
+ * corrected frames of it are shown */
+static void dc_data_unref(DriftCorrectionData *dc_data) {
+  if (!g_atomic_int_dec_and_test(&dc_data->ref_count)) {
+    return;
+  }
+
+  GwyContainer *dc_container =
+      gwy_app_data_browser_get(dc_data->preview_container_id);
+  if (dc_container) {
+    gchar prefix[32];
+    g_snprintf(prefix, sizeof(prefix), "/%d/data",
+               dc_data->preview_datafield_id);
+    gwy_container_remove_by_prefix(dc_container, prefix);
+    if (container_is_pinned(dc_container)) {
+      gwy_app_data_browser_set_keep_invisible(dc_container, FALSE);
+    } else {
+      gwy_app_data_browser_remove(dc_container);
+    }
+  }
+
+  dc_ring_reset(dc_data);
+  free(dc_data->images);
+  free(dc_data->selected_imgs);
+  g_free(dc_data->status);
+  g_free(dc_data->stream_dir);
+  free(dc_data);
+}
+
+/* TRUE once the window is closed. Workers may ask too. */
+static gboolean dc_data_cancelled(DriftCorrectionData *dc_data) {
+  return g_atomic_int_get(&dc_data->cancelled);
+}
+
+static void dc_data_append_image(DriftCorrectionData *dc_data,
+                                 SelectedImage image) {
+  dc_data->images[dc_data->images_len] = image;
+  dc_data->images_len++;
+
+  if (dc_data->images_len == dc_data->images_cap) {
+    dc_data->images = realloc(dc_data->images,
+                              dc_data->images_cap * 2 * sizeof(SelectedImage));
+    dc_data->images_cap *= 2;
+  }
+}
+
+static void dc_data_append_selected_images(GtkIconView *icon_view,
+                                           GtkTreePath *tree_path,
+                                           DriftCorrectionData *dc_data) {
+  GtkTreeIter iter;
+  GtkListStore *store;
+  gint img_id;
+  gint container_id;
+
+  // Get the associated list store
+  store = GTK_LIST_STORE(gtk_icon_view_get_model(icon_view));
+  // Convert the path to an iter
+  gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, tree_path);
+  // Get the value of the first column (assuming it's an integer)
+  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, IMG_ID_COL, &img_id, -1);
+  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, CONTAINER_ID_COL,
+                     &container_id, -1);
+
+  SelectedImage selected_image = {0};
+  selected_image.container_id = container_id;
+  selected_image.img_id = img_id;
+
+  dc_data->selected_imgs[dc_data->selected_images_len] = selected_image;
+  dc_data->selected_images_len++;
+
+  if (dc_data->selected_images_len == dc_data->selected_images_cap) {
+    dc_data->selected_imgs =
+        realloc(dc_data->selected_imgs,
+                dc_data->selected_images_cap * 2 * sizeof(SelectedImage));
+    dc_data->selected_images_cap *= 2;
+  }
+}
+
+static void setup_dc_data(GwyContainer *container,
+                          DriftCorrectionData *drift_correction_data) {
+  gint container_id = gwy_app_data_browser_get_number(container);
+  gint *data_ids = gwy_app_data_browser_get_data_ids(container);
+
+  for (int i = 0; data_ids[i] != -1; i++) {
+    SelectedImage selected_image = {0};
+    selected_image.container_id = container_id;
+    selected_image.img_id = data_ids[i];
+    dc_data_append_image(drift_correction_data, selected_image);
+  }
+}
+
+static void on_selection_finish(GwySelection *selection,
+                                DriftCorrectionData *dc_data) {
+
+  gdouble selection_coords[2];
+  gint n = gwy_selection_get_data(selection, selection_coords);
+
+  SelectedImage *img = dc_data->current_preview_img;
+  img->has_selection = n > 0;
+  img->manual = n > 0;
+  img->confidence = 0.0;
+  img->x_selection = selection_coords[0];
+  img->y_selection = selection_coords[1];
+  dc_show_frame_label(dc_data);
+}
+
+static void on_prev_btn_click(GtkButton *select_btn,
+                              DriftCorrectionData *dc_data) {
+  dc_set_status(dc_data, NULL);
+  if (dc_data->current_preview > 0) {
+    dc_show_frame(dc_data, dc_data->current_preview - 1);
+  }
+}
+
+static void on_next_btn_click(GtkButton *select_btn,
+                              DriftCorrectionData *dc_data) {
+  dc_set_status(dc_data, NULL);
+  if (dc_data->current_preview < dc_data->selected_images_len - 1) {
+    dc_show_frame(dc_data, dc_data->current_preview + 1);
+  }
+}
+
+/* Frames written to disk can't also go into a volume */
+static void on_stream_check_toggled(GtkToggleButton *stream_check,
+                                    DriftCorrectionData *dc_data) {
+  gtk_widget_set_sensitive(dc_data->brick_check,
+                           !gtk_toggle_button_get_active(stream_check));
+}
+
+/* Asks for the directory the corrected frames are streamed to */
+static gchar *choose_stream_dir(void) {
+  GtkWidget *dialog = gtk_file_chooser_dialog_new(
+      "Write Corrected Frames To", NULL, GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+      GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, GTK_STOCK_OK, GTK_RESPONSE_OK,
+      NULL);
+  gchar *dir = NULL;
+
+  if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK) {
+    dir = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+  }
+  gtk_widget_destroy(dialog);
+  return dir;
+}
+
+/* Asks before frames written by an earlier run in dir are overwritten.
+ * Returns FALSE if they must be kept. */
+static gboolean confirm_stream_overwrite(GtkWidget *parent, const gchar *dir,
+                                         gint n_frames) {
+  gint n_existing = 0;
+
+  for (gint k = 0; k < n_frames; k++) {
+    gchar *name = g_strdup_printf("frame-%05d.gsf", k);
+    gchar *filename = g_build_filename(dir, name, NULL);
+    if (g_file_test(filename, G_FILE_TEST_EXISTS)) {
+      n_existing++;
+    }
+    g_free(filename);
+    g_free(name);
+  }
+  if (!n_existing) {
+    return TRUE;
+  }
+
+  GtkWidget *dialog = gtk_message_dialog_new(
+      GTK_WINDOW(gtk_widget_get_toplevel(parent)),
+      GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION,
+      GTK_BUTTONS_YES_NO,
+      "%d of the frame-NNNNN.gsf files already exist in %s. Overwrite them?",
+      n_existing, dir);
+  gboolean ok = gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES;
+  gtk_widget_destroy(dialog);
+  return ok;
+}
+
+static void on_run_btn_click(GtkButton *run_btn, DriftCorrectionData *dc_data) {
+  dc_set_status(dc_data, NULL);
+  g_free(dc_data->stream_dir);
+  dc_data->stream_dir = NULL;
+  if (gtk_toggle_button_get_active(
+          GTK_TOGGLE_BUTTON(dc_data->stream_check))) {
+    dc_data->stream_dir = choose_stream_dir();
+    if (!dc_data->stream_dir) {
+      return;
+    }
+    if (!confirm_stream_overwrite(GTK_WIDGET(run_btn), dc_data->stream_dir,
+                                  dc_data->selected_images_len)) {
+      g_free(dc_data->stream_dir);
+      dc_data->stream_dir = NULL;
+      return;
+    }
+  }
+  drift_estimate_start(dc_data, GTK_WIDGET(run_btn));
+}
+
+/*
+ * Drift estimation.
+ *
+ * The offset of every frame relative to its predecessor is found coarse to
+ * fine by drift_estimate_shift(), see z-kernels.c. The pairs are independent
+ * and are processed in parallel in the worker pool; the offsets relative to
+ * the first frame are summed up on the main thread once all pairs are done.
+ *
+ * If both frames of a pair have a point selected in the preview, the
+ * displacement of the points is used as a seed for the estimation.
+ *
+ * With the drift model enabled, the first DRIFT_MODEL_MIN_FRAMES frames are
+ * estimated as above. For the others, a polynomial in the acquisition time
+ * (linear, quadratic from DRIFT_MODEL_QUADRATIC frames on) is fitted to the
+ * offsets found so far and predicts the displacement. It is then only
+ * checked within DRIFT_MODEL_RADIUS pixels, on a DRIFT_MODEL_PATCH pixel
+ * patch in the centre of the frame, which skips the pyramid altogether.
+ * Frames are done in waves of one per core, the model being refitted after
+ * every wave; if the prediction does not hold, the frame falls back to the
+ * full estimation.
+ */
+#define DRIFT_MODEL_MIN_FRAMES 4
+#define DRIFT_MODEL_QUADRATIC 8
+#define DRIFT_MODEL_RADIUS 3
+#define DRIFT_MODEL_PATCH 256
+#define DRIFT_MODEL_MIN_SCORE 0.5
+
+typedef struct {
+  DriftCorrectionData *dc_data;
+  GtkWidget *run_btn;
+  DcFrame *frames; // released once both of their pairs are done
+  DriftPair *pairs;
+  gint n_pairs;
+  gint next_pair;
+  gint in_flight;
+  gboolean use_model;
+  gdouble *times; // acquisition times of the frames, in s
+  gint times_pending; // files whose labels are still read
+} DriftEstimate;
+
+struct DriftPair {
+  DriftEstimate *estimate;
+  GwyDataField *first; // owned by estimate->frames
+  GwyDataField *second;
+  gboolean seeded;
+  gdouble seed_x; // in pixels
+  gdouble seed_y;
+  gboolean predicted;
+  gdouble pred_dx; // displacement predicted by the drift model
+  gdouble pred_dy;
+  gboolean ok;
+  gboolean done;
+  gdouble dx; // displacement of second against first, in pixels
+  gdouble dy;
+};
+
+static void drift_times_start(DriftEstimate *estimate);
+
+/* Checks the displacement predicted by the drift model on a patch in the
+ * centre of the frames. Returns FALSE if it does not hold. */
+static gboolean drift_pair_check_prediction(DriftPair *pair, gint xres,
+                                            gint yres) {
+  const gdouble *a = gwy_data_field_get_data_const(pair->first);
+  const gdouble *b = gwy_data_field_get_data_const(pair->second);
+  const gint radius = DRIFT_MODEL_RADIUS, n_scores = 2 * radius + 1;
+  gint width = MIN(xres, DRIFT_MODEL_PATCH);
+  gint height = MIN(yres, DRIFT_MODEL_PATCH);
+  gint x0 = (xres - width) / 2, y0 = (yres - height) / 2;
+  gint cx = (gint)floor(pair->pred_dx + 0.5);
+  gint cy = (gint)floor(pair->pred_dy + 0.5);
+  gdouble scores[(2 * DRIFT_MODEL_RADIUS + 1) * (2 * DRIFT_MODEL_RADIUS + 1)];
+
+  gdouble best = -G_MAXDOUBLE;
+  gint best_i = 0, best_j = 0;
+  for (gint i = 0; i < n_scores; i++) {
+    for (gint j = 0; j < n_scores; j++) {
+      gdouble score = drift_region_score(a, b, xres, yres, x0, y0, width,
+                                         height, cx + j - radius,
+                                         cy + i - radius);
+      scores[i * n_scores + j] = score;
+      if (score > best) {
+        best = score;
+        best_i = i;
+        best_j = j;
+      }
+    }
+  }
+
+  // A peak on the border of the window means the prediction was off
+  if (best < DRIFT_MODEL_MIN_SCORE || best_i == 0 || best_j == 0 ||
+      best_i == n_scores - 1 || best_j == n_scores - 1) {
+    return FALSE;
+  }
+
+  pair->dx = cx + best_j - radius +
+             drift_parabola_peak(scores[best_i * n_scores + best_j - 1], best,
+                                 scores[best_i * n_scores + best_j + 1]);
+  pair->dy = cy + best_i - radius +
+             drift_parabola_peak(scores[(best_i - 1) * n_scores + best_j],
+                                 best,
+                                 scores[(best_i + 1) * n_scores + best_j]);
+  return TRUE;
+}
+
+/* Worker part of a pair */
+static void drift_pair_correlate(gpointer user_data) {
+  DriftPair *pair = user_data;
+  gint xres = gwy_data_field_get_xres(pair->first);
+  gint yres = gwy_data_field_get_yres(pair->first);
+  gint64 start = z_stats_begin();
+
+  pair->ok = xres == gwy_data_field_get_xres(pair->second) &&
+             yres == gwy_data_field_get_yres(pair->second);
+  if (dc_data_cancelled(pair->estimate->dc_data)) {
+    pair->ok = FALSE;
+  } else if (!pair->ok) {
+    fprintf(stderr, "Drift correction: frames differ in size\n");
+  } else if (pair->predicted &&
+             drift_pair_check_prediction(pair, xres, yres)) {
+    // The model was right, nothing else to do
+  } else {
+    pair->ok = drift_estimate_shift(
+        gwy_data_field_get_data_const(pair->first),
+        gwy_data_field_get_data_const(pair->second), xres, yres, pair->seeded,
+        pair->seed_x, pair->seed_y, &pair->dx, &pair->dy);
+  }
+  z_stats_end(Z_STAT_DRIFT_ESTIMATE, start, (gint64)xres * yres);
+
+  g_idle_add(drift_pair_finish, pair);
+}
+
+/* Fits v = c0 + c1 u + c2 u^2 (c2 = 0 for degree 1) by least squares */
+static void drift_model_fit(const gdouble *u, const gdouble *v, gint n,
+                            gint degree, gdouble *coeffs) {
+  gint m = degree + 1;
+  gdouble mat[3][4] = {{0.0}};
+
+  for (gint k = 0; k < n; k++) {
+    gdouble pw[3] = {1.0, u[k], u[k] * u[k]};
+    for (gint r = 0; r < m; r++) {
+      for (gint c = 0; c < m; c++) {
+        mat[r][c] += pw[r] * pw[c];
+      }
+      mat[r][m] += pw[r] * v[k];
+    }
+  }
+
+  // Gaussian elimination with partial pivoting, the system is tiny
+  for (gint c = 0; c < m; c++) {
+    gint pivot = c;
+    for (gint r = c + 1; r < m; r++) {
+      if (fabs(mat[r][c]) > fabs(mat[pivot][c])) {
+        pivot = r;
+      }
+    }
+    for (gint k = 0; k <= m; k++) {
+      gdouble tmp = mat[c][k];
+      mat[c][k] = mat[pivot][k];
+      mat[pivot][k] = tmp;
+    }
+    for (gint r = c + 1; r < m; r++) {
+      gdouble f = mat[c][c] != 0.0 ? mat[r][c] / mat[c][c] : 0.0;
+      for (gint k = c; k <= m; k++) {
+        mat[r][k] -= f * mat[c][k];
+      }
+    }
+  }
+  coeffs[0] = coeffs[1] = coeffs[2] = 0.0;
+  for (gint r = m - 1; r >= 0; r--) {
+    gdouble sum = mat[r][m];
+    for (gint c = r + 1; c < m; c++) {
+      sum -= mat[r][c] * coeffs[c];
+    }
+    coeffs[r] = mat[r][r] != 0.0 ? sum / mat[r][r] : 0.0;
+  }
+}
+
+/* Predicts the displacements of the next pairs from the offsets of the frames
+ * up to next_pair */
+static void drift_model_predict(DriftEstimate *estimate, gint n_next) {
+  gint n = estimate->next_pair + 1;
+  gdouble *u = g_new(gdouble, n);
+  gdouble *x = g_new(gdouble, n);
+  gdouble *y = g_new(gdouble, n);
+  const gdouble *t = estimate->times;
+
+  // Time relative to the last known frame, in units of the known span
+  gdouble t_ref = t[n - 1], span = MAX(fabs(t[n - 1] - t[0]), 1e-9);
+  x[0] = y[0] = 0.0;
+  for (gint k = 0; k < n; k++) {
+    u[k] = (t[k] - t_ref) / span;
+    if (k) {
+      x[k] = x[k - 1] + estimate->pairs[k - 1].dx;
+      y[k] = y[k - 1] + estimate->pairs[k - 1].dy;
+    }
+  }
+
+  gint degree = n >= DRIFT_MODEL_QUADRATIC ? 2 : 1;
+  gdouble cx[3], cy[3];
+  drift_model_fit(u, x, n, degree, cx);
+  drift_model_fit(u, y, n, degree, cy);
+
+  for (gint k = 0; k < n_next; k++) {
+    DriftPair *pair = estimate->pairs + estimate->next_pair + k;
+    gdouble u0 = (t[estimate->next_pair + k] - t_ref) / span;
+    gdouble u1 = (t[estimate->next_pair + k + 1] - t_ref) / span;
+    pair->predicted = !pair->seeded;
+    pair->pred_dx = cx[1] * (u1 - u0) + cx[2] * (u1 * u1 - u0 * u0);
+    pair->pred_dy = cy[1] * (u1 - u0) + cy[2] * (u1 * u1 - u0 * u0);
+  }
+
+  g_free(u);
+  g_free(x);
+  g_free(y);
+}
+
+/* Starts the next pairs, or finishes the estimation when all are done */
+static void drift_estimate_next_wave(DriftEstimate *estimate) {
+  gint n_next = estimate->n_pairs - estimate->next_pair;
+
+  if (!n_next || dc_data_cancelled(estimate->dc_data)) {
+    drift_estimate_finish(estimate);
+    return;
+  }
+
+  if (estimate->use_model) {
+    if (estimate->next_pair < DRIFT_MODEL_MIN_FRAMES - 1) {
+      n_next = MIN(n_next, DRIFT_MODEL_MIN_FRAMES - 1 - estimate->next_pair);
+    } else {
+      n_next = MIN(n_next, (gint)g_get_num_processors());
+      drift_model_predict(estimate, n_next);
+    }
+  }
+
+  for (gint k = 0; k < n_next; k++) {
+    estimate->in_flight++;
+    worker_pool_push(drift_pair_correlate,
+                     estimate->pairs + estimate->next_pair++);
+  }
+}
+
+/* Main loop part of a pair */
+static gboolean drift_pair_finish(gpointer user_data) {
+  DriftPair *pair = user_data;
+  DriftEstimate *estimate = pair->estimate;
+
+  // Without a correlation the manual points are all we have
+  if (!pair->ok && pair->seeded) {
+    pair->dx = pair->seed_x;
+    pair->dy = pair->seed_y;
+  }
+  // The copy of a frame goes as soon as both pairs using it are done
+  gint k = pair - estimate->pairs;
+  pair->done = TRUE;
+  if (!k || estimate->pairs[k - 1].done) {
+    dc_frame_release(estimate->frames + k);
+  }
+  if (k + 1 == estimate->n_pairs || estimate->pairs[k + 1].done) {
+    dc_frame_release(estimate->frames + k + 1);
+  }
+  if (!--estimate->in_flight) {
+    drift_estimate_next_wave(estimate);
+  }
+  return FALSE;
+}
+
+/* Main loop part, runs once all pairs are correlated */
+static gboolean drift_estimate_finish(gpointer user_data) {
+  DriftEstimate *estimate = user_data;
+  DriftCorrectionData *dc_data = estimate->dc_data;
+  SelectedImage *images = dc_data->selected_imgs;
+
+  for (gint k = 0; k <= estimate->n_pairs; k++) {
+    dc_frame_release(estimate->frames + k);
+  }
+  // Offsets of a closed window are of no use
+  if (!dc_data_cancelled(dc_data)) {
+    images[0].x_offset = images[0].y_offset = 0.0;
+    for (gint k = 0; k < estimate->n_pairs; k++) {
+      DriftPair *pair = estimate->pairs + k;
+      SelectedImage *img = images + k + 1;
+
+      img->x_offset = images[k].x_offset + pair->dx;
+      img->y_offset = images[k].y_offset + pair->dy;
+    }
+    dc_data->has_offsets = TRUE;
+    drift_apply_start(dc_data, dc_data->stream_dir,
+                      gtk_toggle_button_get_active(
+                          GTK_TOGGLE_BUTTON(dc_data->brick_check)));
+    gtk_widget_set_sensitive(estimate->run_btn, TRUE);
+  }
+
+  g_object_unref(estimate->run_btn);
+  g_free(estimate->times);
+  g_free(estimate->frames);
+  g_free(estimate->pairs);
+  g_free(estimate);
+  dc_data_unref(dc_data);
+  return FALSE;
+}
+
+/* Data field of a frame, NULL if its file was closed or the channel
+ * removed. Main loop only. */
+static GwyDataField *dc_data_get_field(SelectedImage *img) {
+  GwyContainer *container = gwy_app_data_browser_get(img->container_id);
+  GwyDataField *data_field = NULL;
+
+  if (container) {
+    gwy_container_gis_object(container,
+                             gwy_app_get_data_key_for_id(img->img_id),
+                             &data_field);
+  }
+  return data_field;
+}
+
+/* Takes a frame for the workers: a copy of the channel as it is now, which
+ * the channel may change or go away under, and a reference of its container,
+ * until dc_frame_release(). Returns FALSE if the frame is gone. Main loop
+ * only. */
+static gboolean dc_frame_acquire(SelectedImage *img, DcFrame *frame) {
+  GwyDataField *data_field = dc_data_get_field(img);
+
+  if (!data_field) {
+    frame->container = NULL;
+    frame->field = NULL;
+    return FALSE;
+  }
+  frame->container =
+      g_object_ref(gwy_app_data_browser_get(img->container_id));
+  frame->field = gwy_data_field_duplicate(data_field);
+  return TRUE;
+}
+
+static void dc_frame_release(DcFrame *frame) {
+  if (!frame->field) {
+    return;
+  }
+  g_object_unref(frame->field);
+  g_object_unref(frame->container);
+  frame->field = NULL;
+  frame->container = NULL;
+}
+
+/* Estimates the offsets of all selected frames in the background */
+static void drift_estimate_start(DriftCorrectionData *dc_data,
+                                 GtkWidget *run_btn) {
+  if (dc_data->selected_images_len < 2) {
+    return;
+  }
+
+  gint n_frames = dc_data->selected_images_len;
+  DcFrame *frames = g_new0(DcFrame, n_frames);
+  for (gint k = 0; k < n_frames; k++) {
+    if (!dc_frame_acquire(dc_data->selected_imgs + k, frames + k)) {
+      dc_report_missing(dc_data, k);
+      while (k--) {
+        dc_frame_release(frames + k);
+      }
+      g_free(frames);
+      return;
+    }
+  }
+
+  DriftEstimate *estimate = g_new0(DriftEstimate, 1);
+  estimate->dc_data = dc_data_ref(dc_data);
+  estimate->run_btn = g_object_ref(run_btn);
+  estimate->frames = frames;
+  estimate->n_pairs = n_frames - 1;
+  estimate->pairs = g_new0(DriftPair, estimate->n_pairs);
+  estimate->use_model = gtk_toggle_button_get_active(
+      GTK_TOGGLE_BUTTON(dc_data->model_check));
+  gtk_widget_set_sensitive(run_btn, FALSE);
+
+  for (gint k = 0; k < estimate->n_pairs; k++) {
+    DriftPair *pair = estimate->pairs + k;
+    SelectedImage *first = dc_data->selected_imgs + k;
+    SelectedImage *second = dc_data->selected_imgs + k + 1;
+
+    pair->estimate = estimate;
+    pair->first = frames[k].field;
+    pair->second = frames[k + 1].field;
+    pair->seeded = first->has_selection && second->has_selection;
+    if (pair->seeded) {
+      pair->seed_x = gwy_data_field_rtoj(pair->second, second->x_selection) -
+                     gwy_data_field_rtoj(pair->first, first->x_selection);
+      pair->seed_y = gwy_data_field_rtoi(pair->second, second->y_selection) -
+                     gwy_data_field_rtoi(pair->first, first->y_selection);
+    }
+  }
+  // The model needs the acquisition times first
+  if (estimate->use_model) {
+    drift_times_start(estimate);
+  } else {
+    drift_estimate_next_wave(estimate);
+  }
+}
+
+/* Parses the usual date formats of metadata; returns 0 if it can't */
+static gint64 parse_meta_time(const gchar *str) {
+  gint y, mo, d, h = 0, mi = 0;
+  gdouble sec = 0.0;
+
+  if (sscanf(str, "%d-%d-%d %d:%d:%lf", &y, &mo, &d, &h, &mi, &sec) < 3 &&
+      sscanf(str, "%d-%d-%dT%d:%d:%lf", &y, &mo, &d, &h, &mi, &sec) < 3) {
+    if (sscanf(str, "%d.%d.%d %d:%d:%lf", &d, &mo, &y, &h, &mi, &sec) < 3) {
+      return 0;
+    }
+  }
+
+  GDateTime *datetime = g_date_time_new_local(y, mo, d, h, mi, sec);
+  if (!datetime) {
+    return 0;
+  }
+  gint64 timestamp = g_date_time_to_unix(datetime);
+  g_date_time_unref(datetime);
+  return timestamp;
+}
+
+/* Acquisition time of a frame from its metadata, 0 if there is none */
+static gint64 dc_frame_meta_time(GwyContainer *container, gint img_id) {
+  static const gchar *meta_keys[] = {
+      "Date", "Date and time", "Acquisition time", "Time", "Timestamp",
+  };
+  GwyContainer *meta = NULL;
+  const guchar *str;
+
+  gchar *meta_key = g_strdup_printf("/%d/meta", img_id);
+  gwy_container_gis_object_by_name(container, meta_key, &meta);
+  g_free(meta_key);
+  for (guint k = 0; meta && k < G_N_ELEMENTS(meta_keys); k++) {
+    if (gwy_container_gis_string_by_name(meta, meta_keys[k], &str)) {
+      gint64 timestamp = parse_meta_time((const gchar *)str);
+      if (timestamp) {
+        return timestamp;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Acquisition times for the drift model.
+ *
+ * Times in the metadata are looked up on the main loop. Frames of .mul files
+ * without them take the time of their image label; the labels are read by
+ * one job per file in the worker pool, and matched to the channels with
+ * titles collected beforehand on the main loop. The estimation starts once
+ * all files are read.
+ */
+typedef struct {
+  gint index; // of the frame
+  gint img_id;
+  gint64 timestamp;
+} DriftFrameTime;
+
+typedef struct {
+  DriftEstimate *estimate;
+  gchar *filename;
+  gint *data_ids; // channels of the open file
+  gchar **titles;
+  gint n_ids;
+  GArray *frames; // DriftFrameTime of the frames from this file
+} DriftTimesJob;
+
+/* Uses the frame numbers instead if some frame has no time, i.e. assumes a
+ * constant frame time, then starts the estimation */
+static void drift_times_finish(DriftEstimate *estimate) {
+  gint n_frames = estimate->n_pairs + 1;
+  gdouble *times = estimate->times;
+  gboolean complete = TRUE;
+
+  // Equal times would make the model degenerate as well
+  for (gint k = 0; k < n_frames && complete; k++) {
+    complete = times[k] && (!k || times[k] > times[k - 1]);
+  }
+  if (!complete) {
+    dc_set_status(estimate->dc_data, "No usable acquisition times, the drift "
+                                     "model uses frame numbers");
+    for (gint k = 0; k < n_frames; k++) {
+      times[k] = k;
+    }
+  }
+  drift_estimate_next_wave(estimate);
+}
+
+/* Main loop part of a file */
+static gboolean drift_times_job_finish(gpointer user_data) {
+  DriftTimesJob *job = user_data;
+  DriftEstimate *estimate = job->estimate;
+
+  for (guint i = 0; i < job->frames->len; i++) {
+    DriftFrameTime *frame = &g_array_index(job->frames, DriftFrameTime, i);
+    estimate->times[frame->index] = frame->timestamp;
+  }
+  g_array_free(job->frames, TRUE);
+  g_strfreev(job->titles);
+  g_free(job->data_ids);
+  g_free(job->filename);
+  g_free(job);
+
+  if (!--estimate->times_pending) {
+    drift_times_finish(estimate);
+  }
+  return FALSE;
+}
+
+/* Worker part of a file */
+static void drift_times_job_run(gpointer user_data) {
+  DriftTimesJob *job = user_data;
+  GPtrArray *images = mul_read_index(job->filename, -1);
+
+  if (images) {
+    gint *label_channels =
+        mul_match_labels(images, job->data_ids, job->titles, job->n_ids);
+    for (guint i = 0; i < job->frames->len; i++) {
+      DriftFrameTime *frame = &g_array_index(job->frames, DriftFrameTime, i);
+      for (guint k = 0; k < images->len; k++) {
+        if (label_channels[k] == frame->img_id) {
+          MulImageInfo *info = g_ptr_array_index(images, k);
+          frame->timestamp = info->timestamp;
+          break;
+        }
+      }
+    }
+    g_free(label_channels);
+    g_ptr_array_free(images, TRUE);
+  }
+  g_idle_add(drift_times_job_finish, job);
+}
+
+/* Fills estimate->times and starts the estimation when they are complete */
+static void drift_times_start(DriftEstimate *estimate) {
+  gint n_frames = estimate->n_pairs + 1;
+  GHashTable *jobs = g_hash_table_new(g_str_hash, g_str_equal);
+
+  estimate->times = g_new0(gdouble, n_frames);
+  for (gint k = 0; k < n_frames; k++) {
+    GwyContainer *container = estimate->frames[k].container;
+    gint img_id = estimate->dc_data->selected_imgs[k].img_id;
+    estimate->times[k] = dc_frame_meta_time(container, img_id);
+    const gchar *filename = gwy_file_get_filename_sys(container);
+    if (estimate->times[k] || !filename || !endswith(filename, ".mul")) {
+      continue;
+    }
+
+    DriftTimesJob *job = g_hash_table_lookup(jobs, filename);
+    if (!job) {
+      job = g_new0(DriftTimesJob, 1);
+      job->estimate = estimate;
+      job->filename = g_strdup(filename);
+      job->data_ids = gwy_app_data_browser_get_data_ids(container);
+      while (job->data_ids[job->n_ids] != -1) {
+        job->n_ids++;
+      }
+      job->titles = g_new0(gchar *, job->n_ids + 1);
+      for (gint i = 0; i < job->n_ids; i++) {
+        job->titles[i] =
+            gwy_app_get_data_field_title(container, job->data_ids[i]);
+      }
+      job->frames = g_array_new(FALSE, FALSE, sizeof(DriftFrameTime));
+      g_hash_table_insert(jobs, job->filename, job);
+    }
+    DriftFrameTime frame = {k, img_id, 0};
+    g_array_append_val(job->frames, frame);
+  }
 
-  case GTK_RESPONSE_CANCEL:
-    printf("CANCEL");
-    gtk_widget_destroy(prompt_dialog);
-    g_free(drift_correction_data);
-    return;
+  GHashTableIter iter;
+  gpointer job;
+  g_hash_table_iter_init(&iter, jobs);
+  while (g_hash_table_iter_next(&iter, NULL, &job)) {
+    estimate->times_pending++;
+    worker_pool_push(drift_times_job_run, job);
   }
+  g_hash_table_destroy(jobs);
 
-  GwyContainer *dc_container = gwy_container_new();
-  gwy_app_data_browser_add(dc_container);
-  gwy_app_data_browser_set_keep_invisible(dc_container, TRUE);
-  gint dc_container_id = gwy_app_data_browser_get_number(dc_container);
+  if (!estimate->times_pending) {
+    drift_times_finish(estimate);
+  }
+}
 
-  GwyContainer *first_img_container = gwy_app_data_browser_get(
-      drift_correction_data->selected_imgs[0].container_id);
-  GQuark first_img_key = gwy_app_get_data_key_for_id(
-      drift_correction_data->selected_imgs[0].img_id);
-  GwyDataField *first_df =
-      gwy_container_get_object(first_img_container, first_img_key);
-  GwyDataField *preview_datafield = gwy_data_field_duplicate(first_df);
-  drift_correction_data->preview_datafield_id =
-      gwy_app_data_browser_add_data_field(preview_datafield, dc_container,
-                                          TRUE);
+/*
+ * Drift application.
+ *
+ * Every frame is shifted back by its offset and cropped to the region that is
+ * covered by all frames. As the offset is the same for the whole frame, so
+ * are the interpolation weights, and the shift boils down to row_resample()
+ * over consecutive rows. The frames are resampled in parallel.
+ *
+ * The selected frames are never copied as a whole: the workers read the
+ * original fields and write straight into new fields of the cropped size,
+ * which are the only copies of the stack and are added to the drift
+ * correction container on the main thread.
+ *
+ * When streaming to disk, every corrected frame is written to a .gsf file by
+ * its worker and freed right away, and at most DC_STREAM_FRAMES frames per
+ * core are in flight. The corrected stack then never exists in memory as a
+ * whole. This bounds only the output: the source frames are open in Gwyddion
+ * anyway. A series that does not fit into memory at all is corrected from its
+ * files by z-batch --drift, see z-batch.c.
+ *
+ * Otherwise the frames can also go into a single volume: a GwyBrick with the
+ * frame number as z, whose planes the workers fill directly.
+ */
+#define DC_STREAM_FRAMES 2
+
+typedef struct {
+  DriftCorrectionData *dc_data;
+  GwyDataField **fields; // the corrected frames, unless streamed
+  gint n_frames;
+  gint next_frame;
+  gint in_flight;
+  gint max_in_flight;
+  gint xres;
+  gint yres;
+  gint x0; // crop origin in the first frame
+  gint y0;
+  gint width;
+  gint height;
+  gchar *stream_dir; // NULL to keep the frames in dc_container
+  gint n_failed;
+  gboolean aborted; // a frame or the window was closed meanwhile
+  GwyBrick *brick; // the corrected stack as volume, or NULL
+} DriftApply;
+
+typedef struct {
+  DriftApply *apply;
+  gint index;
+  DcFrame source;
+  GwyDataField *data_field; // NULL when writing into the brick
+  gdouble *data; // width x height
+  gdouble x; // position of the crop origin in the frame, in pixels
+  gdouble y;
+  gchar *filename; // where the frame is streamed to, if it is
+  gchar *xy_unit;
+  gchar *z_unit;
+  gboolean written;
+} DriftApplyJob;
+
+/* Worker part of a frame */
+static void drift_apply_frame(gpointer user_data) {
+  DriftApplyJob *job = user_data;
+  gint64 start = z_stats_begin();
+
+  // The frames of a closed window are dropped anyway
+  if (dc_data_cancelled(job->apply->dc_data)) {
+    g_idle_add(drift_apply_frame_finish, job);
+    return;
+  }
+  drift_resample_frame(gwy_data_field_get_data_const(job->source.field),
+                       job->apply->xres, job->x, job->y, job->data,
+                       job->apply->width, job->apply->height);
+
+  if (job->filename) {
+    gchar *title = g_strdup_printf("Frame %d (drift corrected)", job->index);
+    job->written = write_gsf(job->filename, job->data_field, job->xy_unit,
+                             job->z_unit, title);
+    g_free(title);
+  }
+  z_stats_end(Z_STAT_DRIFT_APPLY, start,
+              (gint64)job->apply->width * job->apply->height);
+  g_idle_add(drift_apply_frame_finish, job);
+}
 
-  for (int i = 0; i < drift_correction_data->selected_images_len; i++) {
-    GwyContainer *container = gwy_app_data_browser_get(
-        drift_correction_data->selected_imgs[i].container_id);
-    GQuark key = gwy_app_get_data_key_for_id(
-        drift_correction_data->selected_imgs[i].img_id);
+/* Starts frames until the window is full */
+static void drift_apply_push(DriftApply *apply) {
+  SelectedImage *images = apply->dc_data->selected_imgs;
 
-    GwyDataField *df = gwy_container_get_object(container, key);
-    GwyDataField *new_df = gwy_data_field_duplicate(df);
-    gint new_img_id =
-        gwy_app_data_browser_add_data_field(new_df, dc_container, TRUE);
-    drift_correction_data->selected_imgs[i].img_id = new_img_id;
-    drift_correction_data->selected_imgs[i].container_id = dc_container_id;
+  if (dc_data_cancelled(apply->dc_data)) {
+    apply->aborted = TRUE;
+    apply->next_frame = apply->n_frames;
   }
+  while (apply->in_flight < apply->max_in_flight &&
+         apply->next_frame < apply->n_frames) {
+    gint k = apply->next_frame++;
+    DcFrame frame;
+    if (!dc_frame_acquire(images + k, &frame)) {
+      dc_report_missing(apply->dc_data, k);
+      apply->aborted = TRUE;
+      apply->next_frame = apply->n_frames;
+      break;
+    }
+    GwyDataField *source = frame.field;
+    gdouble dx = gwy_data_field_get_dx(source);
+    gdouble dy = gwy_data_field_get_dy(source);
+
+    DriftApplyJob *job = g_new0(DriftApplyJob, 1);
+    job->apply = apply;
+    job->index = k;
+    job->source = frame;
+    if (apply->brick) {
+      // Plane k of the brick, planes are stored one after another
+      job->data = gwy_brick_get_data(apply->brick) +
+                  (gsize)k * apply->width * apply->height;
+    } else {
+      job->data_field = gwy_data_field_new(apply->width, apply->height,
+                                           apply->width * dx,
+                                           apply->height * dy, FALSE);
+      gwy_data_field_copy_units(source, job->data_field);
+      job->data = gwy_data_field_get_data(job->data_field);
+    }
+    job->x = apply->x0 + images[k].x_offset;
+    job->y = apply->y0 + images[k].y_offset;
+    // Rounding noise must not push the last sample out of the frame
+    job->x = CLAMP(job->x, 0.0, apply->xres - apply->width);
+    job->y = CLAMP(job->y, 0.0, apply->yres - apply->height);
+    if (apply->stream_dir) {
+      gchar *name = g_strdup_printf("frame-%05d.gsf", k);
+      job->filename = g_build_filename(apply->stream_dir, name, NULL);
+      g_free(name);
+      // Units are looked up here, the worker only sees plain strings
+      job->xy_unit = gwy_si_unit_get_string(
+          gwy_data_field_get_si_unit_xy(source), GWY_SI_UNIT_FORMAT_PLAIN);
+      job->z_unit = gwy_si_unit_get_string(
+          gwy_data_field_get_si_unit_z(source), GWY_SI_UNIT_FORMAT_PLAIN);
+    }
 
-  // Main Window
-  GtkWidget *stack_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    apply->in_flight++;
+    worker_pool_push(drift_apply_frame, job);
+  }
+}
 
-  // Start with first image
-  drift_correction_data->preview_img = gwy_create_preview(
-      dc_container, drift_correction_data->preview_datafield_id, 512, FALSE);
-  // Box where preview image and previous and next buttons live in
-  GtkWidget *preview_vbox = gtk_vbox_new(FALSE, 4);
+/* Main loop part of a frame */
+static gboolean drift_apply_frame_finish(gpointer user_data) {
+  DriftApplyJob *job = user_data;
+  DriftApply *apply = job->apply;
 
-  GwyPixmapLayer *view_layer = gwy_data_view_get_base_layer(
-      GWY_DATA_VIEW(drift_correction_data->preview_img));
-  if (view_layer == NULL) {
-    printf("VIEW LAYER IS NULL");
+  dc_frame_release(&job->source);
+  if (job->filename) {
+    if (!job->written) {
+      apply->n_failed++;
+    }
+    g_object_unref(job->data_field);
+  } else if (job->data_field) {
+    apply->fields[job->index] = job->data_field;
   }
-  GwyVectorLayer *vec_layer = gwy_data_view_get_top_layer(
-      GWY_DATA_VIEW(drift_correction_data->preview_img));
-  if (vec_layer == NULL) {
-    printf("isnull\n");
-    vec_layer = g_object_new(g_type_from_name("GwyLayerPoint"), NULL);
-    gwy_data_view_set_top_layer(
-        GWY_DATA_VIEW(drift_correction_data->preview_img), vec_layer);
+  g_free(job->filename);
+  g_free(job->xy_unit);
+  g_free(job->z_unit);
+  g_free(job);
+
+  apply->in_flight--;
+  drift_apply_push(apply);
+  if (!apply->in_flight) {
+    drift_apply_finish(apply);
   }
+  return FALSE;
+}
 
-  gwy_vector_layer_set_selection_key(vec_layer, "/0/select/dc/point");
-  GwySelection *selection = gwy_vector_layer_ensure_selection(vec_layer);
-  gwy_selection_set_max_objects(selection, 1);
-  if (selection == NULL) {
-    printf("selection is null\n");
+/* Main loop part, runs once all frames are resampled */
+static gboolean drift_apply_finish(gpointer user_data) {
+  DriftApply *apply = user_data;
+  DriftCorrectionData *dc_data = apply->dc_data;
+  GwyContainer *dc_container =
+      gwy_app_data_browser_get(dc_data->preview_container_id);
+
+  if (apply->aborted) {
+    // Part of a stack is of no use, the frame label tells why if it is
+    // still there
+    for (gint k = 0; apply->fields && k < apply->n_frames; k++) {
+      if (apply->fields[k]) {
+        g_object_unref(apply->fields[k]);
+      }
+    }
+    if (apply->brick) {
+      g_object_unref(apply->brick);
+    }
+    g_free(apply->fields);
+    g_free(apply->stream_dir);
+    g_free(apply);
+    dc_data_unref(dc_data);
+    return FALSE;
   }
 
-  for (int i = 0; i < drift_correction_data->selected_images_len; i++) {
-    printf("IN NEW CONTAINER: imd_id: %d, container_id: %d\n",
-           drift_correction_data->selected_imgs[i].img_id,
-           drift_correction_data->selected_imgs[i].container_id);
+  if (apply->stream_dir) {
+    // The frames shown stay the uncorrected ones, there is nothing else
+    gchar *text;
+    if (apply->n_failed) {
+      text = g_strdup_printf("Could not write %d of %d frames to %s",
+                             apply->n_failed, apply->n_frames,
+                             apply->stream_dir);
+    } else {
+      text = g_strdup_printf("%d frames of %d x %d written to %s",
+                             apply->n_frames, apply->width, apply->height,
+                             apply->stream_dir);
+    }
+    dc_set_status(dc_data, text);
+    g_free(text);
+    g_free(apply->stream_dir);
+    g_free(apply);
+    dc_data_unref(dc_data);
+    return FALSE;
   }
 
-  g_signal_connect(selection, "finished", G_CALLBACK(on_selection_finish),
-                   drift_correction_data);
-
-  // Box where previous and next buttons live in
-  GtkWidget *preview_controls_hbox = gtk_hbox_new(FALSE, 4);
-
-  GtkWidget *prev_btn = gtk_button_new_with_label("<");
-  g_signal_connect(prev_btn, "clicked", G_CALLBACK(on_prev_btn_click),
-                   drift_correction_data);
-  GtkWidget *next_btn = gtk_button_new_with_label(">");
-  g_signal_connect(next_btn, "clicked", G_CALLBACK(on_next_btn_click),
-                   drift_correction_data);
-  GtkWidget *run_btn = gtk_button_new_with_label("Ok");
-  g_signal_connect(run_btn, "clicked", G_CALLBACK(on_run_btn_click),
-                   drift_correction_data);
+  if (apply->brick) {
+    // The frames shown stay the uncorrected ones, the volume has its own view
+    GwyDataField *preview = gwy_data_field_new(
+        apply->width, apply->height, 1.0, 1.0, FALSE);
+    gwy_brick_data_changed(apply->brick);
+    gwy_brick_extract_xy_plane(apply->brick, preview, 0);
+    gint brick_id = gwy_app_data_browser_add_brick(apply->brick, preview,
+                                                   dc_container, TRUE);
+    gwy_app_set_brick_title(dc_container, brick_id, "Drift corrected stack");
+    g_object_unref(preview);
+    g_object_unref(apply->brick);
+    gchar *text = g_strdup_printf("Corrected volume of %d x %d x %d added",
+                                  apply->width, apply->height,
+                                  apply->n_frames);
+    dc_set_status(dc_data, text);
+    g_free(text);
+    g_free(apply);
+    dc_data_unref(dc_data);
+    return FALSE;
+  }
 
-  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), prev_btn, TRUE, TRUE, 4);
-  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), run_btn, TRUE, TRUE, 4);
-  gtk_box_pack_start(GTK_BOX(preview_controls_hbox), next_btn, TRUE, TRUE, 4);
-  gtk_box_pack_start(GTK_BOX(preview_vbox), drift_correction_data->preview_img,
-                     FALSE, FALSE, 4);
-  gtk_box_pack_start(GTK_BOX(preview_vbox), preview_controls_hbox, FALSE, FALSE,
-                     4);
+  for (gint k = 0; k < apply->n_frames; k++) {
+    GwyDataField *data_field = apply->fields[k];
+    gwy_data_field_invalidate(data_field);
+    gint img_id =
+        gwy_app_data_browser_add_data_field(data_field, dc_container, TRUE);
+    g_object_unref(data_field);
+
+    // From now on the frame is the corrected one, with no drift left
+    SelectedImage *img = dc_data->selected_imgs + k;
+    img->container_id = dc_data->preview_container_id;
+    img->img_id = img_id;
+    img->has_selection = FALSE;
+    img->manual = FALSE;
+    img->confidence = 0.0;
+    img->x_offset = img->y_offset = 0.0;
+  }
 
-  gtk_container_add(GTK_CONTAINER(stack_window), preview_vbox);
+  // The prefetched previews show the uncorrected frames
+  dc_ring_reset(dc_data);
+  dc_show_frame(dc_data, dc_data->current_preview);
 
-  gtk_widget_show_all(stack_window);
+  g_free(apply->fields);
+  g_free(apply);
+  dc_data_unref(dc_data);
+  return FALSE;
 }
 
-static void dc_data_append_image(DriftCorrectionData *dc_data,
-                                 SelectedImage image) {
-  dc_data->images[dc_data->images_len] = image;
-  dc_data->images_len++;
-
-  if (dc_data->images_len == dc_data->images_cap) {
-    dc_data->images = realloc(dc_data->images,
-                              dc_data->images_cap * 2 * sizeof(SelectedImage));
-    dc_data->images_cap *= 2;
-  }
+/* Creates the volume of the corrected stack, frame number as z */
+static GwyBrick *drift_brick_new(GwyDataField *first, gint width, gint height,
+                                 gint n_frames) {
+  gdouble dx = gwy_data_field_get_dx(first);
+  gdouble dy = gwy_data_field_get_dy(first);
+  GwyBrick *brick = gwy_brick_new(width, height, n_frames, width * dx,
+                                  height * dy, n_frames, FALSE);
+  GwySIUnit *unit = gwy_si_unit_duplicate(gwy_data_field_get_si_unit_xy(first));
+
+  gwy_brick_set_si_unit_x(brick, unit);
+  gwy_brick_set_si_unit_y(brick, unit);
+  g_object_unref(unit);
+  unit = gwy_si_unit_duplicate(gwy_data_field_get_si_unit_z(first));
+  gwy_brick_set_si_unit_w(brick, unit);
+  g_object_unref(unit);
+  return brick;
 }
 
-static void dc_data_append_selected_images(GtkIconView *icon_view,
-                                           GtkTreePath *tree_path,
-                                           DriftCorrectionData *dc_data) {
-  GtkTreeIter iter;
-  GtkListStore *store;
-  gint img_id;
-  gint container_id;
+/* Shifts all selected frames by their offsets and crops them to the common
+ * overlap. With a stream_dir, the frames are written there instead of being
+ * kept; as_brick puts them into one volume instead of separate fields. */
+static void drift_apply_start(DriftCorrectionData *dc_data,
+                              const gchar *stream_dir, gboolean as_brick) {
+  gint n_frames = dc_data->selected_images_len;
+  SelectedImage *images = dc_data->selected_imgs;
+  gdouble min_x = 0.0, max_x = 0.0, min_y = 0.0, max_y = 0.0;
+
+  for (gint k = 0; k < n_frames; k++) {
+    min_x = MIN(min_x, images[k].x_offset);
+    max_x = MAX(max_x, images[k].x_offset);
+    min_y = MIN(min_y, images[k].y_offset);
+    max_y = MAX(max_y, images[k].y_offset);
+  }
 
-  // Get the associated list store
-  store = GTK_LIST_STORE(gtk_icon_view_get_model(icon_view));
-  // Convert the path to an iter
-  gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, tree_path);
-  // Get the value of the first column (assuming it's an integer)
-  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, IMG_ID_COL, &img_id, -1);
-  gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, CONTAINER_ID_COL,
-                     &container_id, -1);
+  for (gint k = 0; k < n_frames; k++) {
+    if (!dc_data_get_field(images + k)) {
+      dc_report_missing(dc_data, k);
+      return;
+    }
+  }
 
-  SelectedImage selected_image;
-  selected_image.container_id = container_id;
-  selected_image.img_id = img_id;
+  // Crop origin and size in the coordinates of the first frame
+  GwyDataField *first = dc_data_get_field(images);
+  gint xres = gwy_data_field_get_xres(first);
+  gint yres = gwy_data_field_get_yres(first);
+  gint x0 = (gint)ceil(-min_x), y0 = (gint)ceil(-min_y);
+  gint width = (gint)floor(xres - 1 - max_x) - x0 + 1;
+  gint height = (gint)floor(yres - 1 - max_y) - y0 + 1;
+  if (width < 2 || height < 2) {
+    dc_set_status(dc_data, "The frames do not overlap, nothing corrected");
+    return;
+  }
 
-  dc_data->selected_imgs[dc_data->selected_images_len] = selected_image;
-  dc_data->selected_images_len++;
+  for (gint k = 0; k < n_frames; k++) {
+    GwyDataField *data_field = dc_data_get_field(images + k);
+    if (gwy_data_field_get_xres(data_field) != xres ||
+        gwy_data_field_get_yres(data_field) != yres) {
+      gchar *text = g_strdup_printf(
+          "Frame %d differs in size, nothing corrected", k + 1);
+      dc_set_status(dc_data, text);
+      g_free(text);
+      return;
+    }
+  }
 
-  if (dc_data->selected_images_len == dc_data->selected_images_cap) {
-    dc_data->selected_imgs =
-        realloc(dc_data->selected_imgs,
-                dc_data->selected_images_cap * 2 * sizeof(SelectedImage));
-    dc_data->selected_images_cap *= 2;
+  DriftApply *apply = g_new0(DriftApply, 1);
+  apply->dc_data = dc_data_ref(dc_data);
+  apply->n_frames = n_frames;
+  apply->xres = xres;
+  apply->yres = yres;
+  apply->x0 = x0;
+  apply->y0 = y0;
+  apply->width = width;
+  apply->height = height;
+  if (stream_dir) {
+    apply->stream_dir = g_strdup(stream_dir);
+    apply->max_in_flight = DC_STREAM_FRAMES * g_get_num_processors();
+  } else if (as_brick) {
+    apply->brick = drift_brick_new(first, width, height, n_frames);
+    apply->max_in_flight = n_frames;
+  } else {
+    apply->fields = g_new0(GwyDataField *, n_frames);
+    apply->max_in_flight = n_frames;
+  }
+  drift_apply_push(apply);
+  if (!apply->in_flight) {
+    drift_apply_finish(apply);
   }
 }
 
-static void setup_dc_data(GwyContainer *container,
-                          DriftCorrectionData *drift_correction_data) {
-  gint container_id = gwy_app_data_browser_get_number(container);
-  gint *data_ids = gwy_app_data_browser_get_data_ids(container);
+/*
+ * Preview of the drift correction window.
+ *
+ * There is a single preview widget showing the preview field of the drift
+ * correction container. Navigating assigns a downsampled copy of the frame to
+ * that field. Copies of the frames next to the current one are prepared in
+ * the worker pool and kept in a ring of 2 * DC_PREFETCH + 1 slots, so that
+ * paging back and forth usually just copies a small field. Slots leaving the
+ * window around the current frame are reused for the frames entering it.
+ */
+static void dc_preview_size(gint xres, gint yres, gint *width, gint *height) {
+  gdouble scale = MIN(1.0, MIN((gdouble)DC_PREVIEW_SIZE / xres,
+                               (gdouble)DC_PREVIEW_SIZE / yres));
+  *width = MAX(1, (gint)(xres * scale + 0.5));
+  *height = MAX(1, (gint)(yres * scale + 0.5));
+}
 
-  for (int i = 0; data_ids[i] != -1; i++) {
-    SelectedImage selected_image;
-    selected_image.container_id = container_id;
-    selected_image.img_id = data_ids[i];
-    dc_data_append_image(drift_correction_data, selected_image);
-  }
+/* Empty downsampled counterpart of source, with the same physical size so
+ * that selections on it are in the coordinates of the frame */
+static GwyDataField *dc_preview_field_new(GwyDataField *source) {
+  gint width, height;
+  dc_preview_size(gwy_data_field_get_xres(source),
+                  gwy_data_field_get_yres(source), &width, &height);
+
+  GwyDataField *field = gwy_data_field_new(
+      width, height, gwy_data_field_get_xreal(source),
+      gwy_data_field_get_yreal(source), FALSE);
+  gwy_data_field_set_xoffset(field, gwy_data_field_get_xoffset(source));
+  gwy_data_field_set_yoffset(field, gwy_data_field_get_yoffset(source));
+  gwy_data_field_copy_units(source, field);
+  return field;
 }
 
-static void on_selection_finish(GwySelection *selection,
-                                DriftCorrectionData *dc_data) {
+static void dc_preview_field_fill(GwyDataField *field, GwyDataField *source) {
+  decimate_buffer(gwy_data_field_get_data_const(source),
+                  gwy_data_field_get_xres(source),
+                  gwy_data_field_get_yres(source),
+                  gwy_data_field_get_data(field),
+                  gwy_data_field_get_xres(field),
+                  gwy_data_field_get_yres(field));
+  gwy_data_field_invalidate(field);
+}
 
-  gdouble selection_coords[2];
-  gint n = gwy_selection_get_data(selection, selection_coords);
-  printf("n: %d\n", n);
-  guint num_selections = gwy_selection_get_object_size(selection);
+typedef struct {
+  DriftCorrectionData *dc_data;
+  gint index;
+  DcFrame source;
+  GwyDataField *field;
+} PreviewJob;
+
+/* Main loop part of a prefetch */
+static gboolean dc_prefetch_finish(gpointer user_data) {
+  PreviewJob *job = user_data;
+  DriftCorrectionData *dc_data = job->dc_data;
+
+  // The slot may have been given to another frame in the meantime
+  for (gint k = 0; k < DC_RING_SIZE; k++) {
+    PreviewSlot *slot = dc_data->ring + k;
+    if (slot->index == job->index && slot->field == job->field) {
+      slot->ready = TRUE;
+      gwy_data_field_invalidate(slot->field);
+    }
+  }
+
+  dc_frame_release(&job->source);
+  g_object_unref(job->field);
+  g_free(job);
+  dc_data_unref(dc_data);
+  return FALSE;
+}
 
-  // gint img_id = drift_correction_data->images[0].img_id;
-  // printf("img_id: %d\n", img_id);
-  // GQuark key = gwy_app_get_data_key_for_id(img_id);
-  // GwyContainer* container =
-  // gwy_app_data_browser_get(drift_correction_data->images[0].container_id);
-  // GwyDataField* data_field = gwy_container_get_object(container, key);
+/* Worker part of a prefetch */
+static void dc_prefetch_run(gpointer user_data) {
+  PreviewJob *job = user_data;
 
-  for (guint i = 0; i < num_selections; i++) {
-    printf("selection coord [%d]: %e\n", i, selection_coords[i]);
+  if (dc_data_cancelled(job->dc_data)) {
+    g_idle_add(dc_prefetch_finish, job);
+    return;
   }
+  GwyDataField *source = job->source.field;
+
+  decimate_buffer(gwy_data_field_get_data_const(source),
+                  gwy_data_field_get_xres(source),
+                  gwy_data_field_get_yres(source),
+                  gwy_data_field_get_data(job->field),
+                  gwy_data_field_get_xres(job->field),
+                  gwy_data_field_get_yres(job->field));
+  g_idle_add(dc_prefetch_finish, job);
+}
 
-  SelectedImage *img = dc_data->current_preview_img;
-  img->x_selection = selection_coords[0];
-  img->y_selection = selection_coords[1];
+static void dc_ring_reset(DriftCorrectionData *dc_data) {
+  for (gint k = 0; k < DC_RING_SIZE; k++) {
+    PreviewSlot *slot = dc_data->ring + k;
+    if (slot->field) {
+      g_object_unref(slot->field);
+    }
+    slot->index = -1;
+    slot->field = NULL;
+    slot->ready = FALSE;
+  }
 }
 
-static void on_prev_btn_click(GtkButton *select_btn,
-                              DriftCorrectionData *dc_data) {
-  if (dc_data->current_preview > 0) {
-    dc_data->current_preview -= 1;
-  }
-  gint img_id = dc_data->selected_imgs[dc_data->current_preview].img_id;
-  gint container_id =
-      dc_data->selected_imgs[dc_data->current_preview].container_id;
-  printf("IN PREV: current_preview: %d, container id: %d,img id: %d\n",
-         dc_data->current_preview, container_id, img_id);
-
-  GwyContainer *container = gwy_app_data_browser_get(container_id);
-  GtkWidget *preview_img = gwy_create_preview(container, img_id, 512, FALSE);
-  GwyVectorLayer *vec_layer =
-      gwy_data_view_get_top_layer(GWY_DATA_VIEW(preview_img));
-  if (vec_layer == NULL) {
-    vec_layer = g_object_new(g_type_from_name("GwyLayerPoint"), NULL);
-    gwy_data_view_set_top_layer(GWY_DATA_VIEW(preview_img), vec_layer);
+/* Makes sure the frame index has a slot, starting its prefetch if needed.
+ * Returns NULL if the frame is gone. */
+static PreviewSlot *dc_ring_request(DriftCorrectionData *dc_data,
+                                    gint index) {
+  PreviewSlot *free_slot = NULL;
+
+  for (gint k = 0; k < DC_RING_SIZE; k++) {
+    PreviewSlot *slot = dc_data->ring + k;
+    if (slot->index == index) {
+      return slot;
+    }
+    if (slot->index < 0 ||
+        ABS(slot->index - dc_data->current_preview) > DC_PREFETCH) {
+      free_slot = slot;
+    }
   }
+  g_return_val_if_fail(free_slot, NULL);
 
-  if (gwy_vector_layer_get_selection_key(vec_layer) == NULL) {
-    char selection_key[30];
-    sprintf(selection_key, "/%d/select/dc/point", img_id);
-    gwy_vector_layer_set_selection_key(vec_layer, selection_key);
+  DcFrame source;
+  if (!dc_frame_acquire(dc_data->selected_imgs + index, &source)) {
+    return NULL;
   }
-  GwySelection *selection = gwy_vector_layer_ensure_selection(vec_layer);
-  gwy_selection_set_max_objects(selection, 1);
+  if (free_slot->field) {
+    g_object_unref(free_slot->field);
+  }
+  free_slot->index = index;
+  free_slot->field = dc_preview_field_new(source.field);
+  free_slot->ready = FALSE;
+
+  PreviewJob *job = g_new0(PreviewJob, 1);
+  job->dc_data = dc_data_ref(dc_data);
+  job->index = index;
+  job->source = source;
+  job->field = g_object_ref(free_slot->field);
+  worker_pool_push(dc_prefetch_run, job);
+
+  return free_slot;
+}
 
-  GQuark key = gwy_app_get_data_key_for_id(img_id);
-  GwyDataField *data_field = gwy_container_get_object(container, key);
+/* Shows frame index in the preview and prefetches its neighbours */
+static void dc_show_frame(DriftCorrectionData *dc_data, gint index) {
+  if (dc_data_cancelled(dc_data)) {
+    return;
+  }
+  dc_data->current_preview = index;
+  dc_data->current_preview_img = dc_data->selected_imgs + index;
 
+  GwyContainer *preview_container =
+      gwy_app_data_browser_get(dc_data->preview_container_id);
   GQuark preview_datafield_key =
       gwy_app_get_data_key_for_id(dc_data->preview_datafield_id);
   GwyDataField *preview_datafield =
-      gwy_container_get_object(container, preview_datafield_key);
+      gwy_container_get_object(preview_container, preview_datafield_key);
 
-  gwy_data_field_assign(preview_datafield, data_field);
+  PreviewSlot *slot = dc_ring_request(dc_data, index);
+  GwyDataField *source = dc_data_get_field(dc_data->current_preview_img);
+  if (!source) {
+    dc_report_missing(dc_data, index);
+    return;
+  }
+  if (slot && slot->ready) {
+    gwy_data_field_assign(preview_datafield, slot->field);
+  } else {
+    // Not prefetched (yet), this one is needed right now
+    GwyDataField *field = dc_preview_field_new(source);
+    dc_preview_field_fill(field, source);
+    gwy_data_field_assign(preview_datafield, field);
+    g_object_unref(field);
+  }
   gwy_data_field_data_changed(preview_datafield);
 
-  g_signal_connect(selection, "finished", G_CALLBACK(on_selection_finish),
-                   dc_data);
+  // Show the point selected on this frame, if any
+  SelectedImage *img = dc_data->current_preview_img;
+  if (img->has_selection) {
+    gdouble xy[2] = {img->x_selection, img->y_selection};
+    gwy_selection_set_data(dc_data->selection, 1, xy);
+  } else {
+    gwy_selection_clear(dc_data->selection);
+  }
+  dc_show_frame_label(dc_data);
 
-  dc_data->current_preview_img =
-      &dc_data->selected_imgs[dc_data->current_preview];
+  for (gint k = 1; k <= DC_PREFETCH; k++) {
+    if (index + k < dc_data->selected_images_len) {
+      dc_ring_request(dc_data, index + k);
+    }
+    if (index - k >= 0) {
+      dc_ring_request(dc_data, index - k);
+    }
+  }
 }
 
-static void on_next_btn_click(GtkButton *select_btn,
-                              DriftCorrectionData *dc_data) {
-  if (dc_data->current_preview < dc_data->selected_images_len - 1) {
-    dc_data->current_preview += 1;
+/*
+ * Feature tracking.
+ *
+ * A point clicked on one frame defines a template of TRACK_TEMPLATE_SIZE
+ * pixels around it, which is then searched for in all other frames by
+ * normalized cross-correlation within TRACK_SEARCH_RADIUS pixels by
+ * track_match() of z-kernels.c.
+ *
+ * The template is always the one from the clicked frame, so frames do not
+ * depend on each other, except that the search is centred on the last found
+ * position. Frames are therefore tracked in waves of one frame per core,
+ * forwards and backwards from the clicked frame, each wave centred on the
+ * result of the previous one. The correlation peak is the confidence of the
+ * found point; points below TRACK_MIN_CONFIDENCE are not used as seeds and
+ * should be clicked by hand. Frames with a clicked point are never
+ * overwritten, their point just becomes the centre of the following search.
+ */
+#define TRACK_TEMPLATE_SIZE 33
+#define TRACK_SEARCH_RADIUS 24
+#define TRACK_MIN_CONFIDENCE 0.6
+
+typedef struct {
+  DriftCorrectionData *dc_data;
+  GtkWidget *track_btn;
+  gdouble *tmpl; // mean-free, TRACK_TEMPLATE_SIZE^2
+  gdouble tmpl_norm;
+  gint next_forward; // next frame to track in either direction
+  gint next_backward;
+  gint forward_index; // outermost frames found so far
+  gint backward_index;
+  gdouble forward_x; // and their positions, in real coordinates
+  gdouble forward_y;
+  gdouble backward_x;
+  gdouble backward_y;
+  gint in_flight;
+  gint n_tracked;
+  gint n_uncertain;
+  gint first_uncertain;
+  gboolean stopped; // a frame was closed, the status tells which
+} TrackRun;
+
+typedef struct {
+  TrackRun *run;
+  gint index;
+  DcFrame frame;
+  gdouble x; // in pixels: search centre, then the found position
+  gdouble y;
+  gdouble score;
+} TrackJob;
+
+static void track_run_next_wave(TrackRun *run);
+
+/* The next wave continues from the outermost good frames */
+static void track_run_found(TrackRun *run, gint index, SelectedImage *img) {
+  if (index > run->forward_index) {
+    run->forward_index = index;
+    run->forward_x = img->x_selection;
+    run->forward_y = img->y_selection;
+  } else if (index < run->backward_index) {
+    run->backward_index = index;
+    run->backward_x = img->x_selection;
+    run->backward_y = img->y_selection;
+  }
+}
+
+/* Main loop part of a tracked frame */
+static gboolean track_job_finish(gpointer user_data) {
+  TrackJob *job = user_data;
+  TrackRun *run = job->run;
+  SelectedImage *img = run->dc_data->selected_imgs + job->index;
+
+  // A point clicked while the frame was tracked wins
+  if (!img->manual) {
+    img->confidence = job->score;
+    img->has_selection = job->score >= TRACK_MIN_CONFIDENCE;
+    img->x_selection = gwy_data_field_jtor(job->frame.field, job->x + 0.5);
+    img->y_selection = gwy_data_field_itor(job->frame.field, job->y + 0.5);
+    run->n_tracked++;
   }
-  gint img_id = dc_data->selected_imgs[dc_data->current_preview].img_id;
-  gint container_id =
-      dc_data->selected_imgs[dc_data->current_preview].container_id;
-  printf("IN NEXT: current_preview: %d, container id: %d,img id: %d\n",
-         dc_data->current_preview, container_id, img_id);
+  if (img->has_selection) {
+    track_run_found(run, job->index, img);
+  } else if (!run->n_uncertain++ || job->index < run->first_uncertain) {
+    run->first_uncertain = job->index;
+  }
+
+  dc_frame_release(&job->frame);
+  g_free(job);
 
-  GwyContainer *container = gwy_app_data_browser_get(container_id);
-  if (container == NULL) {
-    printf("CONTAINER IS NULL\n");
+  if (!--run->in_flight) {
+    track_run_next_wave(run);
   }
+  return FALSE;
+}
 
-  GtkWidget *preview_img = gwy_create_preview(container, img_id, 512, FALSE);
-  if (preview_img == NULL) {
-    printf("preview_img is null\n");
+/* Worker part of a tracked frame */
+static void track_job_run(gpointer user_data) {
+  TrackJob *job = user_data;
+  gint64 start = z_stats_begin();
+
+  if (dc_data_cancelled(job->run->dc_data)) {
+    g_idle_add(track_job_finish, job);
+    return;
   }
-  GwyVectorLayer *vec_layer =
-      gwy_data_view_get_top_layer(GWY_DATA_VIEW(preview_img));
-  if (vec_layer == NULL) {
-    vec_layer = g_object_new(g_type_from_name("GwyLayerPoint"), NULL);
-    gwy_data_view_set_top_layer(GWY_DATA_VIEW(preview_img), vec_layer);
+  GwyDataField *data_field = job->frame.field;
+
+  job->score = track_match(gwy_data_field_get_data_const(data_field),
+                           gwy_data_field_get_xres(data_field),
+                           gwy_data_field_get_yres(data_field),
+                           job->run->tmpl, TRACK_TEMPLATE_SIZE,
+                           job->run->tmpl_norm, TRACK_SEARCH_RADIUS, &job->x,
+                           &job->y);
+  z_stats_end(Z_STAT_DRIFT_TRACK, start, 1);
+  g_idle_add(track_job_finish, job);
+}
+
+/* Returns FALSE if the frame is gone */
+static gboolean track_push(TrackRun *run, gint index, gdouble x, gdouble y) {
+  DcFrame frame;
+  if (!dc_frame_acquire(run->dc_data->selected_imgs + index, &frame)) {
+    dc_report_missing(run->dc_data, index);
+    return FALSE;
   }
 
-  if (gwy_vector_layer_get_selection_key(vec_layer) == NULL) {
-    char selection_key[30];
-    sprintf(selection_key, "/%d/select/dc/point", img_id);
-    gwy_vector_layer_set_selection_key(vec_layer, selection_key);
+  TrackJob *job = g_new0(TrackJob, 1);
+  job->run = run;
+  job->index = index;
+  job->frame = frame;
+  job->x = gwy_data_field_rtoj(frame.field, x) - 0.5;
+  job->y = gwy_data_field_rtoi(frame.field, y) - 0.5;
+  run->in_flight++;
+  worker_pool_push(track_job_run, job);
+  return TRUE;
+}
+
+/* Tracks frame index, unless its point was clicked. Returns FALSE if the
+ * frame is gone. */
+static gboolean track_run_frame(TrackRun *run, gint index, gdouble x,
+                                gdouble y) {
+  SelectedImage *img = run->dc_data->selected_imgs + index;
+
+  if (img->manual) {
+    track_run_found(run, index, img);
+    return TRUE;
   }
-  GwySelection *selection = gwy_vector_layer_ensure_selection(vec_layer);
-  gwy_selection_set_max_objects(selection, 1);
+  if (!track_push(run, index, x, y)) {
+    run->stopped = TRUE;
+    return FALSE;
+  }
+  return TRUE;
+}
 
-  GQuark key = gwy_app_get_data_key_for_id(img_id);
-  GwyDataField *data_field = gwy_container_get_object(container, key);
+/* Summary of a finished run for the status line */
+static void track_run_report(TrackRun *run) {
+  gchar *text;
 
-  GQuark preview_datafield_key =
-      gwy_app_get_data_key_for_id(dc_data->preview_datafield_id);
-  GwyDataField *preview_datafield =
-      gwy_container_get_object(container, preview_datafield_key);
+  if (run->stopped) {
+    return;
+  }
+  if (run->n_uncertain) {
+    text = g_strdup_printf("Tracked %d frames, %d uncertain, please click the "
+                           "feature on them (first: frame %d)",
+                           run->n_tracked, run->n_uncertain,
+                           run->first_uncertain + 1);
+  } else {
+    text = g_strdup_printf("Tracked %d frames", run->n_tracked);
+  }
+  dc_set_status(run->dc_data, text);
+  g_free(text);
+}
 
-  gwy_data_field_assign(preview_datafield, data_field);
-  gwy_data_field_data_changed(preview_datafield);
+static void track_run_next_wave(TrackRun *run) {
+  gint n_frames = run->dc_data->selected_images_len;
+  gint wave = MAX(1, (gint)g_get_num_processors() / 2);
 
-  g_signal_connect(selection, "finished", G_CALLBACK(on_selection_finish),
-                   dc_data);
+  // So does a closed window, in both
+  if (dc_data_cancelled(run->dc_data)) {
+    run->next_forward = n_frames;
+    run->next_backward = -1;
+  }
+  // A closed frame ends the run in its direction
+  for (gint k = 0; k < wave && run->next_forward < n_frames; k++) {
+    if (!track_run_frame(run, run->next_forward++, run->forward_x,
+                         run->forward_y)) {
+      run->next_forward = n_frames;
+    }
+  }
+  for (gint k = 0; k < wave && run->next_backward >= 0; k++) {
+    if (!track_run_frame(run, run->next_backward--, run->backward_x,
+                         run->backward_y)) {
+      run->next_backward = -1;
+    }
+  }
 
-  dc_data->current_preview_img =
-      &dc_data->selected_imgs[dc_data->current_preview];
+  if (!run->in_flight) {
+    if (!dc_data_cancelled(run->dc_data)) {
+      gtk_widget_set_sensitive(run->track_btn, TRUE);
+      dc_show_frame(run->dc_data, run->dc_data->current_preview);
+      track_run_report(run);
+    }
+    g_object_unref(run->track_btn);
+    dc_data_unref(run->dc_data);
+    g_free(run->tmpl);
+    g_free(run);
+  }
 }
 
-static void on_run_btn_click(GtkButton *run_btn, DriftCorrectionData *dc_data) {
-  printf("RUN\n");
+/* Tracks the point clicked on the current frame through the stack */
+static void on_track_btn_click(GtkButton *track_btn,
+                               DriftCorrectionData *dc_data) {
+  SelectedImage *img = dc_data->current_preview_img;
+  dc_set_status(dc_data, NULL);
+  if (!img || !img->has_selection) {
+    dc_set_status(dc_data, "Click a feature on the current frame first");
+    return;
+  }
 
-  for (int i = 0; i < dc_data->selected_images_len; i++) {
-    GwyContainer *container =
-        gwy_app_data_browser_get(dc_data->selected_imgs[i].container_id);
-    GQuark key = gwy_app_get_data_key_for_id(dc_data->selected_imgs[i].img_id);
-    GwyDataField *data_field = gwy_container_get_object(container, key);
-    gdouble selection_x = dc_data->selected_imgs[i].x_selection;
-    gdouble selection_y = dc_data->selected_imgs[i].y_selection;
-    printf("x %f, y %f\n", gwy_data_field_rtoj(data_field, selection_x),
-           gwy_data_field_rtoi(data_field, selection_y));
+  GwyDataField *data_field = dc_data_get_field(img);
+  if (!data_field) {
+    dc_report_missing(dc_data, dc_data->current_preview);
+    return;
+  }
+  const gdouble *data = gwy_data_field_get_data_const(data_field);
+  gint xres = gwy_data_field_get_xres(data_field);
+  gint yres = gwy_data_field_get_yres(data_field);
+  const gint side = TRACK_TEMPLATE_SIZE, half = side / 2;
+  gint cx = gwy_data_field_rtoj(data_field, img->x_selection);
+  gint cy = gwy_data_field_rtoi(data_field, img->y_selection);
+  if (cx < half || cx >= xres - half || cy < half || cy >= yres - half) {
+    dc_set_status(dc_data, "The feature is too close to the edge");
+    return;
+  }
+
+  TrackRun *run = g_new0(TrackRun, 1);
+  run->tmpl = g_new(gdouble, side * side);
+  run->tmpl_norm = track_template(data, xres, cx, cy, side, run->tmpl);
+  if (run->tmpl_norm == 0.0) {
+    dc_set_status(dc_data, "The feature has no contrast");
+    g_free(run->tmpl);
+    g_free(run);
+    return;
+  }
+
+  run->dc_data = dc_data_ref(dc_data);
+  run->track_btn = g_object_ref(track_btn);
+  run->next_forward = dc_data->current_preview + 1;
+  run->next_backward = dc_data->current_preview - 1;
+  run->forward_index = run->backward_index = dc_data->current_preview;
+  run->forward_x = run->backward_x = img->x_selection;
+  run->forward_y = run->backward_y = img->y_selection;
+  gtk_widget_set_sensitive(GTK_WIDGET(track_btn), FALSE);
+
+  track_run_next_wave(run);
+}
+
+/* Frame number and where the point of the current frame comes from */
+static void dc_show_frame_label(DriftCorrectionData *dc_data) {
+  SelectedImage *img = dc_data->current_preview_img;
+  gchar *text;
+
+  if (img->has_selection && img->manual) {
+    text = g_strdup_printf("Frame %d of %d, point set by hand",
+                           dc_data->current_preview + 1,
+                           dc_data->selected_images_len);
+  } else if (img->has_selection) {
+    text = g_strdup_printf("Frame %d of %d, tracked (confidence %.2f)",
+                           dc_data->current_preview + 1,
+                           dc_data->selected_images_len, img->confidence);
+  } else if (img->confidence > 0.0) {
+    text = g_strdup_printf("Frame %d of %d, tracking uncertain (confidence "
+                           "%.2f), please click the feature",
+                           dc_data->current_preview + 1,
+                           dc_data->selected_images_len, img->confidence);
+  } else {
+    text = g_strdup_printf("Frame %d of %d", dc_data->current_preview + 1,
+                           dc_data->selected_images_len);
   }
+  if (dc_data->status) {
+    gchar *full = g_strconcat(text, "\n", dc_data->status, NULL);
+    g_free(text);
+    text = full;
+  }
+  gtk_label_set_text(GTK_LABEL(dc_data->frame_label), text);
+  g_free(text);
+}
+
+/* Shows text below the frame label until the user moves to another frame or
+ * starts something new; NULL clears it */
+static void dc_set_status(DriftCorrectionData *dc_data, const gchar *text) {
+  // Jobs finishing after the window was closed have nowhere to report
+  if (dc_data_cancelled(dc_data)) {
+    return;
+  }
+  g_free(dc_data->status);
+  dc_data->status = g_strdup(text);
+  if (dc_data->current_preview_img) {
+    dc_show_frame_label(dc_data);
+  }
+}
+
+static void dc_report_missing(DriftCorrectionData *dc_data, gint index) {
+  gchar *text = g_strdup_printf("Frame %d is no longer open, stopped",
+                                index + 1);
+  dc_set_status(dc_data, text);
+  g_free(text);
 }
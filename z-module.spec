@@ -13,6 +13,9 @@ BuildRoot: %{_tmppath}/%{name}-%{version}-buildroot
 Requires: gwyddion
 BuildPrereq: gtk2-devel
 BuildPrereq: gwyddion-devel
+BuildPrereq: fftw-devel
+BuildPrereq: cairo-devel
+BuildPrereq: libpng-devel
 BuildPrereq: libtool
 BuildPrereq: pkgconfig
 
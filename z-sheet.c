@@ -0,0 +1,369 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Contact sheets: thumbnails with their titles tiled into large PNG images.
+ *
+ * The sheet is produced one band, i.e. one row of tiles, at a time. The tiles
+ * of a band are rendered in parallel on a thread pool, each into its own
+ * small cairo surface that is then copied into the band, and the finished
+ * band is handed to libpng row by row. While a band is encoded, the next one
+ * is already being rendered, so at most two bands are in memory, however
+ * many tiles the sheet has. With per_page, the tiles are spread over several
+ * PNG files of at most per_page tiles each.
+ */
+
+#include <cairo.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "z-sheet.h"
+
+#define SHEET_PAD 4
+#define SHEET_TITLE_HEIGHT 16
+#define SHEET_FONT_SIZE 11.0
+#define SHEET_TILE_WIDTH (THUMBNAIL_SIZE + 2 * SHEET_PAD)
+#define SHEET_TILE_HEIGHT (THUMBNAIL_SIZE + SHEET_TITLE_HEIGHT + 2 * SHEET_PAD)
+
+typedef struct {
+  guchar *pixels; // SHEET_TILE_HEIGHT rows of the page, RGB
+  gint page;
+  gint first; // first tile of the band
+  gint n_tiles;
+  gint pending;
+  GMutex lock;
+  GCond cond;
+} SheetBand;
+
+typedef struct {
+  SheetTileFunc tile_func;
+  gpointer user_data;
+  gsize rowstride; // of the bands, all pages are equally wide
+} Sheet;
+
+typedef struct {
+  SheetBand *band;
+  gint index;
+} SheetTask;
+
+/* Shortens the title with an ellipsis until it fits */
+static gchar *sheet_fit_title(cairo_t *cr, const gchar *title, gdouble width) {
+  gchar *text = g_utf8_make_valid(title, -1);
+  cairo_text_extents_t extents;
+
+  cairo_text_extents(cr, text, &extents);
+  if (extents.x_advance <= width) {
+    return text;
+  }
+
+  glong len = g_utf8_strlen(text, -1);
+  gchar *fitted = NULL;
+  while (len > 0) {
+    g_free(fitted);
+    len--;
+    gchar *end = g_utf8_offset_to_pointer(text, len);
+    fitted = g_strdup_printf("%.*s…", (gint)(end - text), text);
+    cairo_text_extents(cr, fitted, &extents);
+    if (extents.x_advance <= width) {
+      break;
+    }
+  }
+  g_free(text);
+  return fitted;
+}
+
+/* Renders a tile and copies it into its slot of the band */
+static void sheet_tile_render(const SheetTile *tile, guchar *target,
+                              gsize rowstride) {
+  cairo_surface_t *surface = cairo_image_surface_create(
+      CAIRO_FORMAT_RGB24, SHEET_TILE_WIDTH, SHEET_TILE_HEIGHT);
+  cairo_t *cr = cairo_create(surface);
+
+  cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+  cairo_paint(cr);
+  if (tile->title) {
+    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL,
+                           CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, SHEET_FONT_SIZE);
+    gchar *title = sheet_fit_title(cr, tile->title, THUMBNAIL_SIZE);
+    cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+    cairo_move_to(cr, SHEET_PAD,
+                  SHEET_PAD + THUMBNAIL_SIZE + SHEET_TITLE_HEIGHT - 4);
+    cairo_show_text(cr, title);
+    g_free(title);
+  }
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+
+  // RGB24 keeps every pixel in a native endian guint32 as 0x00RRGGBB
+  const guchar *data = cairo_image_surface_get_data(surface);
+  gint stride = cairo_image_surface_get_stride(surface);
+  for (gint i = 0; i < SHEET_TILE_HEIGHT; i++) {
+    const guint32 *src = (const guint32 *)(data + (gsize)i * stride);
+    guchar *dest = target + (gsize)i * rowstride;
+    for (gint j = 0; j < SHEET_TILE_WIDTH; j++) {
+      dest[3 * j] = src[j] >> 16;
+      dest[3 * j + 1] = src[j] >> 8;
+      dest[3 * j + 2] = src[j];
+    }
+  }
+  cairo_surface_destroy(surface);
+
+  // The thumbnail is centred above the title
+  if (tile->pixels) {
+    gint x0 = SHEET_PAD + (THUMBNAIL_SIZE - tile->width) / 2;
+    gint y0 = SHEET_PAD + (THUMBNAIL_SIZE - tile->height) / 2;
+    for (gint i = 0; i < tile->height; i++) {
+      memcpy(target + (gsize)(y0 + i) * rowstride + 3 * x0,
+             tile->pixels + (gsize)i * 3 * tile->width, 3 * tile->width);
+    }
+  }
+}
+
+/* Worker part of a tile */
+static void sheet_task_run(gpointer data, gpointer user_data) {
+  SheetTask *task = data;
+  Sheet *sheet = user_data;
+  SheetBand *band = task->band;
+  SheetTile tile = {NULL, 0, 0, NULL};
+
+  sheet->tile_func(task->index, &tile, sheet->user_data);
+  if (tile.width > THUMBNAIL_SIZE || tile.height > THUMBNAIL_SIZE) {
+    g_clear_pointer(&tile.pixels, g_free);
+  }
+  sheet_tile_render(&tile, band->pixels + (gsize)(task->index - band->first) *
+                                              3 * SHEET_TILE_WIDTH,
+                    sheet->rowstride);
+  g_free(tile.pixels);
+  g_free(tile.title);
+  g_free(task);
+
+  g_mutex_lock(&band->lock);
+  if (!--band->pending) {
+    g_cond_signal(&band->cond);
+  }
+  g_mutex_unlock(&band->lock);
+}
+
+static void sheet_band_start(SheetBand *band, GThreadPool *pool, gint page,
+                             gint first, gint n_tiles, gsize rowstride) {
+  // Tiles missing in the last band stay white
+  memset(band->pixels, 0xff, rowstride * SHEET_TILE_HEIGHT);
+  band->page = page;
+  band->first = first;
+  band->n_tiles = n_tiles;
+  band->pending = n_tiles;
+  for (gint k = 0; k < n_tiles; k++) {
+    SheetTask *task = g_new(SheetTask, 1);
+    task->band = band;
+    task->index = first + k;
+    g_thread_pool_push(pool, task, NULL);
+  }
+}
+
+static void sheet_band_wait(SheetBand *band) {
+  g_mutex_lock(&band->lock);
+  while (band->pending) {
+    g_cond_wait(&band->cond, &band->lock);
+  }
+  g_mutex_unlock(&band->lock);
+}
+
+typedef struct {
+  FILE *fh;
+  png_structp png;
+  png_infop info;
+} SheetPng;
+
+static gboolean sheet_png_open(SheetPng *out, const gchar *filename,
+                               gint width, gint height) {
+  out->fh = g_fopen(filename, "wb");
+  if (!out->fh) {
+    fprintf(stderr, "Can't write %s\n", filename);
+    return FALSE;
+  }
+  out->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  out->info = out->png ? png_create_info_struct(out->png) : NULL;
+  if (!out->info || setjmp(png_jmpbuf(out->png))) {
+    fprintf(stderr, "Can't encode %s\n", filename);
+    png_destroy_write_struct(&out->png, &out->info);
+    fclose(out->fh);
+    out->fh = NULL;
+    return FALSE;
+  }
+
+  png_init_io(out->png, out->fh);
+  png_set_IHDR(out->png, out->info, width, height, 8, PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  // Mostly flat background, fast compression is good enough
+  png_set_compression_level(out->png, 3);
+  png_write_info(out->png, out->info);
+  return TRUE;
+}
+
+static gboolean sheet_png_write_band(SheetPng *out, SheetBand *band) {
+  if (setjmp(png_jmpbuf(out->png))) {
+    return FALSE;
+  }
+  gsize rowstride = png_get_rowbytes(out->png, out->info);
+  for (gint i = 0; i < SHEET_TILE_HEIGHT; i++) {
+    png_write_row(out->png, band->pixels + (gsize)i * rowstride);
+  }
+  return TRUE;
+}
+
+static gboolean sheet_png_close(SheetPng *out, gboolean ok) {
+  if (!out->fh) {
+    return FALSE;
+  }
+  if (ok && !setjmp(png_jmpbuf(out->png))) {
+    png_write_end(out->png, NULL);
+  } else {
+    ok = FALSE;
+  }
+  png_destroy_write_struct(&out->png, &out->info);
+  ok = fclose(out->fh) == 0 && ok;
+  out->fh = NULL;
+  return ok;
+}
+
+/* Name of a page: the file name itself for a single page, otherwise with the
+ * page number before the extension */
+gchar *contact_sheet_page_filename(const gchar *filename, gint page,
+                                   gint n_pages) {
+  if (n_pages <= 1) {
+    return g_strdup(filename);
+  }
+
+  gsize len = strlen(filename);
+  if (len > 4 && g_ascii_strcasecmp(filename + len - 4, ".png") == 0) {
+    len -= 4;
+  }
+  return g_strdup_printf("%.*s-%03d.png", (gint)len, filename, page + 1);
+}
+
+/* Writes n_tiles tiles in rows of columns into filename, or into numbered
+ * files of at most per_page tiles if per_page is positive; columns is then
+ * reduced to per_page if it is larger. Returns FALSE if a page could not be
+ * written or the export was stopped. */
+gboolean contact_sheet_write(const gchar *filename, gint n_tiles,
+                             gint columns, gint per_page,
+                             SheetTileFunc tile_func,
+                             SheetProgressFunc progress_func,
+                             gpointer user_data) {
+  if (n_tiles < 1 || columns < 1) {
+    return FALSE;
+  }
+  columns = MIN(columns, n_tiles);
+  if (per_page > 0) {
+    columns = MIN(columns, per_page);
+  }
+  // Whole rows per page
+  gint rows_per_page = per_page > 0 ? per_page / columns
+                                    : (n_tiles + columns - 1) / columns;
+  gint page_tiles = rows_per_page * columns;
+  gint n_pages = (n_tiles + page_tiles - 1) / page_tiles;
+  gint n_bands = (n_tiles + columns - 1) / columns;
+
+  Sheet sheet = {tile_func, user_data, (gsize)3 * columns * SHEET_TILE_WIDTH};
+  SheetBand bands[2];
+  for (gint k = 0; k < 2; k++) {
+    bands[k].pixels = g_malloc(sheet.rowstride * SHEET_TILE_HEIGHT);
+    g_mutex_init(&bands[k].lock);
+    g_cond_init(&bands[k].cond);
+  }
+  GThreadPool *pool = g_thread_pool_new(sheet_task_run, &sheet,
+                                        g_get_num_processors(), TRUE, NULL);
+
+  for (gint b = 0; b < MIN(2, n_bands); b++) {
+    sheet_band_start(bands + b, pool, b / rows_per_page, b * columns,
+                     MIN(columns, n_tiles - b * columns), sheet.rowstride);
+  }
+
+  SheetPng out = {NULL, NULL, NULL};
+  gboolean ok = TRUE;
+  gint page = -1;
+  for (gint b = 0; b < n_bands; b++) {
+    SheetBand *band = bands + b % 2;
+    sheet_band_wait(band);
+
+    if (ok && band->page != page) {
+      ok = page < 0 || sheet_png_close(&out, TRUE);
+      page = band->page;
+      gint rows = MIN(rows_per_page, n_bands - page * rows_per_page);
+      gchar *page_filename =
+          contact_sheet_page_filename(filename, page, n_pages);
+      ok = ok && sheet_png_open(&out, page_filename, sheet.rowstride / 3,
+                                rows * SHEET_TILE_HEIGHT);
+      g_free(page_filename);
+    }
+    ok = ok && sheet_png_write_band(&out, band);
+    ok = ok && (!progress_func ||
+                progress_func(band->first + band->n_tiles, n_tiles,
+                              user_data));
+
+    // Once failed, the bands in flight are only waited for
+    if (ok && b + 2 < n_bands) {
+      sheet_band_start(band, pool, (b + 2) / rows_per_page,
+                       (b + 2) * columns,
+                       MIN(columns, n_tiles - (b + 2) * columns),
+                       sheet.rowstride);
+    } else if (!ok && b + 1 < n_bands) {
+      sheet_band_wait(bands + (b + 1) % 2);
+      break;
+    }
+  }
+  ok = sheet_png_close(&out, ok) && ok;
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  for (gint k = 0; k < 2; k++) {
+    g_free(bands[k].pixels);
+    g_mutex_clear(&bands[k].lock);
+    g_cond_clear(&bands[k].cond);
+  }
+  return ok;
+}
+
+/* Fills the tile with a leveled thumbnail mapped through lut (256 RGB
+ * triplets from min to max of level), or in grayscale if lut is NULL */
+void sheet_tile_set_data(SheetTile *tile, const gdouble *thumb, gint width,
+                         gint height, const LevelResult *level,
+                         const guchar *lut) {
+  gdouble range = level->max - level->min;
+  gdouble scale = range > 0.0 ? 255.999 / range : 0.0;
+
+  tile->width = width;
+  tile->height = height;
+  tile->pixels = g_new(guchar, (gsize)3 * width * height);
+  for (gsize k = 0; k < (gsize)width * height; k++) {
+    gdouble v = (thumb[k] - level->min) * scale;
+    guint c = (guint)CLAMP(v, 0.0, 255.0);
+    if (lut) {
+      memcpy(tile->pixels + 3 * k, lut + 3 * c, 3);
+    } else {
+      tile->pixels[3 * k] = tile->pixels[3 * k + 1] =
+          tile->pixels[3 * k + 2] = c;
+    }
+  }
+}
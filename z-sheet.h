@@ -0,0 +1,55 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef Z_SHEET_H
+#define Z_SHEET_H
+
+#include <glib.h>
+
+#include "z-kernels.h"
+
+/* Contents of one tile, filled by a SheetTileFunc. Both pointers are freed
+ * by the sheet writer; a tile without pixels only shows its title. */
+typedef struct {
+  guchar *pixels; // RGB, 3 * width bytes per row
+  gint width;     // at most THUMBNAIL_SIZE
+  gint height;
+  gchar *title;
+} SheetTile;
+
+/* Called from worker threads, for every tile exactly once */
+typedef void (*SheetTileFunc)(gint index, SheetTile *tile,
+                              gpointer user_data);
+/* Called from the writing thread after every row of tiles; returning FALSE
+ * stops the export */
+typedef gboolean (*SheetProgressFunc)(gint done, gint n_tiles,
+                                      gpointer user_data);
+
+gboolean contact_sheet_write(const gchar *filename, gint n_tiles,
+                             gint columns, gint per_page,
+                             SheetTileFunc tile_func,
+                             SheetProgressFunc progress_func,
+                             gpointer user_data);
+gchar *contact_sheet_page_filename(const gchar *filename, gint page,
+                                   gint n_pages);
+void sheet_tile_set_data(SheetTile *tile, const gdouble *thumb, gint width,
+                         gint height, const LevelResult *level,
+                         const guchar *lut);
+
+#endif
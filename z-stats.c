@@ -0,0 +1,375 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Timing instrumentation of the module.
+ *
+ * Sections are timed with z_stats_begin() and z_stats_end(), from the main
+ * loop as well as from workers. Every section ends up as an event in a ring
+ * of the last Z_STATS_RING_SIZE events and in the totals of its stage, both
+ * behind one lock, and optionally as a line in a log file:
+ *
+ *   start_s  stage  duration_s  count
+ *
+ * with the start relative to z_stats_init(). Setting Z_MODULE_STATS_LOG to a
+ * file name records into that file from the start; otherwise recording is off
+ * until it is switched on in the Performance Stats window, and a disabled
+ * section costs one test of z_stats_enabled.
+ */
+
+#include "z-stats.h"
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define Z_STATS_RING_SIZE 4096
+#define Z_STATS_SHOWN_EVENTS 200
+#define Z_STATS_REFRESH_MS 500
+#define Z_STATS_LOG_ENV "Z_MODULE_STATS_LOG"
+
+typedef struct {
+  ZStatStage stage;
+  gint64 start; // in us, relative to stats_epoch
+  gint64 duration;
+  gint64 count;
+} ZStatEvent;
+
+typedef struct {
+  gint64 calls;
+  gint64 total; // in us
+  gint64 max;
+  gint64 count;
+} ZStatTotals;
+
+gint z_stats_enabled = 0;
+
+static GMutex stats_lock;
+static ZStatEvent stats_ring[Z_STATS_RING_SIZE];
+static guint64 stats_n_events; // ever recorded, the ring wraps around
+static ZStatTotals stats_totals[Z_STAT_N_STAGES];
+static FILE *stats_log;
+static gchar *stats_log_name;
+static gint64 stats_epoch;
+
+static const gchar *const stage_names[Z_STAT_N_STAGES] = {
+    "File load",        "Leveling",         "Thumbnails",   "Widgets",
+    "Drift estimation", "Drift correction", "Tracking",     "Sheet export",
+};
+
+/* Names in the log file */
+static const gchar *const stage_keys[Z_STAT_N_STAGES] = {
+    "file_load",      "level",       "thumbnail",   "widgets",
+    "drift_estimate", "drift_apply", "drift_track", "sheet_export",
+};
+
+void z_stats_record(ZStatStage stage, gint64 start, gint64 count) {
+  gint64 duration = g_get_monotonic_time() - start;
+
+  g_mutex_lock(&stats_lock);
+  ZStatEvent *event = stats_ring + stats_n_events++ % Z_STATS_RING_SIZE;
+  event->stage = stage;
+  event->start = start - stats_epoch;
+  event->duration = duration;
+  event->count = count;
+
+  ZStatTotals *totals = stats_totals + stage;
+  totals->calls++;
+  totals->total += duration;
+  totals->max = MAX(totals->max, duration);
+  totals->count += count;
+
+  if (stats_log) {
+    fprintf(stats_log, "%.6f\t%s\t%.6f\t%" G_GINT64_FORMAT "\n",
+            event->start * 1e-6, stage_keys[stage], duration * 1e-6, count);
+  }
+  g_mutex_unlock(&stats_lock);
+}
+
+/* Starts logging to filename, or stops it with NULL */
+static gboolean stats_set_log(const gchar *filename) {
+  FILE *fh = NULL;
+
+  if (filename && !(fh = fopen(filename, "a"))) {
+    fprintf(stderr, "Performance stats: can't open %s\n", filename);
+    return FALSE;
+  }
+  if (fh) {
+    setvbuf(fh, NULL, _IOLBF, 0);
+  }
+
+  g_mutex_lock(&stats_lock);
+  if (stats_log) {
+    fclose(stats_log);
+  }
+  stats_log = fh;
+  g_free(stats_log_name);
+  stats_log_name = g_strdup(filename);
+  g_mutex_unlock(&stats_lock);
+  return TRUE;
+}
+
+/* Called once when the module is registered */
+void z_stats_init(void) {
+  const gchar *filename = g_getenv(Z_STATS_LOG_ENV);
+
+  stats_epoch = g_get_monotonic_time();
+  if (filename && *filename && stats_set_log(filename)) {
+    g_atomic_int_set(&z_stats_enabled, 1);
+  }
+}
+
+static void stats_reset(void) {
+  g_mutex_lock(&stats_lock);
+  stats_n_events = 0;
+  memset(stats_totals, 0, sizeof(stats_totals));
+  g_mutex_unlock(&stats_lock);
+}
+
+/*
+ * The Performance Stats window.
+ *
+ * It shows the totals of every stage and the most recent events, copied out
+ * of the ring every Z_STATS_REFRESH_MS. There is at most one window.
+ */
+enum {
+  TOTALS_STAGE_COL,
+  TOTALS_CALLS_COL,
+  TOTALS_TOTAL_COL,
+  TOTALS_MEAN_COL,
+  TOTALS_MAX_COL,
+  TOTALS_COUNT_COL,
+  TOTALS_RATE_COL,
+  TOTALS_N_COLS,
+};
+
+enum {
+  EVENTS_START_COL,
+  EVENTS_STAGE_COL,
+  EVENTS_DURATION_COL,
+  EVENTS_COUNT_COL,
+  EVENTS_N_COLS,
+};
+
+typedef struct {
+  GtkWidget *window;
+  GtkListStore *totals;
+  GtkListStore *events;
+  GtkWidget *log_label;
+  guint refresh_id;
+} StatsWindow;
+
+static StatsWindow *stats_window = NULL;
+
+static gboolean stats_window_refresh(gpointer user_data) {
+  StatsWindow *sw = user_data;
+  ZStatTotals totals[Z_STAT_N_STAGES];
+  ZStatEvent events[Z_STATS_SHOWN_EVENTS];
+  gint n_shown;
+  gchar *log_name;
+
+  g_mutex_lock(&stats_lock);
+  memcpy(totals, stats_totals, sizeof(totals));
+  n_shown = (gint)MIN(stats_n_events, Z_STATS_SHOWN_EVENTS);
+  for (gint k = 0; k < n_shown; k++) {
+    events[k] = stats_ring[(stats_n_events - 1 - k) % Z_STATS_RING_SIZE];
+  }
+  log_name = g_strdup(stats_log_name);
+  g_mutex_unlock(&stats_lock);
+
+  gtk_list_store_clear(sw->totals);
+  for (gint s = 0; s < Z_STAT_N_STAGES; s++) {
+    GtkTreeIter iter;
+    gdouble total = totals[s].total * 1e-3;
+    gtk_list_store_append(sw->totals, &iter);
+    gtk_list_store_set(
+        sw->totals, &iter, TOTALS_STAGE_COL, stage_names[s], TOTALS_CALLS_COL,
+        (gint)totals[s].calls, TOTALS_TOTAL_COL, total, TOTALS_MEAN_COL,
+        totals[s].calls ? total / totals[s].calls : 0.0, TOTALS_MAX_COL,
+        totals[s].max * 1e-3, TOTALS_COUNT_COL, (gdouble)totals[s].count,
+        TOTALS_RATE_COL, total > 0.0 ? totals[s].count / total * 1e3 : 0.0,
+        -1);
+  }
+
+  gtk_list_store_clear(sw->events);
+  for (gint k = 0; k < n_shown; k++) {
+    GtkTreeIter iter;
+    gtk_list_store_append(sw->events, &iter);
+    gtk_list_store_set(sw->events, &iter, EVENTS_START_COL,
+                       events[k].start * 1e-6, EVENTS_STAGE_COL,
+                       stage_names[events[k].stage], EVENTS_DURATION_COL,
+                       events[k].duration * 1e-3, EVENTS_COUNT_COL,
+                       (gdouble)events[k].count, -1);
+  }
+
+  gtk_label_set_text(GTK_LABEL(sw->log_label),
+                     log_name ? log_name : "Not logging to a file");
+  g_free(log_name);
+  return TRUE;
+}
+
+static void on_stats_window_destroy(G_GNUC_UNUSED GtkWidget *window,
+                                    StatsWindow *sw) {
+  g_source_remove(sw->refresh_id);
+  g_object_unref(sw->totals);
+  g_object_unref(sw->events);
+  g_free(sw);
+  stats_window = NULL;
+}
+
+static void on_record_toggled(GtkToggleButton *button,
+                              G_GNUC_UNUSED gpointer user_data) {
+  g_atomic_int_set(&z_stats_enabled, gtk_toggle_button_get_active(button));
+}
+
+static void on_reset_clicked(G_GNUC_UNUSED GtkButton *button,
+                             StatsWindow *sw) {
+  stats_reset();
+  stats_window_refresh(sw);
+}
+
+static void on_log_clicked(G_GNUC_UNUSED GtkButton *button, StatsWindow *sw) {
+  GtkWidget *dialog = gtk_file_chooser_dialog_new(
+      "Log Performance Stats To", GTK_WINDOW(sw->window),
+      GTK_FILE_CHOOSER_ACTION_SAVE, GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+      GTK_STOCK_OK, GTK_RESPONSE_OK, NULL);
+
+  gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog),
+                                    "z-module-stats.tsv");
+  if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK) {
+    gchar *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+    stats_set_log(filename);
+    g_free(filename);
+  }
+  gtk_widget_destroy(dialog);
+  stats_window_refresh(sw);
+}
+
+static void on_stop_log_clicked(G_GNUC_UNUSED GtkButton *button,
+                                StatsWindow *sw) {
+  stats_set_log(NULL);
+  stats_window_refresh(sw);
+}
+
+/* Renders a double column with printf format */
+static void stats_format_cell(G_GNUC_UNUSED GtkTreeViewColumn *column,
+                              GtkCellRenderer *renderer, GtkTreeModel *model,
+                              GtkTreeIter *iter, gpointer user_data) {
+  gint col = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(renderer), "column"));
+  gdouble value;
+  gchar text[32];
+
+  gtk_tree_model_get(model, iter, col, &value, -1);
+  g_snprintf(text, sizeof(text), (const gchar *)user_data, value);
+  g_object_set(renderer, "text", text, NULL);
+}
+
+static void stats_add_column(GtkWidget *tree_view, const gchar *title,
+                             gint col, const gchar *format) {
+  GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+  GtkTreeViewColumn *column = gtk_tree_view_column_new();
+
+  gtk_tree_view_column_set_title(column, title);
+  gtk_tree_view_column_pack_start(column, renderer, TRUE);
+  if (format) {
+    g_object_set(renderer, "xalign", 1.0, NULL);
+    g_object_set_data(G_OBJECT(renderer), "column", GINT_TO_POINTER(col));
+    gtk_tree_view_column_set_cell_data_func(column, renderer,
+                                            stats_format_cell,
+                                            (gpointer)format, NULL);
+  } else {
+    gtk_tree_view_column_add_attribute(column, renderer, "text", col);
+  }
+  gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), column);
+}
+
+static GtkWidget *stats_scrolled(GtkWidget *child) {
+  GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+
+  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                 GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_container_add(GTK_CONTAINER(scrolled), child);
+  return scrolled;
+}
+
+void z_stats_window_show(void) {
+  if (stats_window) {
+    gtk_window_present(GTK_WINDOW(stats_window->window));
+    return;
+  }
+
+  StatsWindow *sw = g_new0(StatsWindow, 1);
+  sw->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title(GTK_WINDOW(sw->window), "Performance Stats");
+  gtk_window_set_default_size(GTK_WINDOW(sw->window), 700, 600);
+  GtkWidget *vbox = gtk_vbox_new(FALSE, 4);
+
+  GtkWidget *controls = gtk_hbox_new(FALSE, 4);
+  GtkWidget *record = gtk_check_button_new_with_label("Record");
+  gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(record),
+                               g_atomic_int_get(&z_stats_enabled));
+  g_signal_connect(record, "toggled", G_CALLBACK(on_record_toggled), NULL);
+  GtkWidget *reset = gtk_button_new_with_label("Reset");
+  g_signal_connect(reset, "clicked", G_CALLBACK(on_reset_clicked), sw);
+  GtkWidget *log = gtk_button_new_with_label("Log to File...");
+  g_signal_connect(log, "clicked", G_CALLBACK(on_log_clicked), sw);
+  GtkWidget *stop_log = gtk_button_new_with_label("Stop Logging");
+  g_signal_connect(stop_log, "clicked", G_CALLBACK(on_stop_log_clicked), sw);
+  sw->log_label = gtk_label_new(NULL);
+  gtk_box_pack_start(GTK_BOX(controls), record, FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(controls), reset, FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(controls), log, FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(controls), stop_log, FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(controls), sw->log_label, FALSE, FALSE, 4);
+
+  sw->totals = gtk_list_store_new(TOTALS_N_COLS, G_TYPE_STRING, G_TYPE_INT,
+                                  G_TYPE_DOUBLE, G_TYPE_DOUBLE, G_TYPE_DOUBLE,
+                                  G_TYPE_DOUBLE, G_TYPE_DOUBLE);
+  GtkWidget *totals = gtk_tree_view_new_with_model(GTK_TREE_MODEL(sw->totals));
+  stats_add_column(totals, "Stage", TOTALS_STAGE_COL, NULL);
+  stats_add_column(totals, "Calls", TOTALS_CALLS_COL, NULL);
+  stats_add_column(totals, "Total [ms]", TOTALS_TOTAL_COL, "%.1f");
+  stats_add_column(totals, "Mean [ms]", TOTALS_MEAN_COL, "%.2f");
+  stats_add_column(totals, "Max [ms]", TOTALS_MAX_COL, "%.2f");
+  stats_add_column(totals, "Items", TOTALS_COUNT_COL, "%.0f");
+  stats_add_column(totals, "Items/s", TOTALS_RATE_COL, "%.4g");
+
+  sw->events = gtk_list_store_new(EVENTS_N_COLS, G_TYPE_DOUBLE, G_TYPE_STRING,
+                                  G_TYPE_DOUBLE, G_TYPE_DOUBLE);
+  GtkWidget *events = gtk_tree_view_new_with_model(GTK_TREE_MODEL(sw->events));
+  stats_add_column(events, "Start [s]", EVENTS_START_COL, "%.3f");
+  stats_add_column(events, "Stage", EVENTS_STAGE_COL, NULL);
+  stats_add_column(events, "Duration [ms]", EVENTS_DURATION_COL, "%.2f");
+  stats_add_column(events, "Items", EVENTS_COUNT_COL, "%.0f");
+
+  gtk_box_pack_start(GTK_BOX(vbox), controls, FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(vbox), totals, FALSE, FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(vbox), gtk_label_new("Recent events"), FALSE,
+                     FALSE, 4);
+  gtk_box_pack_start(GTK_BOX(vbox), stats_scrolled(events), TRUE, TRUE, 4);
+  gtk_container_add(GTK_CONTAINER(sw->window), vbox);
+
+  stats_window = sw;
+  stats_window_refresh(sw);
+  sw->refresh_id =
+      g_timeout_add(Z_STATS_REFRESH_MS, stats_window_refresh, sw);
+  g_signal_connect(sw->window, "destroy", G_CALLBACK(on_stats_window_destroy),
+                   sw);
+  gtk_widget_show_all(sw->window);
+}
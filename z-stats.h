@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2024 Matthias Krinninger
+ *  E-mail: matrkin@protonmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef Z_STATS_H
+#define Z_STATS_H
+
+#include <glib.h>
+
+/* Stages of the module that are timed */
+typedef enum {
+  Z_STAT_FILE_LOAD,
+  Z_STAT_LEVEL,
+  Z_STAT_THUMBNAIL,
+  Z_STAT_WIDGETS,
+  Z_STAT_DRIFT_ESTIMATE,
+  Z_STAT_DRIFT_APPLY,
+  Z_STAT_DRIFT_TRACK,
+  Z_STAT_SHEET_EXPORT,
+  Z_STAT_N_STAGES,
+} ZStatStage;
+
+/* Non-zero while recording; only ever read without a lock */
+extern gint z_stats_enabled;
+
+/* Start of a timed section, 0 while recording is off */
+static inline gint64 z_stats_begin(void) {
+  return G_UNLIKELY(z_stats_enabled) ? g_get_monotonic_time() : 0;
+}
+
+void z_stats_record(ZStatStage stage, gint64 start, gint64 count);
+
+/* Ends a section started by z_stats_begin(); count is the number of items
+ * (pixels, files, ...) it processed. Costs a single test while disabled. */
+#define z_stats_end(stage, start, count)                                       \
+  do {                                                                         \
+    if (G_UNLIKELY(start)) {                                                   \
+      z_stats_record((stage), (start), (count));                               \
+    }                                                                          \
+  } while (0)
+
+void z_stats_init(void);
+void z_stats_window_show(void);
+
+#endif